@@ -0,0 +1,202 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * A result and everything hanging off it are carved out of one block: the
+ * result itself, the RR arrays, names, strings, EDNS options and glue.  The
+ * block is sized up front from the message, so a result is normally built
+ * with a single malloc( ) and released with a single free( ).  If the
+ * estimate turns out to be short, overflow chunks are chained off the block.
+ *
+ * Blocks handed back with dnsr_release_result( ) are kept on a short free
+ * list in the handle and reused for later results, so a handle doing one
+ * lookup after another settles into not allocating at all.  Pooled blocks
+ * are sized in whole chunks so that one block fits most responses.
+ */
+
+#define DNSR_ARENA_ALIGN sizeof(void *)
+#define DNSR_ARENA_CHUNK 4096
+#define DNSR_ARENA_ROUND(x)                                                    \
+    (((x) + DNSR_ARENA_ALIGN - 1) & ~(DNSR_ARENA_ALIGN - 1))
+#define DNSR_ARENA_POOL 8 /* Most blocks a handle keeps for reuse */
+
+struct dnsr_chunk {
+    struct dnsr_chunk *c_next;
+};
+
+static void *dnsr_arena_get(DNSR *, struct dnsr_result *, size_t, int);
+
+struct dnsr_result *
+dnsr_arena_new(DNSR *dnsr, size_t size) {
+    struct dnsr_result_block *rb, **prev;
+    size_t                    header;
+
+    header = DNSR_ARENA_ROUND(sizeof(struct dnsr_result_block));
+    size = header + size;
+    size = ((size + DNSR_ARENA_CHUNK - 1) / DNSR_ARENA_CHUNK) * DNSR_ARENA_CHUNK;
+
+    for (prev = &dnsr->d_pool; *prev != NULL; prev = &(*prev)->rb_next) {
+        if ((*prev)->rb_size >= size) {
+            break;
+        }
+    }
+
+    if ((rb = *prev) != NULL) {
+        *prev = rb->rb_next;
+        dnsr->d_poolcount--;
+        size = rb->rb_size;
+    } else {
+        if (dnsr->d_pool != NULL) {
+            /* Nothing pooled is big enough, make room for a bigger block */
+            rb = dnsr->d_pool;
+            dnsr->d_pool = rb->rb_next;
+            dnsr->d_poolcount--;
+            free(rb);
+        }
+        if ((rb = malloc(size)) == NULL) {
+            DEBUG(perror("malloc"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (NULL);
+        }
+    }
+
+    memset(rb, 0, sizeof(struct dnsr_result_block));
+    rb->rb_size = size;
+    rb->rb_cur = (char *)rb + header;
+    rb->rb_end = (char *)rb + size;
+
+    return (&rb->rb_result);
+}
+
+static void *
+dnsr_arena_get(DNSR *dnsr, struct dnsr_result *result, size_t size, int align) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    struct dnsr_chunk        *c;
+    size_t                    header, csize;
+    char                     *p;
+
+    p = rb->rb_cur;
+    if (align) {
+        p = (char *)DNSR_ARENA_ROUND((uintptr_t)p);
+    }
+
+    if ((p > rb->rb_end) || (size > (size_t)(rb->rb_end - p))) {
+        DEBUG(fprintf(stderr, "arena: %zu bytes: new chunk\n", size));
+        header = DNSR_ARENA_ROUND(sizeof(struct dnsr_chunk));
+        csize = header + MAX(size, DNSR_ARENA_CHUNK);
+        if ((c = malloc(csize)) == NULL) {
+            DEBUG(perror("malloc"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (NULL);
+        }
+        c->c_next = rb->rb_chunks;
+        rb->rb_chunks = c;
+        p = (char *)c + header;
+        rb->rb_end = (char *)c + csize;
+    }
+
+    rb->rb_cur = p + size;
+    return (p);
+}
+
+void *
+dnsr_arena_alloc(DNSR *dnsr, struct dnsr_result *result, size_t size) {
+    return (dnsr_arena_get(dnsr, result, size, 1));
+}
+
+void *
+dnsr_arena_calloc(DNSR *dnsr, struct dnsr_result *result, size_t size) {
+    void *p;
+
+    if ((p = dnsr_arena_get(dnsr, result, size, 1)) != NULL) {
+        memset(p, 0, size);
+    }
+    return (p);
+}
+
+char *
+dnsr_arena_strndup(
+        DNSR *dnsr, struct dnsr_result *result, const char *s, size_t len) {
+    char *p;
+
+    if ((p = dnsr_arena_get(dnsr, result, len + 1, 0)) != NULL) {
+        memcpy(p, s, len);
+        p[ len ] = '\0';
+    }
+    return (p);
+}
+
+void
+dnsr_arena_free(struct dnsr_result *result) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    struct dnsr_chunk        *c, *next;
+
+    for (c = rb->rb_chunks; c != NULL; c = next) {
+        next = c->c_next;
+        free(c);
+    }
+    free(rb);
+}
+
+/*
+ * Hands a result back to the handle it came from for reuse.  Like
+ * dnsr_free_result( ), the result and everything in it are gone after this.
+ */
+
+void
+dnsr_release_result(DNSR *dnsr, struct dnsr_result *result) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    struct dnsr_chunk        *c, *next;
+
+    if (result == NULL) {
+        return;
+    }
+
+    if (dnsr->d_poolcount >= DNSR_ARENA_POOL) {
+        dnsr_arena_free(result);
+        return;
+    }
+
+    for (c = rb->rb_chunks; c != NULL; c = next) {
+        next = c->c_next;
+        free(c);
+    }
+    rb->rb_next = dnsr->d_pool;
+    dnsr->d_pool = rb;
+    dnsr->d_poolcount++;
+}
+
+/*
+ * Releases the blocks and buffers a handle is keeping for reuse.  Done by
+ * dnsr_free( ), but a long-lived handle can shed them at any time.
+ */
+
+void
+dnsr_free_pool(DNSR *dnsr) {
+    struct dnsr_result_block *rb;
+
+    while ((rb = dnsr->d_pool) != NULL) {
+        dnsr->d_pool = rb->rb_next;
+        free(rb);
+    }
+    dnsr->d_poolcount = 0;
+
+    free(dnsr->d_tcpbuf);
+    dnsr->d_tcpbuf = NULL;
+    dnsr->d_tcpbufsize = 0;
+    free(dnsr->d_recvq);
+    dnsr->d_recvq = NULL;
+}
@@ -7,6 +7,7 @@
  * Return parsed argc/argv from the net.
  */
 
+#include <errno.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/param.h>
@@ -16,7 +17,6 @@
 #define ACV_ARGC 10
 #define ACV_WHITE 0
 #define ACV_WORD 1
-static ACAV *acavg = NULL;
 
 ACAV *
 acav_alloc(void) {
@@ -36,7 +36,8 @@ acav_alloc(void) {
 }
 
 /*
- * acav->acv_argv = **argv[] if passed an ACAV
+ * acav->acv_argv = **argv[].  There is no shared default ACAV, each caller
+ * brings its own so that parsing is safe across threads.
  */
 
 int
@@ -45,12 +46,8 @@ acav_parse(ACAV *acav, char *line, char **argv[]) {
     int state;
 
     if (acav == NULL) {
-        if (acavg == NULL) {
-            if ((acavg = acav_alloc()) == NULL) {
-                return (-1);
-            }
-        }
-        acav = acavg;
+        errno = EINVAL;
+        return (-1);
     }
 
     ac = 0;
@@ -1,9 +1,7 @@
 #ifndef DENSER_ARGCARGV_H
 #define DENSER_ARGCARGV_H
 
-#define argcargv(X, Y) (acav_parse(NULL, X, Y))
-
-typedef struct {
+typedef struct acav {
     unsigned acv_argc;
     char   **acv_argv;
 } ACAV;
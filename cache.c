@@ -0,0 +1,529 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * A DNSR_CACHE holds good responses for any number of handles, in any
+ * number of threads, for as long as the smallest TTL in their answer.
+ * NXDOMAIN and NODATA responses are held for as long as the SOA in their
+ * authority section says ( RFC 2308 5 ), and not at all without one.  It
+ * is split into DNSR_CACHE_SHARDS shards by the hash of the question, each
+ * with its own lock and hash table, so that threads seldom wait on each
+ * other.  A full shard drops its oldest entry.  dnsr_cache_shm_new( ) makes
+ * one that lives in shared memory instead, see shm.c.
+ *
+ * Entries are whole response messages, keyed by their question, so that a
+ * hit is parsed like any response, with the options of the handle that
+ * asked.  Before that, the TTLs in a copy of the message are lowered by the
+ * time it has been in the cache.  Lookups are made as a query starts, and
+ * again for each name a CNAME chain leads to.
+ */
+
+#define DNSR_CACHE_SHARDS 16     /* Power of 2 */
+#define DNSR_CACHE_MAX_MSG 4096  /* Larger responses are not cached */
+#define DNSR_CACHE_MAX_TTL 86400 /* Longest an entry is kept */
+#define DNSR_CACHE_MAX_NEG 10800 /* Longest a negative one is, RFC 2308 5 */
+
+struct dnsr_centry {
+    struct dnsr_centry *ce_hnext; /* hash chain */
+    struct dnsr_centry *ce_next;  /* shard's entries, oldest first */
+    struct dnsr_centry *ce_prev;
+    uint32_t            ce_hash;
+    time_t              ce_stored;  /* TTLs in ce_msg count from here */
+    time_t              ce_expires;
+    unsigned int        ce_questionlen;
+    unsigned int        ce_msglen;
+    char               *ce_msg; /* follows the entry */
+};
+
+struct dnsr_cache_shard {
+    pthread_mutex_t      s_lock;
+    struct dnsr_centry **s_table;
+    unsigned int         s_mask; /* buckets - 1 */
+    unsigned int         s_count;
+    unsigned int         s_max;
+    struct dnsr_centry  *s_oldest;
+    struct dnsr_centry  *s_newest;
+};
+
+struct dnsr_cache {
+    struct dnsr_shm        *c_shm; /* instead of the shards, see shm.c */
+    struct dnsr_cache_shard c_shards[ DNSR_CACHE_SHARDS ];
+};
+
+static uint32_t dnsr_cache_hash(const char *, unsigned int);
+static int      dnsr_cache_match(
+             struct dnsr_centry *, uint32_t, const char *, unsigned int);
+static struct dnsr_centry **dnsr_cache_find(
+        struct dnsr_cache_shard *, uint32_t, const char *, unsigned int);
+static void dnsr_cache_unlink(
+        struct dnsr_cache_shard *, struct dnsr_centry **);
+static int dnsr_cache_ttl(DNSR *, char *, unsigned int, unsigned int, time_t,
+        uint32_t *, uint32_t *, int *);
+
+/*
+ * Makes a cache of at most size responses.  It is shared by attaching it
+ * to handles with dnsr_config_cache( ), and must outlive them.
+ *
+ * Return Values:
+ *      DNSR_CACHE *    success
+ *      NULL            error - check errno
+ */
+
+DNSR_CACHE *
+dnsr_cache_new(int size) {
+    DNSR_CACHE              *cache;
+    struct dnsr_cache_shard *s;
+    unsigned int             buckets;
+    int                      i;
+
+    if (size < DNSR_CACHE_SHARDS) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    if ((cache = calloc(1, sizeof(DNSR_CACHE))) == NULL) {
+        return (NULL);
+    }
+
+    /* About one entry per bucket when full */
+    for (buckets = 1; buckets < size / DNSR_CACHE_SHARDS; buckets <<= 1)
+        ;
+    for (i = 0; i < DNSR_CACHE_SHARDS; i++) {
+        s = &cache->c_shards[ i ];
+        if ((s->s_table = calloc(buckets, sizeof(struct dnsr_centry *))) ==
+                NULL) {
+            while (--i >= 0) {
+                pthread_mutex_destroy(&cache->c_shards[ i ].s_lock);
+                free(cache->c_shards[ i ].s_table);
+            }
+            free(cache);
+            return (NULL);
+        }
+        s->s_mask = buckets - 1;
+        s->s_max = size / DNSR_CACHE_SHARDS;
+        pthread_mutex_init(&s->s_lock, NULL);
+    }
+
+    return (cache);
+}
+
+/*
+ * Makes a cache of about size responses, as dnsr_cache_new( ) does, in
+ * memory shared with the processes forked after it, see shm.c.  Each
+ * process frees its own with dnsr_cache_free( ).
+ *
+ * Return Values:
+ *      DNSR_CACHE *    success
+ *      NULL            error - check errno
+ */
+
+DNSR_CACHE *
+dnsr_cache_shm_new(int size) {
+    DNSR_CACHE *cache;
+
+    if (size < 1) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    if ((cache = calloc(1, sizeof(DNSR_CACHE))) == NULL) {
+        return (NULL);
+    }
+    if ((cache->c_shm = dnsr_shm_new(size)) == NULL) {
+        free(cache);
+        return (NULL);
+    }
+
+    return (cache);
+}
+
+/* No handle may be using cache */
+void
+dnsr_cache_free(DNSR_CACHE *cache) {
+    struct dnsr_cache_shard *s;
+    struct dnsr_centry      *ce;
+    int                      i;
+
+    if (cache == NULL) {
+        return;
+    }
+
+    if (cache->c_shm != NULL) {
+        dnsr_shm_free(cache->c_shm);
+        free(cache);
+        return;
+    }
+
+    for (i = 0; i < DNSR_CACHE_SHARDS; i++) {
+        s = &cache->c_shards[ i ];
+        while ((ce = s->s_oldest) != NULL) {
+            s->s_oldest = ce->ce_next;
+            free(ce);
+        }
+        free(s->s_table);
+        pthread_mutex_destroy(&s->s_lock);
+    }
+    free(cache);
+}
+
+/*
+ * Has dnsr answer from cache, and fill it, from then on.  NULL stops it.
+ *
+ * Return Values:
+ *      0       success
+ */
+
+int
+dnsr_config_cache(DNSR *dnsr, DNSR_CACHE *cache) {
+    dnsr->d_cache = cache;
+    return 0;
+}
+
+/*
+ * Answers p, which has just been built, from the cache.  A cached CNAME is
+ * followed as if it had come from the network, which sends p on its way.
+ *
+ * Return Values:
+ *      1       p is answered, or in flight for the end of a CNAME chain
+ *      0       not cached, p is to be sent
+ */
+
+int
+dnsr_cache_answer(DNSR *dnsr, struct dnsr_pending *p) {
+    struct dnsr_cache_shard *s;
+    struct dnsr_centry     **cep, *ce, *dead = NULL;
+    struct dnsr_result      *result;
+    struct timeval           now;
+    char                     msg[ DNSR_CACHE_MAX_MSG ];
+    char                    *key = p->p_query + sizeof(struct dnsr_header);
+    unsigned int             keylen, msglen = 0;
+    uint32_t                 hash;
+    time_t                   stored, age = 0;
+
+    if (gettimeofday(&now, NULL) < 0) {
+        return 0;
+    }
+
+    keylen = p->p_questionlen - sizeof(struct dnsr_header);
+    hash = dnsr_cache_hash(key, keylen);
+
+    if (dnsr->d_cache->c_shm != NULL) {
+        if ((msglen = dnsr_shm_get(dnsr->d_cache->c_shm, hash, key, keylen,
+                     now.tv_sec, msg, &stored)) > 0) {
+            age = now.tv_sec - stored;
+        }
+    } else {
+        s = &dnsr->d_cache->c_shards[ hash & (DNSR_CACHE_SHARDS - 1) ];
+
+        pthread_mutex_lock(&s->s_lock);
+        if ((cep = dnsr_cache_find(s, hash, key, keylen)) != NULL) {
+            ce = *cep;
+            if (now.tv_sec >= ce->ce_expires) {
+                dnsr_cache_unlink(s, cep);
+                dead = ce;
+            } else {
+                memcpy(msg, ce->ce_msg, ce->ce_msglen);
+                msglen = ce->ce_msglen;
+                age = now.tv_sec - ce->ce_stored;
+            }
+        }
+        pthread_mutex_unlock(&s->s_lock);
+        free(dead);
+    }
+
+    if (msglen == 0) {
+        return 0;
+    }
+    DEBUG(fprintf(stderr, "cache_answer: hit, %ld sec old\n", (long)age));
+    dnsr->d_nsresp = -1;
+
+    if ((dnsr_cache_ttl(dnsr, msg, msglen, p->p_questionlen, age, NULL,
+                 NULL, NULL) != 0) ||
+            ((result = dnsr_create_result(
+                      dnsr, msg, msglen, p->p_questionlen)) == NULL)) {
+        dnsr->d_errno = DNSR_ERROR_NONE;
+        return 0;
+    }
+    ((struct dnsr_result_block *)result)->rb_querytime = now;
+    if (dnsr_match_additional(dnsr, result) != 0) {
+        dnsr_release_result(dnsr, result);
+        dnsr->d_errno = DNSR_ERROR_NONE;
+        return 0;
+    }
+
+    if (dnsr_cname_follow(dnsr, p, result) == 0) {
+        dnsr_pending_done(dnsr, p, result, DNSR_ERROR_NONE);
+    }
+    return 1;
+}
+
+/*
+ * Keeps result, a good or NXDOMAIN response to p, if it may be.
+ */
+
+void
+dnsr_cache_put(DNSR *dnsr, struct dnsr_pending *p, struct dnsr_result *result) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    struct dnsr_header       *h = (struct dnsr_header *)rb->rb_msg;
+    struct dnsr_cache_shard  *s;
+    struct dnsr_centry      **cep, *ce, *dead = NULL, *old = NULL;
+    char                     *key;
+    unsigned int              keylen;
+    uint32_t                  ttl, soa;
+    int                       answered;
+
+    if (((result->r_rcode != DNSR_RC_OK) &&
+                (result->r_rcode != DNSR_RC_NXDOMAIN)) ||
+            (ntohs(h->h_flags) & DNSR_TRUNCATION) ||
+            (rb->rb_msglen > DNSR_CACHE_MAX_MSG)) {
+        return;
+    }
+    if (dnsr_cache_ttl(dnsr, rb->rb_msg, rb->rb_msglen, p->p_questionlen, 0,
+                &ttl, &soa, &answered) != 0) {
+        dnsr->d_errno = DNSR_ERROR_NONE;
+        return;
+    }
+    /* NODATA may follow a CNAME, and without an SOA soa is 0 */
+    if ((result->r_rcode == DNSR_RC_NXDOMAIN) || !answered) {
+        /* A CNAME in front of a negative answer may end sooner */
+        ttl = MIN(ttl, MIN(soa, DNSR_CACHE_MAX_NEG));
+    }
+    if (ttl == 0) {
+        return;
+    }
+
+    if (dnsr->d_cache->c_shm != NULL) {
+        key = rb->rb_msg + sizeof(struct dnsr_header);
+        keylen = p->p_questionlen - sizeof(struct dnsr_header);
+        dnsr_shm_put(dnsr->d_cache->c_shm, dnsr_cache_hash(key, keylen),
+                rb->rb_msg, rb->rb_msglen, p->p_questionlen,
+                rb->rb_querytime.tv_sec, rb->rb_querytime.tv_sec + ttl);
+        return;
+    }
+
+    if ((ce = malloc(sizeof(struct dnsr_centry) + rb->rb_msglen)) == NULL) {
+        DEBUG(perror("malloc"));
+        return;
+    }
+    ce->ce_msg = (char *)(ce + 1);
+    memcpy(ce->ce_msg, rb->rb_msg, rb->rb_msglen);
+    ce->ce_msglen = rb->rb_msglen;
+    ce->ce_questionlen = p->p_questionlen;
+    ce->ce_stored = rb->rb_querytime.tv_sec;
+    ce->ce_expires = ce->ce_stored + ttl;
+
+    key = ce->ce_msg + sizeof(struct dnsr_header);
+    keylen = p->p_questionlen - sizeof(struct dnsr_header);
+    ce->ce_hash = dnsr_cache_hash(key, keylen);
+    s = &dnsr->d_cache->c_shards[ ce->ce_hash & (DNSR_CACHE_SHARDS - 1) ];
+
+    pthread_mutex_lock(&s->s_lock);
+    if ((cep = dnsr_cache_find(s, ce->ce_hash, key, keylen)) != NULL) {
+        dead = *cep;
+        dnsr_cache_unlink(s, cep);
+    } else if (s->s_count >= s->s_max) {
+        old = s->s_oldest;
+        dnsr_cache_unlink(s,
+                dnsr_cache_find(s, old->ce_hash,
+                        old->ce_msg + sizeof(struct dnsr_header),
+                        old->ce_questionlen - sizeof(struct dnsr_header)));
+    }
+
+    ce->ce_hnext = s->s_table[ (ce->ce_hash / DNSR_CACHE_SHARDS) & s->s_mask ];
+    s->s_table[ (ce->ce_hash / DNSR_CACHE_SHARDS) & s->s_mask ] = ce;
+    ce->ce_next = NULL;
+    if ((ce->ce_prev = s->s_newest) != NULL) {
+        s->s_newest->ce_next = ce;
+    } else {
+        s->s_oldest = ce;
+    }
+    s->s_newest = ce;
+    s->s_count++;
+    pthread_mutex_unlock(&s->s_lock);
+
+    free(dead);
+    free(old);
+}
+
+/* FNV-1a of the question, names compare without case */
+static uint32_t
+dnsr_cache_hash(const char *key, unsigned int len) {
+    uint32_t     hash = 2166136261U;
+    unsigned int i;
+    uint8_t      c;
+
+    for (i = 0; i < len; i++) {
+        c = key[ i ];
+        if ((c >= 'A') && (c <= 'Z')) {
+            c += 'a' - 'A';
+        }
+        hash = (hash ^ c) * 16777619U;
+    }
+    return (hash);
+}
+
+static int
+dnsr_cache_match(struct dnsr_centry *ce, uint32_t hash, const char *key,
+        unsigned int len) {
+    return ((ce->ce_hash == hash) &&
+            (ce->ce_questionlen - sizeof(struct dnsr_header) == len) &&
+            dnsr_cache_samekey(
+                    ce->ce_msg + sizeof(struct dnsr_header), key, len));
+}
+
+/* Compares two questions of len octets, names without case */
+int
+dnsr_cache_samekey(const char *k1, const char *k2, unsigned int len) {
+    unsigned int i;
+    uint8_t      a, b;
+
+    /* Length octets are below 'A', and don't change */
+    for (i = 0; i < len; i++) {
+        a = k1[ i ];
+        b = k2[ i ];
+        if ((a >= 'A') && (a <= 'Z')) {
+            a += 'a' - 'A';
+        }
+        if ((b >= 'A') && (b <= 'Z')) {
+            b += 'a' - 'A';
+        }
+        if (a != b) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/* Returns the link to the entry for key, with s locked */
+static struct dnsr_centry **
+dnsr_cache_find(struct dnsr_cache_shard *s, uint32_t hash, const char *key,
+        unsigned int len) {
+    struct dnsr_centry **cep;
+
+    for (cep = &s->s_table[ (hash / DNSR_CACHE_SHARDS) & s->s_mask ];
+            *cep != NULL; cep = &(*cep)->ce_hnext) {
+        if (dnsr_cache_match(*cep, hash, key, len)) {
+            return (cep);
+        }
+    }
+    return (NULL);
+}
+
+/* Takes the entry cep links to out of s, with s locked */
+static void
+dnsr_cache_unlink(struct dnsr_cache_shard *s, struct dnsr_centry **cep) {
+    struct dnsr_centry *ce = *cep;
+
+    *cep = ce->ce_hnext;
+    if (ce->ce_prev != NULL) {
+        ce->ce_prev->ce_next = ce->ce_next;
+    } else {
+        s->s_oldest = ce->ce_next;
+    }
+    if (ce->ce_next != NULL) {
+        ce->ce_next->ce_prev = ce->ce_prev;
+    } else {
+        s->s_newest = ce->ce_prev;
+    }
+    s->s_count--;
+}
+
+/*
+ * Walks the RRs of msg, lowering every TTL by age, and puts the smallest
+ * TTL in the answer section in min, and the lesser of the TTL and MINIMUM
+ * of the first SOA in the authority section in soa, or 0 if there is none.
+ * answered is set if the answer section holds an RR of the type and class
+ * asked for, which only the end of a CNAME chain can.  TTLs with the top
+ * bit set count as 0 ( RFC 2181 8 ).  The OPT RR has no TTL.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+static int
+dnsr_cache_ttl(DNSR *dnsr, char *msg, unsigned int msglen, unsigned int first,
+        time_t age, uint32_t *min, uint32_t *soa, int *answered) {
+    struct dnsr_header *h = (struct dnsr_header *)msg;
+    char               *cur = msg + first, *end = msg + msglen;
+    unsigned int        i, count, ancount, nscount;
+    uint16_t            type, class, rdlength, qtype, qclass;
+    uint32_t            ttl, minimum;
+
+    /* The question ends with its type and class */
+    memcpy(&qtype, msg + first - 4, sizeof(qtype));
+    memcpy(&qclass, msg + first - 2, sizeof(qclass));
+    qtype = ntohs(qtype);
+    qclass = ntohs(qclass);
+    if (answered != NULL) {
+        *answered = 0;
+    }
+
+    ancount = ntohs(h->h_ancount);
+    nscount = ntohs(h->h_nscount);
+    count = ancount + nscount + ntohs(h->h_arcount);
+    if (min != NULL) {
+        *min = DNSR_CACHE_MAX_TTL;
+    }
+    if (soa != NULL) {
+        *soa = 0;
+    }
+
+    for (i = 0; i < count; i++) {
+        if ((dnsr_skip_name(dnsr, msg, &cur, msglen) != 0) ||
+                (dnsr_parse_header(dnsr, &cur, end, &type, &class, &ttl,
+                         &rdlength) != 0)) {
+            return (-1);
+        }
+        if (cur + rdlength > end) {
+            DEBUG(fprintf(stderr, "cache_ttl: invalid rdlength\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+        if (type != DNSR_TYPE_OPT) {
+            if (ttl & 0x80000000) {
+                ttl = 0;
+            }
+            if ((min != NULL) && (i < ancount) && (ttl < *min)) {
+                *min = ttl;
+            }
+            if ((answered != NULL) && (i < ancount) && (class == qclass) &&
+                    ((type == qtype) || (qtype == DNSR_TYPE_ALL))) {
+                *answered = 1;
+            }
+            /* MINIMUM ends the RDATA, after two names and four counts */
+            if ((soa != NULL) && (*soa == 0) && (type == DNSR_TYPE_SOA) &&
+                    (i >= ancount) && (i < ancount + nscount) &&
+                    (rdlength >= 2 + 5 * sizeof(uint32_t))) {
+                memcpy(&minimum, cur + rdlength - sizeof(uint32_t),
+                        sizeof(uint32_t));
+                minimum = ntohl(minimum);
+                *soa = MIN(ttl, minimum);
+            }
+            if (age > 0) {
+                ttl = htonl((ttl > age) ? ttl - age : 0);
+                /* TTL and RD Length were just read */
+                memcpy(cur - sizeof(uint32_t) - sizeof(uint16_t), &ttl,
+                        sizeof(uint32_t));
+            }
+        }
+        cur += rdlength;
+    }
+
+    return 0;
+}
@@ -0,0 +1,257 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * With CNAME following on, a response whose answer is a CNAME chain that
+ * stops short of the records asked for doesn't finish its query.  The chain
+ * is walked as far as the message goes, and the query is asked again, under
+ * a new ID, for the name at the end of it, so only the missing tail costs a
+ * round trip.  The response is kept on the query, and the CNAMEs in it are
+ * copied into the next one, so the result the caller gets holds the whole
+ * chain followed by the final records.
+ *
+ * The chain is carried in r_answer.  A cursor walks only the message of the
+ * last response, so with DNSR_FLAG_LAZY the result holds the final records
+ * without the CNAMEs that came before.
+ */
+
+static int dnsr_cname_merge(
+        DNSR *, struct dnsr_result *, struct dnsr_result *);
+static int dnsr_cname_tail(
+        DNSR *, struct dnsr_pending *, struct dnsr_result *, char *);
+
+/*
+ * dnsr_config_cname sets how many CNAMEs a query follows before it gives
+ * up and returns the chain as far as it got.  0 turns following off.
+ * DNSR_FLAG_CNAME turns it on with a depth of DNSR_CNAME_DEPTH.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_config_cname(DNSR *dnsr, int depth) {
+    if ((depth < 0) || (depth > DNSR_MAX_CNAME)) {
+        DEBUG(fprintf(stderr, "dnsr_config_cname: %d: bad depth\n", depth));
+        dnsr->d_errno = DNSR_ERROR_CONFIG;
+        return (-1);
+    }
+    dnsr->d_cnamedepth = depth;
+    return 0;
+}
+
+/*
+ * Called with a good response for p.  If it ends in a CNAME to be followed,
+ * the query is asked again for the target and result is kept for later.
+ * Otherwise the chain so far is added to result, which finishes p.
+ *
+ * Return Values:
+ *      1       result is p's, which is in flight, or answered from the cache
+ *      0       result is the answer to p
+ */
+
+int
+dnsr_cname_follow(
+        DNSR *dnsr, struct dnsr_pending *p, struct dnsr_result *result) {
+    char name[ DNSR_MAX_NAME + 1 ];
+
+    if (p->p_chain != NULL) {
+        if (dnsr_cname_merge(dnsr, p->p_chain, result) != 0) {
+            DEBUG(fprintf(stderr, "cname_follow: chain dropped\n"));
+            dnsr->d_errno = DNSR_ERROR_NONE;
+        }
+        dnsr_release_result(dnsr, p->p_chain);
+        p->p_chain = NULL;
+    }
+
+    if ((dnsr->d_cnamedepth == 0) ||
+            (dnsr_cname_tail(dnsr, p, result, name) != 1)) {
+        return 0;
+    }
+
+    DEBUG(fprintf(stderr, "cname_follow: asking for %s\n", name));
+    /* Set first, a cached answer follows on before the restart returns */
+    p->p_chain = result;
+    if (dnsr_query_restart(dnsr, p, name) != 0) {
+        /* Return the chain as far as it goes */
+        DEBUG(dnsr_perror(dnsr, "dnsr_query_restart"));
+        dnsr->d_errno = DNSR_ERROR_NONE;
+        p->p_chain = NULL;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * Walks the CNAMEs in the answer of result from the name p asked for.  If
+ * the chain ends without the type asked for, its last name is put in name.
+ * An SOA in the authority section means the server followed the chain and
+ * found nothing at its end, NODATA, so it is not asked again.
+ *
+ * Return Values:
+ *      1       name should be asked for
+ *      0       the answer is complete, or as long as it may get
+ */
+
+static int
+dnsr_cname_tail(DNSR *dnsr, struct dnsr_pending *p,
+        struct dnsr_result *result, char *name) {
+    struct dnsr_cursor c;
+    char               owner[ DNSR_MAX_NAME + 1 ];
+    char              *cur, *dn;
+    uint16_t           qtype, qclass;
+    int                found, hops = 0;
+
+    if (result->r_rcode != DNSR_RC_OK) {
+        return 0;
+    }
+
+    memcpy(&qtype, &p->p_query[ p->p_questionlen - 4 ], sizeof(qtype));
+    memcpy(&qclass, &p->p_query[ p->p_questionlen - 2 ], sizeof(qclass));
+    qtype = ntohs(qtype);
+    qclass = ntohs(qclass);
+    if ((qtype == DNSR_TYPE_CNAME) || (qtype == DNSR_TYPE_ALL)) {
+        return 0;
+    }
+
+    cur = &p->p_query[ sizeof(struct dnsr_header) ];
+    dn = name;
+    if (dnsr_labels_to_name(dnsr, p->p_query, &cur, p->p_questionlen, name,
+                &dn, name + DNSR_MAX_NAME) != 0) {
+        dnsr->d_errno = DNSR_ERROR_NONE;
+        return 0;
+    }
+
+    /* The chain may be in any order, go round until it stops growing */
+    do {
+        found = 0;
+        dnsr_cursor_init(&c, result);
+        while ((dnsr_rr_next(dnsr, &c) == 1) &&
+                (dnsr_cursor_section(&c) == DNSR_SECTION_ANSWER)) {
+            if ((dnsr_cursor_class(&c) != qclass) ||
+                    (dnsr_cursor_name(dnsr, &c, owner, sizeof(owner)) != 0) ||
+                    (strcasecmp(owner, name) != 0)) {
+                continue;
+            }
+            if (dnsr_cursor_type(&c) == qtype) {
+                return 0;
+            }
+            if (dnsr_cursor_type(&c) != DNSR_TYPE_CNAME) {
+                continue;
+            }
+            if (p->p_cnames + hops >= dnsr->d_cnamedepth) {
+                DEBUG(fprintf(stderr, "cname_tail: too deep\n"));
+                p->p_cnames += hops;
+                return 0;
+            }
+            if (dnsr_cursor_target(dnsr, &c, name, DNSR_MAX_NAME + 1) != 0) {
+                dnsr->d_errno = DNSR_ERROR_NONE;
+                return 0;
+            }
+            hops++;
+            found = 1;
+            break;
+        }
+    } while (found);
+
+    p->p_cnames += hops;
+    if (hops == 0) {
+        return 0;
+    }
+
+    dnsr_cursor_init(&c, result);
+    while (dnsr_rr_next(dnsr, &c) == 1) {
+        if (dnsr_cursor_section(&c) == DNSR_SECTION_ADDITIONAL) {
+            break;
+        }
+        if ((dnsr_cursor_section(&c) == DNSR_SECTION_AUTHORITY) &&
+                (dnsr_cursor_type(&c) == DNSR_TYPE_SOA)) {
+            DEBUG(fprintf(stderr, "cname_tail: NODATA at %s\n", name));
+            return 0;
+        }
+    }
+    return 1;
+}
+
+/*
+ * Puts the CNAMEs from the answer of chain, an earlier response, in front
+ * of the answer of result.  Their TTLs are moved on by the time between the
+ * two, as result's TTLs count from when it was asked for.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+static int
+dnsr_cname_merge(
+        DNSR *dnsr, struct dnsr_result *chain, struct dnsr_result *result) {
+    struct dnsr_result_block *cb = (struct dnsr_result_block *)chain;
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    struct dnsr_rr           *rr, *answer;
+    time_t                    age;
+    unsigned int              i, n = 0;
+
+    if (rb->rb_lazy || cb->rb_lazy) {
+        return 0;
+    }
+    for (i = 0; i < chain->r_ancount; i++) {
+        if (chain->r_answer[ i ].rr_type == DNSR_TYPE_CNAME) {
+            n++;
+        }
+    }
+    if (n == 0) {
+        return 0;
+    }
+
+    if ((answer = dnsr_arena_alloc(dnsr, result,
+                 (n + result->r_ancount) * sizeof(struct dnsr_rr))) == NULL) {
+        return (-1);
+    }
+    if ((age = rb->rb_querytime.tv_sec - cb->rb_querytime.tv_sec) < 0) {
+        age = 0;
+    }
+
+    n = 0;
+    for (i = 0; i < chain->r_ancount; i++) {
+        if (chain->r_answer[ i ].rr_type != DNSR_TYPE_CNAME) {
+            continue;
+        }
+        rr = &answer[ n++ ];
+        *rr = chain->r_answer[ i ];
+        rr->rr_addr = NULL;
+        rr->rr_naddr = 0;
+        rr->rr_ttl = (rr->rr_ttl > age) ? rr->rr_ttl - age : 0;
+        if (((rr->rr_name = dnsr_arena_strndup(dnsr, result,
+                      chain->r_answer[ i ].rr_name,
+                      strlen(chain->r_answer[ i ].rr_name))) == NULL) ||
+                ((rr->rr_dn.dn_name = dnsr_arena_strndup(dnsr, result,
+                          chain->r_answer[ i ].rr_dn.dn_name,
+                          strlen(chain->r_answer[ i ].rr_dn.dn_name))) ==
+                        NULL)) {
+            return (-1);
+        }
+    }
+    if (result->r_ancount > 0) {
+        memcpy(&answer[ n ], result->r_answer,
+                result->r_ancount * sizeof(struct dnsr_rr));
+    }
+    result->r_answer = answer;
+    result->r_ancount += n;
+
+    return 0;
+}
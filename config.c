@@ -29,6 +29,7 @@ static int dnsr_parse_resolv(DNSR *dnsr);
 static int dnsr_nameserver_add(
         DNSR *dnsr, const char *nameserver, const char *port, int index);
 static void dnsr_nameserver_reset(DNSR *dnsr);
+static int  dnsr_config_opt(DNSR *dnsr, unsigned int opt, int toggle);
 
 static char *dnsr_resolvconf_path = DNSR_RESOLV_CONF_PATH;
 
@@ -93,6 +94,80 @@ dnsr_config(DNSR *dnsr, int flag, int toggle) {
         }
         break;
 
+    case DNSR_FLAG_LAZY:
+        return (dnsr_config_opt(dnsr, DNSR_OPT_LAZY, toggle));
+
+    case DNSR_FLAG_AUTHORITY:
+        return (dnsr_config_opt(dnsr, DNSR_OPT_AUTHORITY, toggle));
+
+    case DNSR_FLAG_ADDITIONAL:
+        return (dnsr_config_opt(dnsr, DNSR_OPT_ADDITIONAL, toggle));
+
+    case DNSR_FLAG_RACE:
+        return (dnsr_config_opt(dnsr, DNSR_OPT_RACE, toggle));
+
+    case DNSR_FLAG_HEDGE:
+        switch (toggle) {
+        case DNSR_FLAG_ON:
+            if (dnsr->d_hedge == 0) {
+                dnsr->d_hedge = DNSR_HEDGE_PERCENTILE;
+            }
+            break;
+
+        case DNSR_FLAG_OFF:
+            dnsr->d_hedge = 0;
+            break;
+
+        default:
+            DEBUG(fprintf(stderr, "dnsr_config: %d: unknown toggle\n", toggle));
+            dnsr->d_errno = DNSR_ERROR_TOGGLE;
+            return (-1);
+        }
+        break;
+
+    case DNSR_FLAG_CNAME:
+        switch (toggle) {
+        case DNSR_FLAG_ON:
+            if (dnsr->d_cnamedepth == 0) {
+                dnsr->d_cnamedepth = DNSR_CNAME_DEPTH;
+            }
+            break;
+
+        case DNSR_FLAG_OFF:
+            dnsr->d_cnamedepth = 0;
+            break;
+
+        default:
+            DEBUG(fprintf(stderr, "dnsr_config: %d: unknown toggle\n", toggle));
+            dnsr->d_errno = DNSR_ERROR_TOGGLE;
+            return (-1);
+        }
+        break;
+
+    case DNSR_FLAG_URING:
+        /* The transport can't change under queries in flight, or once the
+         * descriptors are in a DNSR_POLL.
+         */
+        if ((dnsr->d_npending > 0) || (dnsr->d_poll != NULL)) {
+            DEBUG(fprintf(stderr, "dnsr_config: handle in use\n"));
+            dnsr->d_errno = DNSR_ERROR_CONFIG;
+            return (-1);
+        }
+        switch (toggle) {
+        case DNSR_FLAG_ON:
+            return (dnsr_uring_init(dnsr));
+
+        case DNSR_FLAG_OFF:
+            dnsr_uring_free(dnsr);
+            break;
+
+        default:
+            DEBUG(fprintf(stderr, "dnsr_config: %d: unknown toggle\n", toggle));
+            dnsr->d_errno = DNSR_ERROR_TOGGLE;
+            return (-1);
+        }
+        break;
+
     default:
         DEBUG(fprintf(stderr, "dnsr_config: %d: unknown flag\n", flag));
         dnsr->d_errno = DNSR_ERROR_FLAG;
@@ -102,6 +177,68 @@ dnsr_config(DNSR *dnsr, int flag, int toggle) {
     return 0;
 }
 
+static int
+dnsr_config_opt(DNSR *dnsr, unsigned int opt, int toggle) {
+    switch (toggle) {
+    case DNSR_FLAG_ON:
+        dnsr->d_opts |= opt;
+        break;
+
+    case DNSR_FLAG_OFF:
+        dnsr->d_opts &= ~opt;
+        break;
+
+    default:
+        DEBUG(fprintf(stderr, "dnsr_config: %d: unknown toggle\n", toggle));
+        dnsr->d_errno = DNSR_ERROR_TOGGLE;
+        return (-1);
+    }
+
+    return 0;
+}
+
+/*
+ * Turns decoding of an RR type on or off.  RRs of a type that is off are
+ * stepped over when a result is built, and left out of it, so callers that
+ * ignore e.g. RRSIG or NSEC records don't pay for them.  All types are on
+ * for a new handle.  OPT RRs are always read for their EDNS fields.
+ */
+
+int
+dnsr_config_type(DNSR *dnsr, int type, int toggle) {
+    if ((type < 0) || (type > DNSR_MAX_TYPE)) {
+        DEBUG(fprintf(stderr, "dnsr_config_type: %d: unknown type\n", type));
+        dnsr->d_errno = DNSR_ERROR_TYPE;
+        return (-1);
+    }
+
+    switch (toggle) {
+    case DNSR_FLAG_ON:
+        dnsr->d_skiptypes[ type / 8 ] &= ~(1 << (type % 8));
+        break;
+
+    case DNSR_FLAG_OFF:
+        dnsr->d_skiptypes[ type / 8 ] |= (1 << (type % 8));
+        break;
+
+    default:
+        DEBUG(fprintf(
+                stderr, "dnsr_config_type: %d: unknown toggle\n", toggle));
+        dnsr->d_errno = DNSR_ERROR_TOGGLE;
+        return (-1);
+    }
+
+    return 0;
+}
+
+int
+dnsr_skip_type(DNSR *dnsr, uint16_t type) {
+    if (type > DNSR_MAX_TYPE) {
+        return 0;
+    }
+    return (dnsr->d_skiptypes[ type / 8 ] & (1 << (type % 8)));
+}
+
 /* An empty file, or one without any valid nameservers defaults to local host
  * Can only add one server by hand, that will use default port
  */
@@ -115,6 +252,13 @@ dnsr_parse_resolv(DNSR *dnsr) {
     int    argc;
     FILE  *f;
 
+    /* Scratch space for acav_parse( ), kept with the handle */
+    if ((dnsr->d_acav == NULL) && ((dnsr->d_acav = acav_alloc()) == NULL)) {
+        DEBUG(perror("parse_resolve: acav_alloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+
     if ((f = fopen(dnsr_resolvconf_path, "r")) == NULL) {
         DEBUG(perror(dnsr_resolvconf_path));
         /* Not an error if DNSR_RESOLVECONF_PATH missing - not required */
@@ -137,7 +281,7 @@ dnsr_parse_resolv(DNSR *dnsr) {
             continue;
         }
 
-        if ((argc = acav_parse(NULL, buf, &argv)) < 0) {
+        if ((argc = acav_parse(dnsr->d_acav, buf, &argv)) < 0) {
             DEBUG(perror("parse_resolve: acav_parse"));
             dnsr->d_errno = DNSR_ERROR_SYSTEM;
             return (-1);
@@ -190,9 +334,12 @@ dnsr_nameserver_add(
     }
     DEBUG(fprintf(stderr, "name server %d: %s\n", index, nameserver));
 
-    dnsr->d_nsinfo[ index ].ns_id = rand() & 0xffff;
+    dnsr->d_nsinfo[ index ].ns_id = dnsr_rand(dnsr) & 0xffff;
     dnsr->d_nsinfo[ index ].ns_udp = DNSR_MAX_UDP_BASIC;
     dnsr->d_nsinfo[ index ].ns_edns = DNSR_EDNS_UNKNOWN;
+    memset(dnsr->d_nsinfo[ index ].ns_lat, 0,
+            sizeof(dnsr->d_nsinfo[ index ].ns_lat));
+    dnsr->d_nsinfo[ index ].ns_latcount = 0;
 
     memset(&hints, 0, sizeof(struct addrinfo));
 
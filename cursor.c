@@ -0,0 +1,238 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "internal.h"
+
+static unsigned int dnsr_section_count(struct dnsr_result *, int);
+static int dnsr_cursor_dn(DNSR *, struct dnsr_cursor *, char *, char *, size_t);
+
+/*
+ * The cursor always walks the whole message, so counts come from its header
+ * rather than the result, which may have had RRs left out.
+ */
+
+static unsigned int
+dnsr_section_count(struct dnsr_result *result, int section) {
+    struct dnsr_header *h;
+
+    h = (struct dnsr_header *)((struct dnsr_result_block *)result)->rb_msg;
+
+    switch (section) {
+    case DNSR_SECTION_ANSWER:
+        return (ntohs(h->h_ancount));
+    case DNSR_SECTION_AUTHORITY:
+        return (ntohs(h->h_nscount));
+    case DNSR_SECTION_ADDITIONAL:
+        return (ntohs(h->h_arcount));
+    default:
+        return 0;
+    }
+}
+
+void
+dnsr_cursor_init(struct dnsr_cursor *c, struct dnsr_result *result) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+
+    memset(c, 0, sizeof(struct dnsr_cursor));
+    c->c_result = result;
+    c->c_next = rb->rb_msg + rb->rb_first;
+}
+
+/*
+ * Advances the cursor to the next RR, crossing into the next section when
+ * the current one is exhausted.  Only the owner name is stepped over and the
+ * fixed part of the RR read; nothing is copied out of the message.
+ *
+ * Return Values:
+ *      1       cursor is on an RR
+ *      0       no more RRs
+ *      -1      malformed message - check dnsr_errno
+ */
+
+int
+dnsr_rr_next(DNSR *dnsr, struct dnsr_cursor *c) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)c->c_result;
+    char                     *resp_cur;
+    char                     *resp_end = rb->rb_msg + rb->rb_msglen;
+
+    if (c->c_section == 0) {
+        c->c_section = DNSR_SECTION_ANSWER;
+        c->c_index = 0;
+    } else if (c->c_section > DNSR_SECTION_ADDITIONAL) {
+        return 0;
+    } else {
+        c->c_index++;
+    }
+
+    while (c->c_index >= dnsr_section_count(c->c_result, c->c_section)) {
+        c->c_index = 0;
+        if (++c->c_section > DNSR_SECTION_ADDITIONAL) {
+            return 0;
+        }
+    }
+
+    resp_cur = c->c_next;
+    c->c_name = resp_cur;
+    if (dnsr_skip_name(dnsr, rb->rb_msg, &resp_cur, rb->rb_msglen) != 0) {
+        goto error;
+    }
+    if (dnsr_parse_header(dnsr, &resp_cur, resp_end, &c->c_type, &c->c_class,
+                &c->c_ttl, &c->c_rdlength) != 0) {
+        goto error;
+    }
+    if (resp_cur + c->c_rdlength > resp_end) {
+        DEBUG(fprintf(stderr, "rr_next: invalid rdlength\n"));
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+        goto error;
+    }
+    c->c_rdata = resp_cur;
+    c->c_next = resp_cur + c->c_rdlength;
+
+    return 1;
+
+error:
+    /* Nothing past a malformed RR can be trusted */
+    c->c_section = DNSR_SECTION_ADDITIONAL + 1;
+    return (-1);
+}
+
+int
+dnsr_cursor_section(const struct dnsr_cursor *c) {
+    return (c->c_section);
+}
+
+uint16_t
+dnsr_cursor_type(const struct dnsr_cursor *c) {
+    return (c->c_type);
+}
+
+uint16_t
+dnsr_cursor_class(const struct dnsr_cursor *c) {
+    return (c->c_class);
+}
+
+uint32_t
+dnsr_cursor_ttl(const struct dnsr_cursor *c) {
+    return (c->c_ttl);
+}
+
+/*
+ * Returns the RDATA of the current RR as it is on the wire.  Names within
+ * it may be compressed; use dnsr_cursor_target( ) to read them.
+ */
+
+const void *
+dnsr_cursor_rdata(const struct dnsr_cursor *c, uint16_t *len) {
+    if (len != NULL) {
+        *len = c->c_rdlength;
+    }
+    return (c->c_rdata);
+}
+
+static int
+dnsr_cursor_dn(DNSR *dnsr, struct dnsr_cursor *c, char *dn, char *buf,
+        size_t len) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)c->c_result;
+    char                     *dn_cur = buf;
+
+    if (len == 0) {
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+        return (-1);
+    }
+
+    if (dnsr_labels_to_name(dnsr, rb->rb_msg, &dn, rb->rb_msglen, buf, &dn_cur,
+                buf + MIN(len - 1, DNSR_MAX_NAME)) < 0) {
+        return (-1);
+    }
+    return 0;
+}
+
+/*
+ * Decodes the owner name of the current RR into buf, which should have room
+ * for DNSR_MAX_NAME + 1 bytes.
+ */
+
+int
+dnsr_cursor_name(DNSR *dnsr, struct dnsr_cursor *c, char *buf, size_t len) {
+    return (dnsr_cursor_dn(dnsr, c, c->c_name, buf, len));
+}
+
+/*
+ * Decodes the domain name carried in the RDATA of the current RR into buf,
+ * as dnsr_rr_target( ) does for a decoded RR.
+ */
+
+int
+dnsr_cursor_target(DNSR *dnsr, struct dnsr_cursor *c, char *buf, size_t len) {
+    uint16_t offset;
+
+    switch (c->c_type) {
+    case DNSR_TYPE_CNAME:
+    case DNSR_TYPE_MB:
+    case DNSR_TYPE_MD:
+    case DNSR_TYPE_MF:
+    case DNSR_TYPE_MG:
+    case DNSR_TYPE_MR:
+    case DNSR_TYPE_NS:
+    case DNSR_TYPE_PTR:
+    case DNSR_TYPE_SOA:
+        offset = 0;
+        break;
+
+    case DNSR_TYPE_MX:
+        /* preference */
+        offset = sizeof(uint16_t);
+        break;
+
+    case DNSR_TYPE_SRV:
+        /* priority, weight and port */
+        offset = 3 * sizeof(uint16_t);
+        break;
+
+    default:
+        DEBUG(fprintf(stderr, "cursor_target: %d: no target\n", c->c_type));
+        dnsr->d_errno = DNSR_ERROR_TYPE;
+        return (-1);
+    }
+
+    if (offset >= c->c_rdlength) {
+        DEBUG(fprintf(stderr, "cursor_target: rdata too short\n"));
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+        return (-1);
+    }
+
+    return (dnsr_cursor_dn(dnsr, c, c->c_rdata + offset, buf, len));
+}
+
+/*
+ * Fully decodes the current RR.  The returned RR lives with the result and
+ * is released by dnsr_free_result( ).
+ */
+
+struct dnsr_rr *
+dnsr_cursor_decode(DNSR *dnsr, struct dnsr_cursor *c) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)c->c_result;
+    struct dnsr_rr           *rr;
+    char                     *resp_cur = c->c_name;
+
+    if ((rr = dnsr_arena_calloc(dnsr, c->c_result, sizeof(struct dnsr_rr))) ==
+            NULL) {
+        return (NULL);
+    }
+    if (dnsr_parse_rr(dnsr, rr, c->c_result, rb->rb_msg, &resp_cur,
+                rb->rb_msglen) != 0) {
+        return (NULL);
+    }
+    return (rr);
+}
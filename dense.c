@@ -54,7 +54,7 @@ densetype(char *type) {
 
 int
 print_rr(struct dnsr_rr *rr) {
-    struct ip_info *ip_info;
+    int i;
 
     if (rr->rr_type != DNSR_TYPE_OPT) {
         printf("%s\t", rr->rr_name);
@@ -131,12 +131,11 @@ print_rr(struct dnsr_rr *rr) {
         break;
 
     case DNSR_TYPE_TXT: {
-        struct dnsr_string *txt;
-        txt = rr->rr_txt.txt_data;
+        const char *txt;
+        uint16_t    len;
         printf("\tTXT");
-        while (txt != NULL) {
-            printf("\t%s\n", txt->s_string);
-            txt = txt->s_next;
+        for (i = 0; (txt = dnsr_txt_string(rr, i, &len)) != NULL; i++) {
+            printf("\t%.*s\n", len, txt);
         }
         break;
     }
@@ -188,19 +187,10 @@ print_rr(struct dnsr_rr *rr) {
 
     if (rr->rr_type != DNSR_TYPE_A) {
         char buf[ INET6_ADDRSTRLEN ];
-        for (ip_info = rr->rr_ip; ip_info; ip_info = ip_info->ip_next) {
-            printf("\t%s\n",
-                    inet_ntop(ip_info->ip_sa.ss_family,
-                            ((ip_info->ip_sa.ss_family == AF_INET)
-                                            ? (void *)&(
-                                                      ((struct sockaddr_in *)&(
-                                                               ip_info->ip_sa))
-                                                              ->sin_addr)
-                                            : (void *)&(
-                                                      ((struct sockaddr_in6 *)&(
-                                                               ip_info->ip_sa))
-                                                              ->sin6_addr)),
-                            buf, INET6_ADDRSTRLEN));
+        for (i = 0; i < rr->rr_naddr; i++) {
+            printf("\t%s\n", inet_ntop(rr->rr_addr[ i ].a_family,
+                                     &rr->rr_addr[ i ].a_u, buf,
+                                     INET6_ADDRSTRLEN));
         }
     }
     return 0;
@@ -19,6 +19,9 @@
 #define DNSR_MAX_ERRNO 31 /* Highest valid error number */
 #define DNSR_MAX_TYPE 255 /* Highest valid type */
 #define DNSR_MAX_CLASS 4  /* Highest valid class */
+#define DNSR_MAX_CNAME 16 /* Most CNAMEs a query will follow */
+#define DNSR_CNAME_DEPTH 8 /* CNAMEs followed with DNSR_FLAG_CNAME */
+#define DNSR_HEDGE_PERCENTILE 95 /* Hedge point with DNSR_FLAG_HEDGE */
 
 /* RR types ( RFC 1035 3.2.2 ) */
 #define DNSR_TYPE_A 1      /* Host address */
@@ -58,9 +61,21 @@
 #define DNSR_CLASS_ALL 255  /* Any class */
 
 /* DNSR flags */
-#define DNSR_FLAG_ON 0        /* Turn flag on */
-#define DNSR_FLAG_OFF 1       /* Turn flag off */
-#define DNSR_FLAG_RECURSION 2 /* Recursion */
+#define DNSR_FLAG_ON 0         /* Turn flag on */
+#define DNSR_FLAG_OFF 1        /* Turn flag off */
+#define DNSR_FLAG_RECURSION 2  /* Recursion */
+#define DNSR_FLAG_LAZY 3       /* Decode RRs on demand, see dnsr_rr_next( ) */
+#define DNSR_FLAG_AUTHORITY 4  /* Decode the authority section */
+#define DNSR_FLAG_ADDITIONAL 5 /* Decode the additional section */
+#define DNSR_FLAG_URING 6      /* Send and receive with io_uring */
+#define DNSR_FLAG_CNAME 7      /* Follow CNAMEs, see dnsr_config_cname( ) */
+#define DNSR_FLAG_RACE 8       /* Ask every name server at once */
+#define DNSR_FLAG_HEDGE 9      /* Ask the next name server when one is slow */
+
+/* Message sections */
+#define DNSR_SECTION_ANSWER 1
+#define DNSR_SECTION_AUTHORITY 2
+#define DNSR_SECTION_ADDITIONAL 3
 
 /* DNSR error codes */
 #define DNSR_ERROR_NONE 0   /* No error condition */
@@ -120,7 +135,56 @@ struct dnsr_result {
     uint16_t        r_rcode;
 };
 
-typedef struct dnsr DNSR;
+typedef struct dnsr         DNSR;
+typedef struct dnsr_poll    DNSR_POLL;
+typedef struct dnsr_service DNSR_SERVICE;
+typedef struct dnsr_cache   DNSR_CACHE;
+
+/* Called when a dnsr_submit( ) lookup finishes, see service.c */
+typedef void (*dnsr_callback)(
+        void *arg, struct dnsr_result *result, int dnsr_errno);
+
+/* A finished lookup from dnsr_service_completions( ) */
+struct dnsr_completion {
+    void               *dc_arg;
+    int                 dc_errno;
+    struct dnsr_result *dc_result;
+};
+
+/* A query for dnsr_query_batch( ) */
+struct dnsr_batch_query {
+    uint16_t    bq_type;
+    uint16_t    bq_class;
+    const char *bq_name;
+};
+
+/* A finished query from dnsr_result_batch( ), by its index in the batch */
+struct dnsr_batch_result {
+    int                 br_index;
+    int                 br_errno; /* why br_result is NULL */
+    struct dnsr_result *br_result;
+};
+
+/*
+ * A cursor walks the RRs of a result in message order, straight off the
+ * received message.  Only the fixed part of each RR is read as the cursor
+ * moves; names and RDATA are decoded when asked for.  With DNSR_FLAG_LAZY
+ * set, results are returned without r_answer, r_ns and r_additional and
+ * this is the only way to get at their RRs.
+ */
+
+struct dnsr_cursor {
+    struct dnsr_result *c_result;
+    char               *c_next;     /* next RR in the message */
+    char               *c_name;     /* owner name of the current RR */
+    char               *c_rdata;    /* RDATA of the current RR */
+    int                 c_section;  /* section of the current RR */
+    unsigned int        c_index;    /* index of the current RR in section */
+    uint16_t            c_type;     /* RR type */
+    uint16_t            c_class;    /* RR class */
+    uint32_t            c_ttl;      /* RR ttl */
+    uint16_t            c_rdlength; /* length of RDATA field */
+};
 
 /*
  * 3.3. Standard RRs
@@ -140,76 +204,78 @@ typedef struct dnsr DNSR;
 
 /* Generic RR Domain */
 struct rr_dn {
-    char dn_name[ DNSR_MAX_NAME + 1 ];
+    char *dn_name;
 };
 
 /* 3.3.1. CNAME RDATA format */
 struct rr_cname {
-    char cn_name[ DNSR_MAX_NAME + 1 ];
+    char *cn_name;
 };
 
 /* 3.3.2. HINFO RDATA format */
 struct rr_hinfo {
-    char hi_cpu[ DNSR_MAX_STRING + 1 ];
-    char hi_os[ DNSR_MAX_STRING + 1 ];
+    char *hi_cpu;
+    char *hi_os;
 };
 
 /* 3.3.3. MB RDATA format */
 struct rr_mb {
-    char mb_name[ DNSR_MAX_NAME + 1 ];
+    char *mb_name;
 };
 
 /* 3.3.4. MD RDATA format */
 struct rr_md {
-    char md_name[ DNSR_MAX_NAME + 1 ];
+    char *md_name;
 };
 
 /* 3.3.5. MF RDATA format */
 struct rr_mf {
-    char mf_name[ DNSR_MAX_NAME + 1 ];
+    char *mf_name;
 };
 
 /* 3.3.6. MG RDATA format */
 struct rr_mg {
-    char mg_name[ DNSR_MAX_NAME + 1 ];
+    char *mg_name;
 };
 
 /* 3.3.7. MINFO RDATA format */
 struct rr_minfo {
-    char mi_rmailbx[ DNSR_MAX_NAME + 1 ];
-    char mi_emailbx[ DNSR_MAX_NAME + 1 ];
+    char *mi_rmailbx;
+    char *mi_emailbx;
 };
 
 /* 3.3.8. MR RDATA format */
 struct rr_mr {
-    char mr_name[ DNSR_MAX_NAME + 1 ];
+    char *mr_name;
 };
 
 /* 3.3.9. MX RDATA format */
 struct rr_mx {
     uint16_t mx_preference;
-    char     mx_exchange[ DNSR_MAX_NAME + 1 ];
+    char    *mx_exchange;
 };
 
-/* 3.3.10. NULL RDATA format */
+/* 3.3.10. NULL RDATA format, rr_rdlength bytes of raw RDATA.  Also used
+ * for any other type that is not decoded.
+ */
 struct rr_null {
-    char null_name[ DNSR_MAX_RDATA ];
+    char *null_name;
 };
 
 /* 3.3.11. NS RDATA format */
 struct rr_ns {
-    char ns_name[ DNSR_MAX_NAME + 1 ];
+    char *ns_name;
 };
 
 /* 3.3.12. PTR RDATA format */
 struct rr_ptr {
-    char ptr_name[ DNSR_MAX_NAME + 1 ];
+    char *ptr_name;
 };
 
 /* 3.3.13 SOA RDATA format */
 struct rr_soa {
-    char    soa_mname[ DNSR_MAX_NAME + 1 ];
-    char    soa_rname[ DNSR_MAX_NAME + 1 ];
+    char   *soa_mname;
+    char   *soa_rname;
     int     soa_serial;
     int32_t soa_refresh;
     int32_t soa_retry;
@@ -217,14 +283,15 @@ struct rr_soa {
     int32_t soa_minimum;
 };
 
-/* 3.3.14. TXT RDATA format */
-struct dnsr_string {
-    struct dnsr_string *s_next;
-    char                s_string[ DNSR_MAX_STRING + 1 ];
-};
-
+/* 3.3.14. TXT RDATA format
+ * The <character-string>s are stored back to back in txt_data, which is NUL
+ * terminated, so a key split over several strings can be used as it is.
+ * String i starts at txt_off[ i ] and ends at txt_off[ i + 1 ].
+ */
 struct rr_txt {
-    struct dnsr_string *txt_data;
+    char     *txt_data;  /* all strings, joined */
+    uint16_t *txt_off;   /* txt_count + 1 offsets into txt_data */
+    uint16_t  txt_count; /* number of strings */
 };
 
 /*
@@ -245,7 +312,7 @@ struct rr_srv {
     uint16_t srv_priority;
     uint16_t srv_weight;
     uint16_t srv_port;
-    char     srv_target[ DNSR_MAX_NAME + 1 ];
+    char    *srv_target;
 };
 
 /* RFC 6891 OPT record */
@@ -264,18 +331,42 @@ struct rr_opt {
     uint16_t         opt_udp;
 };
 
-struct ip_info {
-    struct ip_info         *ip_next;
-    struct sockaddr_storage ip_sa;
+/* An address from the additional section for the name an RR points at */
+struct dnsr_addr {
+    sa_family_t a_family; /* AF_INET or AF_INET6 */
+    union {
+        struct in_addr  a_in;
+        struct in6_addr a_in6;
+    } a_u;
+#define a_v4 a_u.a_in
+#define a_v6 a_u.a_in6
 };
 
+/* A mail exchanger from dnsr_resolve_mx( ) */
+struct dnsr_exchanger {
+    char             *ex_name;
+    struct dnsr_addr *ex_addr;       /* in the order to try them */
+    int               ex_naddr;
+    int               ex_errno;      /* why an address lookup failed */
+    uint16_t          ex_preference;
+};
+
+/*
+ * Names and strings are stored outside the record and sized to their
+ * contents, so a dnsr_rr costs the same few dozen bytes whatever its type.
+ * The member names and rr_* shorthands below are unchanged from the old
+ * fixed-size layout; code that only reads them needs no changes.  Names
+ * are shared between the RRs of a result and must not be modified.
+ */
+
 struct dnsr_rr {
-    char            rr_name[ DNSR_MAX_NAME + 1 ]; /* domain name */
-    struct ip_info *rr_ip;                        /* related IP */
-    uint16_t        rr_type;                      /* RR type */
-    uint16_t        rr_class;                     /* RR class */
-    uint32_t        rr_ttl;                       /* RR ttl */
-    uint16_t        rr_rdlength;                  /* length of RDATA field */
+    char             *rr_name;     /* domain name */
+    struct dnsr_addr *rr_addr;     /* related addresses */
+    uint16_t          rr_naddr;    /* number of related addresses */
+    uint16_t          rr_type;     /* RR type */
+    uint16_t          rr_class;    /* RR class */
+    uint32_t          rr_ttl;      /* RR ttl */
+    uint16_t          rr_rdlength; /* length of RDATA field */
     union {
         struct rr_dn rd_dn;
 #define rr_dn rr_u.rd_dn
@@ -318,14 +409,73 @@ struct dnsr_rr {
     } rr_u;
 };
 
+#ifdef __cplusplus
+extern "C" {
+#endif /* __cplusplus */
+
 DNSR *dnsr_new(void);
 int   dnsr_nameserver(DNSR *dnsr, const char *server);
 int   dnsr_nameserver_port(DNSR *dnsr, const char *server, const char *port);
 int   dnsr_config(DNSR *dnsr, int flag, int toggle);
+int   dnsr_config_type(DNSR *dnsr, int type, int toggle);
+int   dnsr_config_cname(DNSR *dnsr, int depth);
+int   dnsr_config_hedge(DNSR *dnsr, int percentile);
+int   dnsr_config_cache(DNSR *dnsr, DNSR_CACHE *cache);
 int   dnsr_query(DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn);
+int   dnsr_query_tagged(
+          DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn, int tag);
+int   dnsr_query_batch(
+          DNSR *dnsr, const struct dnsr_batch_query *queries, int count);
 struct dnsr_result *dnsr_result(DNSR *dnsr, struct timeval *timeout);
+int                 dnsr_result_tagged(DNSR *dnsr, struct timeval *timeout,
+                        int *tag, struct dnsr_result **result);
+int                 dnsr_result_batch(DNSR *dnsr, struct timeval *timeout,
+                        struct dnsr_batch_result *results, int max);
+int                 dnsr_fds(DNSR *dnsr, int *fds, int max);
+int                 dnsr_next_timeout(DNSR *dnsr, struct timeval *tv);
+int                 dnsr_process(DNSR *dnsr, int fd);
+int dnsr_resolve_host(DNSR *dnsr, const char *name, struct timeval *timeout,
+        struct dnsr_addr *addrs, int max);
+int dnsr_resolve_mx(DNSR *dnsr, const char *name, struct timeval *timeout,
+        struct dnsr_exchanger **exchangers);
+
+DNSR_POLL *dnsr_poll_new(void);
+int        dnsr_poll_add(DNSR_POLL *dp, DNSR *dnsr);
+int        dnsr_poll_remove(DNSR_POLL *dp, DNSR *dnsr);
+int  dnsr_poll(DNSR_POLL *dp, DNSR **ready, int max, struct timeval *timeout);
+void dnsr_poll_free(DNSR_POLL *dp);
+
+DNSR_SERVICE *dnsr_service_new(DNSR *dnsr);
+int           dnsr_submit(DNSR_SERVICE *svc, uint16_t qtype, const char *name,
+                  dnsr_callback cb, void *arg);
+int           dnsr_service_completions(DNSR_SERVICE *svc,
+                  struct dnsr_completion *completions, int max,
+                  struct timeval *timeout);
+void          dnsr_service_free(DNSR_SERVICE *svc);
+
+DNSR_CACHE *dnsr_cache_new(int size);
+DNSR_CACHE *dnsr_cache_shm_new(int size);
+void        dnsr_cache_free(DNSR_CACHE *cache);
+
 int                 dnsr_result_expired(DNSR *dnsr, struct dnsr_result *result);
 
+const char *dnsr_rr_target(const struct dnsr_rr *rr);
+const void *dnsr_rr_rdata(const struct dnsr_rr *rr, uint16_t *len);
+const char *dnsr_txt_joined(const struct dnsr_rr *rr, uint16_t *len);
+const char *dnsr_txt_string(const struct dnsr_rr *rr, int i, uint16_t *len);
+
+void     dnsr_cursor_init(struct dnsr_cursor *c, struct dnsr_result *result);
+int      dnsr_rr_next(DNSR *dnsr, struct dnsr_cursor *c);
+int      dnsr_cursor_section(const struct dnsr_cursor *c);
+uint16_t dnsr_cursor_type(const struct dnsr_cursor *c);
+uint16_t dnsr_cursor_class(const struct dnsr_cursor *c);
+uint32_t dnsr_cursor_ttl(const struct dnsr_cursor *c);
+const void *dnsr_cursor_rdata(const struct dnsr_cursor *c, uint16_t *len);
+int dnsr_cursor_name(DNSR *dnsr, struct dnsr_cursor *c, char *buf, size_t len);
+int dnsr_cursor_target(
+        DNSR *dnsr, struct dnsr_cursor *c, char *buf, size_t len);
+struct dnsr_rr *dnsr_cursor_decode(DNSR *dnsr, struct dnsr_cursor *c);
+
 char *dnsr_ntoptr(DNSR *, int, const void *, const char *);
 char *dnsr_reverse_ip(DNSR *, const char *, const char *);
 
@@ -337,7 +487,13 @@ void  dnsr_perror(DNSR *dnsr, const char *s);
 void dnsr_free(DNSR *dnsr);
 void dnsr_free_result(struct dnsr_result *result);
 void dnsr_free_val(void *);
+void dnsr_release_result(DNSR *dnsr, struct dnsr_result *result);
+void dnsr_free_pool(DNSR *dnsr);
 
 int dnsr_send_query(DNSR *dnsr, int ns);
 
+#ifdef __cplusplus
+}
+#endif /* __cplusplus */
+
 #endif /* DENSER_H */
@@ -0,0 +1,438 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#ifndef DENSER_HPP
+#define DENSER_HPP
+
+/*
+ * A header-only C++20 layer over denser.h.
+ *
+ *  - denser::resolver and denser::result own a DNSR and a dnsr_result, are
+ *    move-only, and free them when they go.
+ *  - Records are the library's own struct dnsr_rr, seen through spans;
+ *    names, strings and RDATA are string_views and spans into the result,
+ *    valid as long as it is, and never copied.
+ *  - denser::engine runs tagged queries on a resolver without blocking,
+ *    and engine::lookup( ) is an awaitable that resumes its coroutine when
+ *    the query finishes.  The engine is driven from the application's own
+ *    event loop through fds( ), next_timeout( ) and process( ), or by
+ *    run( ).
+ *
+ * Nothing here throws except the resolver constructor, when dnsr_new( )
+ * or dnsr_nameserver( ) fails.  Lookup failures are carried in the result,
+ * as a DNSR_ERROR_* code from error( ).
+ */
+
+#include <coroutine>
+#include <cstddef>
+#include <span>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+#include <errno.h>
+
+#include "denser.h"
+
+namespace denser {
+
+/* The DNSR_ERROR_* codes, as an error category */
+class error_category : public std::error_category {
+  public:
+    const char *
+    name() const noexcept override {
+        return ("dnsr");
+    }
+    std::string
+    message(int ev) const override {
+        return (dnsr_err2string(ev));
+    }
+};
+
+inline const std::error_category &
+category() noexcept {
+    static const error_category c;
+
+    return (c);
+}
+
+/* The owner name of rr */
+inline std::string_view
+name(const dnsr_rr &rr) {
+    return (rr.rr_name ? std::string_view(rr.rr_name) : std::string_view());
+}
+
+/* The name rr points at, for CNAME, MX, NS, PTR, SRV and the like */
+inline std::string_view
+target(const dnsr_rr &rr) {
+    const char *t = dnsr_rr_target(&rr);
+
+    return (t ? std::string_view(t) : std::string_view());
+}
+
+/* The raw RDATA of rr, for types that are not decoded */
+inline std::span<const std::byte>
+rdata(const dnsr_rr &rr) {
+    uint16_t    len = 0;
+    const void *d = dnsr_rr_rdata(&rr, &len);
+
+    return (std::span<const std::byte>(
+            static_cast<const std::byte *>(d), d ? len : 0));
+}
+
+/* All of a TXT record's strings, joined */
+inline std::string_view
+txt(const dnsr_rr &rr) {
+    uint16_t    len = 0;
+    const char *t = dnsr_txt_joined(&rr, &len);
+
+    return (t ? std::string_view(t, len) : std::string_view());
+}
+
+/* String i of a TXT record */
+inline std::string_view
+txt(const dnsr_rr &rr, int i) {
+    uint16_t    len = 0;
+    const char *t = dnsr_txt_string(&rr, i, &len);
+
+    return (t ? std::string_view(t, len) : std::string_view());
+}
+
+/* Addresses from the additional section for the name rr points at */
+inline std::span<const dnsr_addr>
+addresses(const dnsr_rr &rr) {
+    return (std::span<const dnsr_addr>(rr.rr_addr, rr.rr_naddr));
+}
+
+/*
+ * A result, or the DNSR_ERROR_* code for why there is none.
+ */
+
+class result {
+    /* dnsr_result( ), the function, hides the struct's plain name */
+    using raw = struct dnsr_result;
+
+  public:
+    result() noexcept = default;
+    explicit result(raw *r, int err = DNSR_ERROR_NONE) noexcept
+            : r_result(r), r_errno(r ? DNSR_ERROR_NONE : err) {
+    }
+    result(result &&o) noexcept
+            : r_result(std::exchange(o.r_result, nullptr)),
+              r_errno(o.r_errno) {
+    }
+    result &
+    operator=(result &&o) noexcept {
+        if (this != &o) {
+            dnsr_free_result(r_result);
+            r_result = std::exchange(o.r_result, nullptr);
+            r_errno = o.r_errno;
+        }
+        return (*this);
+    }
+    result(const result &) = delete;
+    result &operator=(const result &) = delete;
+    ~result() {
+        dnsr_free_result(r_result);
+    }
+
+    explicit
+    operator bool() const noexcept {
+        return (r_result != nullptr);
+    }
+    int
+    error() const noexcept {
+        return (r_errno);
+    }
+    std::string_view
+    error_string() const noexcept {
+        return (dnsr_err2string(r_errno));
+    }
+    uint16_t
+    rcode() const noexcept {
+        return (r_result ? r_result->r_rcode : 0);
+    }
+
+    /* Empty with DNSR_FLAG_LAZY, walk a cursor( ) instead */
+    std::span<const dnsr_rr>
+    answer() const noexcept {
+        return (section(&raw::r_answer, &raw::r_ancount));
+    }
+    std::span<const dnsr_rr>
+    authority() const noexcept {
+        return (section(&raw::r_ns, &raw::r_nscount));
+    }
+    std::span<const dnsr_rr>
+    additional() const noexcept {
+        return (section(&raw::r_additional, &raw::r_arcount));
+    }
+
+    dnsr_cursor
+    cursor() const noexcept {
+        dnsr_cursor c;
+
+        dnsr_cursor_init(&c, r_result);
+        return (c);
+    }
+
+    raw *
+    get() const noexcept {
+        return (r_result);
+    }
+    /* Gives up ownership, for handing back to C */
+    raw *
+    release() noexcept {
+        return (std::exchange(r_result, nullptr));
+    }
+
+  private:
+    std::span<const dnsr_rr>
+    section(dnsr_rr *raw::*rrs,
+            unsigned int raw::*count) const noexcept {
+        if ((r_result == nullptr) || (r_result->*rrs == nullptr)) {
+            return {};
+        }
+        return (std::span<const dnsr_rr>(r_result->*rrs, r_result->*count));
+    }
+
+    raw *r_result = nullptr;
+    int          r_errno = DNSR_ERROR_NO_QUERY;
+};
+
+/*
+ * A DNSR.  The constructor sets up name servers from resolv.conf, or
+ * server when it is given.  It throws a std::system_error if it can't: of
+ * the generic category when dnsr_new( ) fails, and of category( ), with
+ * the DNSR_ERROR_* code, when the name servers can't be set up.
+ */
+
+class resolver {
+  public:
+    resolver() : resolver(nullptr) {
+    }
+    explicit resolver(const char *server) : r_dnsr(dnsr_new()) {
+        if (r_dnsr == nullptr) {
+            throw std::system_error(errno, std::generic_category(), "dnsr_new");
+        }
+        if (dnsr_nameserver(r_dnsr, server) != 0) {
+            int err = dnsr_errno(r_dnsr);
+
+            dnsr_free(r_dnsr);
+            throw std::system_error(err, category(), "dnsr_nameserver");
+        }
+    }
+    resolver(resolver &&o) noexcept
+            : r_dnsr(std::exchange(o.r_dnsr, nullptr)) {
+    }
+    resolver &
+    operator=(resolver &&o) noexcept {
+        if (this != &o) {
+            dnsr_free(r_dnsr);
+            r_dnsr = std::exchange(o.r_dnsr, nullptr);
+        }
+        return (*this);
+    }
+    resolver(const resolver &) = delete;
+    resolver &operator=(const resolver &) = delete;
+    ~resolver() {
+        dnsr_free(r_dnsr);
+    }
+
+    /* As dnsr_config( ), returns a DNSR_ERROR_* code */
+    int
+    config(int flag, bool on) noexcept {
+        if (dnsr_config(r_dnsr, flag, on ? DNSR_FLAG_ON : DNSR_FLAG_OFF) !=
+                0) {
+            return (dnsr_errno(r_dnsr));
+        }
+        return (DNSR_ERROR_NONE);
+    }
+
+    DNSR *
+    get() const noexcept {
+        return (r_dnsr);
+    }
+
+  private:
+    DNSR *r_dnsr;
+};
+
+/*
+ * Runs queries on a resolver for coroutines.  Each lookup( ) is a tagged
+ * query, and the tag is the slot its coroutine waits in.  An engine is
+ * used from one thread; coroutines waiting on it when it is destroyed are
+ * never resumed.
+ */
+
+class engine {
+  public:
+    explicit engine(resolver &r) noexcept : e_dnsr(r.get()) {
+    }
+    engine(const engine &) = delete;
+    engine &operator=(const engine &) = delete;
+
+    class awaitable {
+      public:
+        awaitable(engine &e, uint16_t type, uint16_t cls,
+                std::string_view name) noexcept
+                : a_engine(e), a_type(type), a_class(cls), a_name(name) {
+        }
+
+        bool
+        await_ready() const noexcept {
+            return (false);
+        }
+        /* Doesn't suspend if the query can't be sent */
+        bool
+        await_suspend(std::coroutine_handle<> h) {
+            a_slot = a_engine.start(a_type, a_class, a_name, h, a_errno);
+            return (a_slot >= 0);
+        }
+        result
+        await_resume() noexcept {
+            if (a_slot < 0) {
+                return (result(nullptr, a_errno));
+            }
+            return (a_engine.take(a_slot));
+        }
+
+      private:
+        engine          &a_engine;
+        uint16_t         a_type;
+        uint16_t         a_class;
+        std::string_view a_name;
+        int              a_slot = -1;
+        int              a_errno = DNSR_ERROR_NONE;
+    };
+
+    /* co_await e.lookup(DNSR_TYPE_MX, "example.edu") */
+    awaitable
+    lookup(uint16_t type, std::string_view name,
+            uint16_t cls = DNSR_CLASS_IN) noexcept {
+        return (awaitable(*this, type, cls, name));
+    }
+
+    /* Lookups waiting on a response */
+    std::size_t
+    pending() const noexcept {
+        return (e_pending);
+    }
+
+    /* For an event loop, as dnsr_fds( ), dnsr_next_timeout( ) and
+     * dnsr_process( ).  Call dispatch( ) after process( ).
+     */
+    std::span<const int>
+    fds() noexcept {
+        return (std::span<const int>(e_fds, dnsr_fds(e_dnsr, e_fds, 2)));
+    }
+    bool
+    next_timeout(timeval &tv) noexcept {
+        return (dnsr_next_timeout(e_dnsr, &tv) == 1);
+    }
+    void
+    process(int fd) noexcept {
+        dnsr_process(e_dnsr, fd);
+    }
+
+    /* Resumes the coroutines whose lookups have finished, without waiting.
+     * Returns how many were resumed.
+     */
+    std::size_t
+    dispatch() {
+        timeval zero = {0, 0};
+
+        return (run(&zero));
+    }
+
+    /* Waits upto timeout, or until every lookup is done if it is NULL, for
+     * lookups to finish, and resumes their coroutines.  Returns how many
+     * were resumed.
+     */
+    std::size_t
+    run(timeval *timeout) {
+        dnsr_batch_result       br[ 32 ];
+        std::coroutine_handle<> h;
+        timeval                 zero;
+        std::size_t             resumed = 0;
+        int                     i, n;
+
+        while (e_pending > 0) {
+            if ((n = dnsr_result_batch(e_dnsr, timeout, br, 32)) <= 0) {
+                break;
+            }
+            for (i = 0; i < n; i++) {
+                slot &s = e_slots[ br[ i ].br_index ];
+                s.s_result = result(br[ i ].br_result, br[ i ].br_errno);
+                h = std::exchange(s.s_waiter, nullptr);
+                e_pending--;
+                /* May start more lookups, and grow e_slots */
+                h.resume();
+                resumed++;
+            }
+            /* Something finished, collect the rest without waiting */
+            if (timeout != nullptr) {
+                zero.tv_sec = 0;
+                zero.tv_usec = 0;
+                timeout = &zero;
+            }
+        }
+        return (resumed);
+    }
+
+  private:
+    struct slot {
+        std::coroutine_handle<> s_waiter;
+        result                  s_result;
+    };
+
+    int
+    start(uint16_t type, uint16_t cls, std::string_view name,
+            std::coroutine_handle<> h, int &err) {
+        char buf[ DNSR_MAX_NAME + 1 ];
+        int  slot;
+
+        /* denser wants a C string */
+        if (name.size() > DNSR_MAX_NAME) {
+            err = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+        name.copy(buf, name.size());
+        buf[ name.size() ] = '\0';
+
+        if (e_free.empty()) {
+            e_slots.emplace_back();
+            e_free.push_back(static_cast<int>(e_slots.size()) - 1);
+        }
+        slot = e_free.back();
+        if (dnsr_query_tagged(e_dnsr, type, cls, buf, slot) != 0) {
+            err = dnsr_errno(e_dnsr);
+            return (-1);
+        }
+        e_free.pop_back();
+        e_slots[ slot ].s_waiter = h;
+        e_pending++;
+        return (slot);
+    }
+
+    result
+    take(int slot) noexcept {
+        result r = std::move(e_slots[ slot ].s_result);
+
+        e_free.push_back(slot);
+        return (r);
+    }
+
+    DNSR             *e_dnsr;
+    std::vector<slot> e_slots;
+    std::vector<int>  e_free;
+    std::size_t       e_pending = 0;
+    int               e_fds[ 2 ];
+};
+
+} // namespace denser
+
+#endif /* DENSER_HPP */
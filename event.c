@@ -32,3 +32,40 @@ struct event eventlist[ 32 ] = {
         {DNSR_STATE_ASK, 0}, {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 1},
         {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 2}, {DNSR_STATE_WAIT, 1},
         {DNSR_STATE_ASK, 3}, {DNSR_STATE_WAIT, 16}, {DNSR_STATE_DONE, -1}};
+
+/* With DNSR_FLAG_RACE every name server is asked at once, and again each
+ * round, so a lost packet costs one round rather than a server's turn.
+ * Rounds end at 2, 5, 11, 23 and 47 sec, as the table above does.
+ */
+
+struct event eventlist_race[ 10 ] = {{DNSR_STATE_WAIT, 2},
+        {DNSR_STATE_ASK, DNSR_ASK_ALL}, {DNSR_STATE_WAIT, 3},
+        {DNSR_STATE_ASK, DNSR_ASK_ALL}, {DNSR_STATE_WAIT, 6},
+        {DNSR_STATE_ASK, DNSR_ASK_ALL}, {DNSR_STATE_WAIT, 12},
+        {DNSR_STATE_ASK, DNSR_ASK_ALL}, {DNSR_STATE_WAIT, 24},
+        {DNSR_STATE_DONE, -1}};
+
+/* With DNSR_FLAG_HEDGE the waits of the first round end at the percentile
+ * of the server last asked, see hedge.c.  The rest is as eventlist.
+ */
+
+struct event eventlist_hedge[ 32 ] = {
+        /* First round  0 - 3 sec. */
+        {DNSR_STATE_HEDGE, 1}, {DNSR_STATE_ASK, 1}, {DNSR_STATE_HEDGE, 1},
+        {DNSR_STATE_ASK, 2}, {DNSR_STATE_HEDGE, 1}, {DNSR_STATE_ASK, 3},
+        {DNSR_STATE_WAIT, 1},
+
+        /* Second round 4 - 11 sec. */
+        {DNSR_STATE_ASK, 0}, {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 1},
+        {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 2}, {DNSR_STATE_WAIT, 1},
+        {DNSR_STATE_ASK, 3}, {DNSR_STATE_WAIT, 5},
+
+        /* Third round  12 - 27 sec.*/
+        {DNSR_STATE_ASK, 0}, {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 1},
+        {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 2}, {DNSR_STATE_WAIT, 1},
+        {DNSR_STATE_ASK, 3}, {DNSR_STATE_WAIT, 13},
+
+        /* Final round  28 - 47 sec. */
+        {DNSR_STATE_ASK, 0}, {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 1},
+        {DNSR_STATE_WAIT, 1}, {DNSR_STATE_ASK, 2}, {DNSR_STATE_WAIT, 1},
+        {DNSR_STATE_ASK, 3}, {DNSR_STATE_WAIT, 16}, {DNSR_STATE_DONE, -1}};
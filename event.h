@@ -5,10 +5,17 @@
 #define DNSR_STATE_ASK 1
 #define DNSR_STATE_WAIT 2
 #define DNSR_STATE_DONE 3
+#define DNSR_STATE_HEDGE 4 /* a WAIT that may end early, see hedge.c */
+
+#define DNSR_ASK_ALL -1 /* e_value of an ASK that goes to every server */
 
 struct event {
     int e_type;
     int e_value;
 };
 
+extern struct event eventlist[ 32 ];
+extern struct event eventlist_race[ 10 ];
+extern struct event eventlist_hedge[ 32 ];
+
 #endif /* DENSER_EVENT_H */
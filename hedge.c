@@ -0,0 +1,131 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "event.h"
+#include "internal.h"
+#include "timeval.h"
+
+/*
+ * With hedging on, each name server's response times are kept in a small
+ * histogram, and the waits of the first round of eventlist_hedge end when
+ * the last server asked is slower than its own percentile, rather than
+ * after a whole second.  The next server is then asked alongside it, so
+ * only the slowest few percent of queries are sent twice.
+ *
+ * Buckets are about a factor of sqrt( 2 ) apart, from 1 ms to 1 sec; a wait
+ * never ends later than the eventlist would have it.  Counts are halved
+ * every DNSR_LAT_WINDOW samples, so the percentile follows a server that
+ * slows down.  A response to a query that was sent to its server more than
+ * once can't be timed, and isn't.
+ */
+
+#define DNSR_LAT_WINDOW 512 /* Samples between halvings */
+#define DNSR_LAT_MIN 16     /* Samples before a server's percentile is used */
+
+/* Upper bound of each bucket in ms */
+static const uint16_t dnsr_lat_bound[ DNSR_LAT_BUCKETS ] = {1, 2, 3, 4, 6, 8,
+        11, 16, 23, 32, 45, 64, 91, 128, 181, 256, 362, 512, 724, 1000};
+
+/*
+ * dnsr_config_hedge sets the percentile of a name server's response time
+ * after which the next server is asked too.  0 turns hedging off.
+ * DNSR_FLAG_HEDGE turns it on at DNSR_HEDGE_PERCENTILE.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_config_hedge(DNSR *dnsr, int percentile) {
+    if ((percentile != 0) && ((percentile < 50) || (percentile > 99))) {
+        DEBUG(fprintf(stderr, "dnsr_config_hedge: %d: bad percentile\n",
+                percentile));
+        dnsr->d_errno = DNSR_ERROR_CONFIG;
+        return (-1);
+    }
+    dnsr->d_hedge = percentile;
+    return 0;
+}
+
+/*
+ * Times the response from name server ns to p.
+ */
+
+void
+dnsr_hedge_sample(DNSR *dnsr, struct dnsr_pending *p, int ns) {
+    struct nsinfo *n = &dnsr->d_nsinfo[ ns ];
+    struct timeval cur, rtt;
+    long           ms;
+    int            i;
+
+    if ((dnsr->d_hedge == 0) || !timerisset(&p->p_sent[ ns ])) {
+        return;
+    }
+    if ((gettimeofday(&cur, NULL) < 0) ||
+            (tv_sub(&cur, &p->p_sent[ ns ], &rtt) != 0)) {
+        return;
+    }
+    /* Only the first response is timed */
+    timerclear(&p->p_sent[ ns ]);
+
+    ms = rtt.tv_sec * 1000 + rtt.tv_usec / 1000;
+    for (i = 0; i < DNSR_LAT_BUCKETS - 1; i++) {
+        if (ms < dnsr_lat_bound[ i ]) {
+            break;
+        }
+    }
+    n->ns_lat[ i ]++;
+
+    if (++n->ns_latcount >= DNSR_LAT_WINDOW) {
+        n->ns_latcount = 0;
+        for (i = 0; i < DNSR_LAT_BUCKETS; i++) {
+            n->ns_lat[ i ] /= 2;
+            n->ns_latcount += n->ns_lat[ i ];
+        }
+    }
+}
+
+/*
+ * Sets end to when p's current wait is over: e_value seconds after it was
+ * last sent, or sooner for a hedge.
+ */
+
+void
+dnsr_hedge_end(DNSR *dnsr, struct dnsr_pending *p, struct timeval *end) {
+    struct nsinfo *n = &dnsr->d_nsinfo[ p->p_ns ];
+    struct timeval wait;
+    unsigned int   target, sum = 0;
+    int            i;
+
+    end->tv_sec = p->p_querytime.tv_sec + p->p_events[ p->p_state ].e_value;
+    end->tv_usec = p->p_querytime.tv_usec;
+
+    if ((p->p_events[ p->p_state ].e_type != DNSR_STATE_HEDGE) ||
+            (dnsr->d_hedge == 0) || (n->ns_latcount < DNSR_LAT_MIN)) {
+        return;
+    }
+
+    target = (n->ns_latcount * dnsr->d_hedge + 99) / 100;
+    for (i = 0; i < DNSR_LAT_BUCKETS - 1; i++) {
+        if ((sum += n->ns_lat[ i ]) >= target) {
+            break;
+        }
+    }
+
+    wait.tv_sec = dnsr_lat_bound[ i ] / 1000;
+    wait.tv_usec = (dnsr_lat_bound[ i ] % 1000) * 1000;
+    if ((wait.tv_sec < p->p_events[ p->p_state ].e_value) &&
+            (tv_add(&p->p_querytime, &wait, &wait) == 0)) {
+        *end = wait;
+    }
+}
@@ -0,0 +1,405 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * dnsr_resolve_host( ) asks for A and AAAA records together, in one send
+ * of the UDP queue, and sorts the addresses that come back into the order
+ * of RFC 6724 section 6.  The source address for each destination is the
+ * one the kernel would pick, found by connecting an unsent UDP socket to
+ * it as getaddrinfo( ) does.
+ *
+ * Of the ten rules, 3 ( deprecated sources ), 4 ( home addresses ) and 7
+ * ( native transport ) need information the socket API doesn't give, and
+ * are skipped.  Rule 9, longest matching prefix, is only applied between
+ * IPv6 addresses, and to at most 64 bits, so that IPv4 round robin DNS is
+ * kept ( RFC 6724 section 2.1 allows this ).
+ */
+
+struct dnsr_policy {
+    uint8_t p_prefix[ 16 ];
+    int     p_len;
+    int     p_precedence;
+    int     p_label;
+};
+
+/* RFC 6724 2.1, longest prefix first */
+static const struct dnsr_policy dnsr_policy_table[] = {
+        {{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 1}, 128, 50, 0},
+        {{0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff}, 96, 35, 4},
+        {{0}, 96, 1, 3},
+        {{0x20, 0x01, 0, 0}, 32, 5, 5},
+        {{0x20, 0x02}, 16, 30, 2},
+        {{0x3f, 0xfe}, 16, 1, 12},
+        {{0xfe, 0xc0}, 10, 1, 11},
+        {{0xfc}, 7, 3, 13},
+        {{0}, 0, 40, 1},
+};
+
+#define DNSR_SCOPE_LINKLOCAL 2
+#define DNSR_SCOPE_SITELOCAL 5
+#define DNSR_SCOPE_GLOBAL 14
+
+struct dnsr_hostsort {
+    struct dnsr_addr hs_addr;
+    struct in6_addr  hs_dst; /* IPv4 is mapped, ::ffff:a.b.c.d */
+    struct in6_addr  hs_src;
+    int              hs_usable;
+    int              hs_index;
+};
+
+static void dnsr_host_source(struct dnsr_hostsort *);
+static int  dnsr_host_cmp(const void *, const void *);
+static int  dnsr_prefix_match(const struct in6_addr *, const uint8_t *, int);
+static int  dnsr_common_prefix(
+         const struct in6_addr *, const struct in6_addr *);
+static int  dnsr_scope(const struct in6_addr *);
+static const struct dnsr_policy *dnsr_policy(const struct in6_addr *);
+
+/*
+ * dnsr_resolve_host looks up the A and AAAA records of name at once and
+ * returns as many as max of the addresses, in the order they should be
+ * tried, in addrs.  It waits upto timeout, as dnsr_result does.  If only
+ * one of the two lookups has finished when timeout runs out, its addresses
+ * are returned.  The query made with dnsr_query, if any, is not touched.
+ *
+ * Return Values:
+ *      >=0     number of addresses in addrs
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_resolve_host(DNSR *dnsr, const char *name, struct timeval *timeout,
+        struct dnsr_addr *addrs, int max) {
+    struct dnsr_pending *p4, *p6;
+    int                  n = 0, err4 = 0, err6 = 0;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if ((p4 = dnsr_query_start(dnsr, DNSR_TYPE_A, DNSR_CLASS_IN, name)) ==
+            NULL) {
+        return (-1);
+    }
+    if ((p6 = dnsr_query_start(dnsr, DNSR_TYPE_AAAA, DNSR_CLASS_IN, name)) ==
+            NULL) {
+        dnsr_pending_free(dnsr, p4);
+        return (-1);
+    }
+    /* Both go out in one batch; a failed send finishes its query */
+    dnsr_udp_flush(dnsr);
+
+    /* While waiting on one, responses to the other are taken too */
+    if ((dnsr_run(dnsr, p4, timeout) != 0) ||
+            (dnsr_run(dnsr, p6, timeout) != 0)) {
+        dnsr_pending_free(dnsr, p4);
+        dnsr_pending_free(dnsr, p6);
+        return (-1);
+    }
+
+    n = dnsr_addr_collect(dnsr, p4, addrs, n, max, &err4);
+    n = dnsr_addr_collect(dnsr, p6, addrs, n, max, &err6);
+    dnsr_pending_free(dnsr, p4);
+    dnsr_pending_free(dnsr, p6);
+
+    if ((n == 0) && err4 && err6) {
+        /* NXDOMAIN is the same for both, otherwise say why A failed */
+        dnsr->d_errno = err4;
+        return (-1);
+    }
+
+    if (dnsr_addr_sort(dnsr, addrs, n) != 0) {
+        return (-1);
+    }
+    return (n);
+}
+
+/*
+ * Adds the A or AAAA records answering p to addrs, from n on, upto max,
+ * and returns the new count.  If p failed, err is set to why.  RRs are
+ * read with a cursor, so this works with DNSR_FLAG_LAZY and with RR types
+ * turned off by dnsr_config_type( ).
+ */
+
+int
+dnsr_addr_collect(DNSR *dnsr, struct dnsr_pending *p, struct dnsr_addr *addrs,
+        int n, int max, int *err) {
+    struct dnsr_cursor c;
+    const void        *rdata;
+    uint16_t           len;
+
+    if (!p->p_done) {
+        *err = DNSR_ERROR_TIMEOUT;
+        return (n);
+    }
+    if (p->p_result == NULL) {
+        *err = p->p_errno;
+        return (n);
+    }
+    if (p->p_result->r_rcode == DNSR_RC_NXDOMAIN) {
+        *err = DNSR_ERROR_NAME;
+        return (n);
+    }
+
+    dnsr_cursor_init(&c, p->p_result);
+    while ((n < max) && (dnsr_rr_next(dnsr, &c) == 1)) {
+        /* CNAMEs on the way are skipped, the addresses are at the end */
+        if ((dnsr_cursor_section(&c) != DNSR_SECTION_ANSWER) ||
+                (dnsr_cursor_class(&c) != DNSR_CLASS_IN)) {
+            continue;
+        }
+        rdata = dnsr_cursor_rdata(&c, &len);
+        if ((dnsr_cursor_type(&c) == DNSR_TYPE_A) &&
+                (len == sizeof(struct in_addr))) {
+            addrs[ n ].a_family = AF_INET;
+            memcpy(&addrs[ n++ ].a_v4, rdata, len);
+        } else if ((dnsr_cursor_type(&c) == DNSR_TYPE_AAAA) &&
+                   (len == sizeof(struct in6_addr))) {
+            addrs[ n ].a_family = AF_INET6;
+            memcpy(&addrs[ n++ ].a_v6, rdata, len);
+        }
+    }
+    return (n);
+}
+
+/*
+ * Sorts addrs into the order they should be tried in.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_addr_sort(DNSR *dnsr, struct dnsr_addr *addrs, int n) {
+    struct dnsr_hostsort *hs;
+    int                   i;
+
+    if (n < 2) {
+        return 0;
+    }
+
+    if ((hs = calloc(n, sizeof(struct dnsr_hostsort))) == NULL) {
+        DEBUG(perror("calloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+
+    for (i = 0; i < n; i++) {
+        hs[ i ].hs_addr = addrs[ i ];
+        hs[ i ].hs_index = i;
+        if (addrs[ i ].a_family == AF_INET) {
+            /* ::ffff:a.b.c.d */
+            hs[ i ].hs_dst.s6_addr[ 10 ] = 0xff;
+            hs[ i ].hs_dst.s6_addr[ 11 ] = 0xff;
+            memcpy(&hs[ i ].hs_dst.s6_addr[ 12 ], &addrs[ i ].a_v4,
+                    sizeof(struct in_addr));
+        } else {
+            hs[ i ].hs_dst = addrs[ i ].a_v6;
+        }
+        dnsr_host_source(&hs[ i ]);
+    }
+    qsort(hs, n, sizeof(struct dnsr_hostsort), dnsr_host_cmp);
+    for (i = 0; i < n; i++) {
+        addrs[ i ] = hs[ i ].hs_addr;
+    }
+
+    free(hs);
+    return 0;
+}
+
+/* Finds the source address the kernel would use to reach hs, if any */
+static void
+dnsr_host_source(struct dnsr_hostsort *hs) {
+    struct sockaddr_storage ss;
+    struct sockaddr_in     *sin;
+    struct sockaddr_in6    *sin6;
+    socklen_t               len;
+    int                     s;
+
+    memset(&ss, 0, sizeof(struct sockaddr_storage));
+    if (hs->hs_addr.a_family == AF_INET) {
+        sin = (struct sockaddr_in *)&ss;
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(53);
+        sin->sin_addr = hs->hs_addr.a_v4;
+        len = sizeof(struct sockaddr_in);
+    } else {
+        sin6 = (struct sockaddr_in6 *)&ss;
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(53);
+        sin6->sin6_addr = hs->hs_addr.a_v6;
+        len = sizeof(struct sockaddr_in6);
+    }
+
+    /* connect( ) on UDP only picks a route, nothing is sent */
+    if ((s = socket(hs->hs_addr.a_family, SOCK_DGRAM, 0)) < 0) {
+        return;
+    }
+    if (connect(s, (struct sockaddr *)&ss, len) != 0) {
+        close(s);
+        return;
+    }
+    len = sizeof(struct sockaddr_storage);
+    if (getsockname(s, (struct sockaddr *)&ss, &len) == 0) {
+        if (ss.ss_family == AF_INET) {
+            sin = (struct sockaddr_in *)&ss;
+            hs->hs_src.s6_addr[ 10 ] = 0xff;
+            hs->hs_src.s6_addr[ 11 ] = 0xff;
+            memcpy(&hs->hs_src.s6_addr[ 12 ], &sin->sin_addr,
+                    sizeof(struct in_addr));
+            hs->hs_usable = 1;
+        } else if (ss.ss_family == AF_INET6) {
+            hs->hs_src = ((struct sockaddr_in6 *)&ss)->sin6_addr;
+            hs->hs_usable = 1;
+        }
+    }
+    close(s);
+}
+
+/* RFC 6724 6, less than zero when a is to be tried first */
+static int
+dnsr_host_cmp(const void *va, const void *vb) {
+    const struct dnsr_hostsort *a = va, *b = vb;
+    const struct dnsr_policy   *da, *db;
+    int                         sa, sb, pa, pb;
+
+    /* Rule 1: Avoid unusable destinations */
+    if (a->hs_usable != b->hs_usable) {
+        return (b->hs_usable - a->hs_usable);
+    }
+
+    da = dnsr_policy(&a->hs_dst);
+    db = dnsr_policy(&b->hs_dst);
+    sa = dnsr_scope(&a->hs_dst);
+    sb = dnsr_scope(&b->hs_dst);
+
+    if (a->hs_usable) {
+        /* Rule 2: Prefer matching scope */
+        pa = (sa == dnsr_scope(&a->hs_src));
+        pb = (sb == dnsr_scope(&b->hs_src));
+        if (pa != pb) {
+            return (pb - pa);
+        }
+
+        /* Rule 5: Prefer matching label */
+        pa = (da->p_label == dnsr_policy(&a->hs_src)->p_label);
+        pb = (db->p_label == dnsr_policy(&b->hs_src)->p_label);
+        if (pa != pb) {
+            return (pb - pa);
+        }
+    }
+
+    /* Rule 6: Prefer higher precedence */
+    if (da->p_precedence != db->p_precedence) {
+        return (db->p_precedence - da->p_precedence);
+    }
+
+    /* Rule 8: Prefer smaller scope */
+    if (sa != sb) {
+        return (sa - sb);
+    }
+
+    /* Rule 9: Use longest matching prefix */
+    if (a->hs_usable && (a->hs_addr.a_family == AF_INET6) &&
+            (b->hs_addr.a_family == AF_INET6)) {
+        pa = dnsr_common_prefix(&a->hs_dst, &a->hs_src);
+        pb = dnsr_common_prefix(&b->hs_dst, &b->hs_src);
+        if (pa != pb) {
+            return (pb - pa);
+        }
+    }
+
+    /* Rule 10: Otherwise, leave the order unchanged */
+    return (a->hs_index - b->hs_index);
+}
+
+static int
+dnsr_prefix_match(const struct in6_addr *a, const uint8_t *prefix, int len) {
+    int i;
+
+    for (i = 0; i < len / 8; i++) {
+        if (a->s6_addr[ i ] != prefix[ i ]) {
+            return 0;
+        }
+    }
+    if (len % 8) {
+        return ((a->s6_addr[ i ] & (0xff << (8 - len % 8)) & 0xff) ==
+                prefix[ i ]);
+    }
+    return 1;
+}
+
+/* Leading bits a and b share, upto 64 */
+static int
+dnsr_common_prefix(const struct in6_addr *a, const struct in6_addr *b) {
+    int     i, n = 0;
+    uint8_t x;
+
+    for (i = 0; i < 8; i++) {
+        if ((x = a->s6_addr[ i ] ^ b->s6_addr[ i ]) != 0) {
+            while (!(x & 0x80)) {
+                x <<= 1;
+                n++;
+            }
+            return (n);
+        }
+        n += 8;
+    }
+    return (n);
+}
+
+static const struct dnsr_policy *
+dnsr_policy(const struct in6_addr *a) {
+    const struct dnsr_policy *p;
+
+    /* The last entry, ::/0, matches anything */
+    for (p = dnsr_policy_table;; p++) {
+        if (dnsr_prefix_match(a, p->p_prefix, p->p_len)) {
+            return (p);
+        }
+    }
+}
+
+/* RFC 6724 3.1 and 3.2 */
+static int
+dnsr_scope(const struct in6_addr *a) {
+    static const uint8_t mapped[ 12 ] = {
+            0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff};
+
+    if (memcmp(a->s6_addr, mapped, sizeof(mapped)) == 0) {
+        /* 127/8 and 169.254/16 are link-local, private space is global */
+        if ((a->s6_addr[ 12 ] == 127) ||
+                ((a->s6_addr[ 12 ] == 169) && (a->s6_addr[ 13 ] == 254))) {
+            return (DNSR_SCOPE_LINKLOCAL);
+        }
+        return (DNSR_SCOPE_GLOBAL);
+    }
+    if (a->s6_addr[ 0 ] == 0xff) {
+        return (a->s6_addr[ 1 ] & 0x0f);
+    }
+    if (IN6_IS_ADDR_LINKLOCAL(a) || IN6_IS_ADDR_LOOPBACK(a)) {
+        return (DNSR_SCOPE_LINKLOCAL);
+    }
+    if (IN6_IS_ADDR_SITELOCAL(a)) {
+        return (DNSR_SCOPE_SITELOCAL);
+    }
+    return (DNSR_SCOPE_GLOBAL);
+}
@@ -60,6 +60,13 @@
 #define DNSR_OFFSET 0xc000
 #define DNSR_EXTENDED_LABEL 0x4000
 
+/* Handle options set with dnsr_config( ), kept apart from the header flags */
+#define DNSR_OPT_LAZY 0x0001
+#define DNSR_OPT_AUTHORITY 0x0002
+#define DNSR_OPT_ADDITIONAL 0x0004
+#define DNSR_OPT_RACE 0x0008
+#define DNSR_OPT_TCPASYNC 0x0010 /* set by dnsr_service_new( ), see tcp.c */
+
 #ifdef sun
 #define MIN(a, b) ((a) < (b) ? (a) : (b))
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
@@ -71,30 +78,15 @@
 #define DEBUG(x)
 #endif
 
+#define DNSR_LAT_BUCKETS 20 /* Response time histogram, see hedge.c */
+
 struct nsinfo {
     struct sockaddr_storage ns_sa;
     uint16_t                ns_id;
     uint16_t                ns_udp;
-    int                     ns_asked;
     int                     ns_edns;
-};
-
-struct dnsr {
-    uint16_t       d_id;
-    uint16_t       d_flags;
-    char           d_dn[ DNSR_MAX_NAME + 1 ];
-    char           d_query[ DNSR_MAX_UDP ];
-    size_t         d_questionlen;
-    size_t         d_querylen;
-    int            d_querysent;
-    int            d_state;
-    int            d_errno;
-    struct nsinfo  d_nsinfo[ DNSR_MAX_NS ];
-    int            d_nscount;
-    int            d_nsresp;
-    int            d_fd;
-    int            d_fd6;
-    struct timeval d_querytime;
+    uint16_t                ns_lat[ DNSR_LAT_BUCKETS ];
+    unsigned int            ns_latcount;
 };
 
 struct dnsr_header {
@@ -106,19 +98,191 @@ struct dnsr_header {
     uint16_t h_arcount;
 };
 
-struct dnsr_result *dnsr_create_result(DNSR *, char *, int);
+#define DNSR_PENDING_HASH 256  /* Buckets in the table of queries by ID */
+#define DNSR_MAX_PENDING 16384 /* Most queries in flight on a handle */
+
+/* A query in flight, see pending.c */
+struct dnsr_pending {
+    struct dnsr_pending *p_hnext; /* hash chain */
+    struct dnsr_pending *p_next;  /* active list, done queue or free list */
+    struct dnsr_pending *p_prev;  /* active list */
+    struct dnsr_result  *p_result;
+    struct timeval       p_querytime; /* last time the query was sent */
+    size_t               p_questionlen;
+    size_t               p_querylen;
+    uint16_t             p_id;
+    struct event        *p_events;     /* retry schedule, see event.c */
+    int                  p_state;      /* index into p_events */
+    unsigned int         p_asked;      /* bitmask of name servers asked */
+    int                  p_ns;         /* name server last asked */
+    struct timeval       p_sent[ DNSR_MAX_NS ]; /* see hedge.c */
+    int                  p_done;
+    int                  p_tagged;
+    int                  p_tag;
+    int                  p_errno;      /* why it failed, once done */
+    int                  p_resp_errno; /* why the last response was bad */
+    int                  p_cnames;     /* CNAMEs followed, see cname.c */
+    struct dnsr_result  *p_chain;      /* the chain so far */
+    struct dnsr_tcp     *p_tcp;        /* TCP retry in flight, see tcp.c */
+    char                 p_query[ DNSR_MAX_UDP_BASIC ];
+};
+
+#define DNSR_SEND_BATCH 64 /* Most queries queued per socket, see udp.c */
+#define DNSR_RECV_BATCH 32 /* Most responses read at once */
+#define DNSR_TCP_MAX 32    /* Most TCP retries open at once, see tcp.c */
+
+/* A query waiting to be sent */
+struct dnsr_udpsend {
+    struct dnsr_pending *s_pending;
+    int                  s_ns;
+    size_t               s_len;
+    struct dnsr_header   s_header; /* with the ID for s_ns */
+};
+
+/* A received response */
+struct dnsr_udprecv {
+    char                    r_buf[ DNSR_MAX_UDP ];
+    int                     r_len;
+    struct sockaddr_storage r_from;
+};
+
+struct dnsr {
+    uint16_t                  d_flags;
+    unsigned int              d_opts;
+    uint8_t                   d_skiptypes[ (DNSR_MAX_TYPE + 1) / 8 ];
+    int                       d_errno;
+    struct nsinfo             d_nsinfo[ DNSR_MAX_NS ];
+    int                       d_nscount;
+    int                       d_nsresp;
+    int                       d_fd;
+    int                       d_fd6;
+    /* Queries in flight by ID, see pending.c */
+    struct dnsr_pending      *d_pending[ DNSR_PENDING_HASH ];
+    struct dnsr_pending      *d_active;   /* queries in flight */
+    struct dnsr_pending      *d_current;  /* the dnsr_query( ) query */
+    struct dnsr_pending      *d_done;     /* finished tagged queries */
+    struct dnsr_pending      *d_donetail;
+    struct dnsr_pending      *d_pendfree; /* recycled pendings */
+    int                       d_npending;
+    int                       d_ntagged;  /* tagged queries not collected */
+    int                       d_npendfree;
+    struct dnsr_result_block *d_pool;     /* released results, see arena.c */
+    int                       d_poolcount;
+    char                     *d_tcpbuf;   /* TCP receive buffer */
+    size_t                    d_tcpbufsize;
+    struct dnsr_tcp          *d_tcp;      /* TCP retries, see tcp.c */
+    int                       d_ntcp;
+    struct dnsr_udpsend       d_sendq[ 2 ][ DNSR_SEND_BATCH ]; /* v4, v6 */
+    int                       d_sendcount[ 2 ];
+    struct dnsr_udprecv      *d_recvq; /* receive ring */
+    DNSR_POLL                *d_poll;  /* see poll.c */
+    int                       d_pollindex;
+    int                       d_pollerr;
+    struct dnsr_uring        *d_uring; /* see uring.c */
+    struct acav              *d_acav;  /* resolv.conf parsing */
+    uint64_t                  d_rand;  /* PRNG state, see dnsr_rand( ) */
+    int                       d_cnamedepth; /* CNAMEs to follow, cname.c */
+    int                       d_hedge;      /* percentile, see hedge.c */
+    DNSR_CACHE               *d_cache;      /* see cache.c */
+};
+
+/* A decoded name, keyed by the offset its labels start at in the message */
+struct dnsr_name {
+    char        *n_name;
+    unsigned int n_offset;
+};
+
+/* A result and its arena, see arena.c */
+struct dnsr_result_block {
+    struct dnsr_result        rb_result;    /* must be first */
+    struct dnsr_chunk        *rb_chunks;    /* overflow chunks */
+    char                     *rb_cur;
+    char                     *rb_end;
+    char                     *rb_msg;       /* copy of the response */
+    unsigned int              rb_msglen;
+    unsigned int              rb_first;     /* offset of the first RR */
+    int                       rb_lazy;      /* RRs only reachable by cursor */
+    struct dnsr_name         *rb_names;     /* name pool, see parse.c */
+    unsigned int              rb_nameslots;
+    unsigned int              rb_namecount;
+    size_t                    rb_size;      /* size of the block */
+    struct timeval            rb_querytime; /* TTLs count from here */
+    struct dnsr_result_block *rb_next;      /* handle's free list */
+};
+
+struct pollfd;
+
+struct dnsr_result *dnsr_arena_new(DNSR *, size_t);
+void               *dnsr_arena_alloc(DNSR *, struct dnsr_result *, size_t);
+void               *dnsr_arena_calloc(DNSR *, struct dnsr_result *, size_t);
+char *dnsr_arena_strndup(DNSR *, struct dnsr_result *, const char *, size_t);
+void  dnsr_arena_free(struct dnsr_result *);
+
+struct dnsr_pending *dnsr_query_start(DNSR *, uint16_t, uint16_t, const char *);
+int                  dnsr_query_restart(DNSR *, struct dnsr_pending *, const char *);
+uint32_t             dnsr_rand(DNSR *);
+struct dnsr_pending *dnsr_pending_new(DNSR *);
+struct dnsr_pending *dnsr_pending_lookup(DNSR *, uint16_t);
+void                 dnsr_pending_rekey(DNSR *, struct dnsr_pending *);
+void                 dnsr_pending_done(
+                        DNSR *, struct dnsr_pending *, struct dnsr_result *, int);
+void                 dnsr_pending_tag(DNSR *, struct dnsr_pending *, int);
+struct dnsr_pending *dnsr_pending_next_done(DNSR *);
+void                 dnsr_pending_free(DNSR *, struct dnsr_pending *);
+void                 dnsr_pending_clear(DNSR *);
+
+struct dnsr_result *dnsr_create_result(DNSR *, char *, int, size_t);
 int                 dnsr_display_header(struct dnsr_header *h);
-void                dnsr_free_ip_info(struct ip_info *);
-void                dnsr_free_dnsr_string(struct dnsr_string *);
 int                 dnsr_labels_to_name(
                         DNSR *, char *, char **, unsigned int, char *, char **, char *);
 int dnsr_labels_to_string(DNSR *, char **, char *, char *);
+int dnsr_parse_header(DNSR *, char **, char *, uint16_t *, uint16_t *,
+        uint32_t *, uint16_t *);
+int dnsr_skip_name(DNSR *, char *, char **, unsigned int);
+int dnsr_skip_type(DNSR *, uint16_t);
 int dnsr_match_additional(DNSR *, struct dnsr_result *);
-int dnsr_match_ip(DNSR *, struct dnsr_rr *, struct dnsr_rr *);
+int dnsr_match_rr(DNSR *, struct dnsr_result *, struct dnsr_rr *);
+int dnsr_match_ip(const struct dnsr_rr *, const struct dnsr_rr *);
 int dnsr_parse_rr(
         DNSR *, struct dnsr_rr *, struct dnsr_result *, char *, char **, int);
-char *dnsr_send_query_tcp(DNSR *, int, int *);
-int   dnsr_validate_resp(DNSR *, char *, struct sockaddr *);
+void  dnsr_udp_queue(DNSR *, struct dnsr_pending *, int, int);
+int   dnsr_udp_flush(DNSR *);
+void  dnsr_udp_forget(DNSR *, struct dnsr_pending *);
+void  dnsr_udp_failed(DNSR *, struct dnsr_pending *, int);
+int   dnsr_udp_recv(DNSR *, int);
+int   dnsr_uring_init(DNSR *);
+void  dnsr_uring_free(DNSR *);
+int   dnsr_uring_fd(DNSR *);
+int   dnsr_uring_send(DNSR *, struct dnsr_udpsend *, int);
+void  dnsr_uring_forget(DNSR *, struct dnsr_pending *);
+int   dnsr_uring_wait(DNSR *, int);
+void  dnsr_response(DNSR *, char *, int, struct sockaddr *);
+void  dnsr_response_use(DNSR *, struct dnsr_pending *, char *, int, int);
+int   dnsr_tcp_start(DNSR *, struct dnsr_pending *, int);
+void  dnsr_tcp_close(DNSR *, struct dnsr_pending *);
+int   dnsr_tcp_fds(DNSR *, struct pollfd *, int);
+void  dnsr_tcp_process(DNSR *, int);
+int   dnsr_run(DNSR *, struct dnsr_pending *, struct timeval *);
+int   dnsr_addr_collect(
+          DNSR *, struct dnsr_pending *, struct dnsr_addr *, int, int, int *);
+int   dnsr_addr_sort(DNSR *, struct dnsr_addr *, int);
+char *dnsr_send_query_tcp(DNSR *, struct dnsr_pending *, int, int *);
+int   dnsr_send_pending(DNSR *, struct dnsr_pending *, int);
+int   dnsr_send_all(DNSR *, struct dnsr_pending *);
+int   dnsr_validate_resp(
+          DNSR *, char *, int, struct sockaddr *, struct dnsr_pending **);
 int   dnsr_validate_result(DNSR *, struct dnsr_result *);
+int   dnsr_cname_follow(DNSR *, struct dnsr_pending *, struct dnsr_result *);
+void  dnsr_hedge_sample(DNSR *, struct dnsr_pending *, int);
+void  dnsr_hedge_end(DNSR *, struct dnsr_pending *, struct timeval *);
+int   dnsr_cache_answer(DNSR *, struct dnsr_pending *);
+void  dnsr_cache_put(DNSR *, struct dnsr_pending *, struct dnsr_result *);
+int   dnsr_cache_samekey(const char *, const char *, unsigned int);
+struct dnsr_shm *dnsr_shm_new(int);
+void             dnsr_shm_free(struct dnsr_shm *);
+unsigned int     dnsr_shm_get(struct dnsr_shm *, uint32_t, const char *,
+                    unsigned int, time_t, char *, time_t *);
+void             dnsr_shm_put(struct dnsr_shm *, uint32_t, const char *,
+                    unsigned int, unsigned int, time_t, time_t);
 
 #endif /* DENSER_INTERNAL_H */
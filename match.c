@@ -17,109 +17,106 @@
 #include "denser.h"
 #include "internal.h"
 
+/*
+ * Attaches the A and AAAA records of the additional section to the RRs that
+ * name them, as one array of addresses per RR.  Matches are counted before
+ * they are copied so that each array is allocated once, at its final size.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
 int
 dnsr_match_additional(DNSR *dnsr, struct dnsr_result *result) {
-    int i, j;
+    int i;
 
-    for (i = 0; i < result->r_arcount; i++) {
-        if ((result->r_additional[ i ].rr_type != DNSR_TYPE_A) &&
-                (result->r_additional[ i ].rr_type != DNSR_TYPE_AAAA)) {
-            DEBUG(printf("%s rr_type %d\n", &result->r_additional[ i ].rr_name,
-                    result->r_additional[ i ].rr_type));
-            continue;
-        }
+    /* Lazy results have no decoded RRs to attach addresses to */
+    if (((struct dnsr_result_block *)result)->rb_lazy) {
+        return 0;
+    }
 
-        for (j = 0; j < result->r_ancount; j++) {
-            if (dnsr_match_ip(dnsr, &result->r_additional[ i ],
-                        &result->r_answer[ j ]) < 0) {
-                return 0;
-            }
+    if (result->r_arcount == 0) {
+        return 0;
+    }
+
+    for (i = 0; i < result->r_ancount; i++) {
+        if (dnsr_match_rr(dnsr, result, &result->r_answer[ i ]) < 0) {
+            return (-1);
         }
-        for (j = 0; j < result->r_nscount; j++) {
-            if (dnsr_match_ip(dnsr, &result->r_additional[ i ],
-                        &result->r_ns[ j ]) < 0) {
-                return 0;
-            }
+    }
+    for (i = 0; i < result->r_nscount; i++) {
+        if (dnsr_match_rr(dnsr, result, &result->r_ns[ i ]) < 0) {
+            return (-1);
         }
     }
     return 0;
 }
 
 int
-dnsr_match_ip(DNSR *dnsr, struct dnsr_rr *ar_rr, struct dnsr_rr *rr) {
-    struct ip_info      *ip_info, *prev_ip_info;
-    struct sockaddr_in  *addr4;
-    struct sockaddr_in6 *addr6;
-
-    switch (rr->rr_type) {
+dnsr_match_rr(DNSR *dnsr, struct dnsr_result *result, struct dnsr_rr *rr) {
+    struct dnsr_rr   *ar_rr;
+    struct dnsr_addr *addr;
+    int               i, count = 0;
 
-    case DNSR_TYPE_A:
-    case DNSR_TYPE_AAAA:
+    for (i = 0; i < result->r_arcount; i++) {
+        if (dnsr_match_ip(&result->r_additional[ i ], rr)) {
+            count++;
+        }
+    }
+    if (count == 0) {
         return 0;
+    }
 
-    case DNSR_TYPE_CNAME:
-    case DNSR_TYPE_MB:
-    case DNSR_TYPE_MD:
-    case DNSR_TYPE_MF:
-    case DNSR_TYPE_MG:
-    case DNSR_TYPE_MR:
-    case DNSR_TYPE_NS:
-    case DNSR_TYPE_PTR:
-        if (strcmp(ar_rr->rr_name, rr->rr_dn.dn_name) != 0) {
-            return 0;
-        }
-        break;
+    if ((rr->rr_addr = dnsr_arena_alloc(
+                 dnsr, result, count * sizeof(struct dnsr_addr))) == NULL) {
+        return (-1);
+    }
 
-    case DNSR_TYPE_MX:
-        if (strcmp(ar_rr->rr_name, rr->rr_mx.mx_exchange) != 0) {
-            return 0;
+    for (i = 0; i < result->r_arcount; i++) {
+        ar_rr = &result->r_additional[ i ];
+        if (!dnsr_match_ip(ar_rr, rr)) {
+            continue;
         }
-        break;
 
-    case DNSR_TYPE_SOA:
-        if (strcmp(ar_rr->rr_name, rr->rr_soa.soa_mname) != 0) {
-            return 0;
+        addr = &rr->rr_addr[ rr->rr_naddr++ ];
+        if (ar_rr->rr_type == DNSR_TYPE_A) {
+            addr->a_family = AF_INET;
+            addr->a_v4 = ar_rr->rr_a.a_address;
+        } else {
+            addr->a_family = AF_INET6;
+            addr->a_v6 = ar_rr->rr_aaaa.aaaa_address;
         }
-        break;
+    }
 
-    case DNSR_TYPE_SRV:
-        if (strcmp(ar_rr->rr_name, rr->rr_srv.srv_target) != 0) {
-            return 0;
-        }
-        break;
+    return (count);
+}
 
-    default:
-        DEBUG(fprintf(
-                stderr, "create_result: unknown type: %d\n", rr->rr_type));
-        dnsr->d_errno = DNSR_ERROR_TYPE;
-        return (-1);
+/*
+ * Return Values:
+ *      1       ar_rr is an address for the name rr points at
+ *      0       it isn't
+ */
+
+int
+dnsr_match_ip(const struct dnsr_rr *ar_rr, const struct dnsr_rr *rr) {
+    const char *target;
+
+    if ((ar_rr->rr_type != DNSR_TYPE_A) && (ar_rr->rr_type != DNSR_TYPE_AAAA)) {
+        return 0;
     }
 
-    if ((ip_info = malloc(sizeof(struct ip_info))) == NULL) {
-        DEBUG(perror("malloc"));
-        dnsr->d_errno = DNSR_ERROR_SYSTEM;
-        return (-1);
+    if ((rr->rr_type == DNSR_TYPE_A) || (rr->rr_type == DNSR_TYPE_AAAA)) {
+        return 0;
     }
-    memset(ip_info, 0, sizeof(struct ip_info));
-
-    if (ar_rr->rr_type == DNSR_TYPE_A) {
-        addr4 = (struct sockaddr_in *)&(ip_info->ip_sa);
-        addr4->sin_family = AF_INET;
-        addr4->sin_addr = ar_rr->rr_a.a_address;
-    } else {
-        addr6 = (struct sockaddr_in6 *)&(ip_info->ip_sa);
-        addr6->sin6_family = AF_INET6;
-        addr6->sin6_addr = ar_rr->rr_aaaa.aaaa_address;
+
+    if ((target = dnsr_rr_target(rr)) == NULL) {
+        return 0;
     }
 
-    if (rr->rr_ip == NULL) {
-        rr->rr_ip = ip_info;
-    } else {
-        prev_ip_info = rr->rr_ip;
-        while (prev_ip_info->ip_next != NULL) {
-            prev_ip_info = prev_ip_info->ip_next;
-        }
-        prev_ip_info->ip_next = ip_info;
+    /* Pooled names are usually the same string */
+    if ((ar_rr->rr_name != target) && (strcmp(ar_rr->rr_name, target) != 0)) {
+        return 0;
     }
 
     return 1;
@@ -0,0 +1,393 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * dnsr_resolve_mx( ) is the lookup a mail client does before it connects:
+ * the MX records of a domain, and the addresses of every exchanger.  As
+ * soon as the MX response is read, the A and AAAA lookups for exchangers
+ * that came without glue in the additional section are all started, and
+ * go out in one send of the UDP queue, so the whole thing costs about two
+ * round trips however many exchangers there are.
+ */
+
+struct dnsr_mx {
+    char                 mx_name[ DNSR_MAX_NAME + 1 ];
+    uint16_t             mx_preference;
+    uint32_t             mx_shuffle;
+    int                  mx_glue4;
+    int                  mx_glue6;
+    int                  mx_room;
+    int                  mx_naddr;
+    int                  mx_errno;
+    struct dnsr_addr    *mx_addr;
+    struct dnsr_pending *mx_p4;
+    struct dnsr_pending *mx_p6;
+};
+
+static int  dnsr_mx_cmp(const void *, const void *);
+static int  dnsr_mx_find(struct dnsr_mx *, int, const char *);
+static void dnsr_mx_glue(DNSR *, struct dnsr_result *, struct dnsr_mx *, int);
+static void dnsr_mx_start(DNSR *, struct dnsr_mx *, int);
+static int  dnsr_mx_addrmax(struct dnsr_pending *);
+static void dnsr_mx_free(DNSR *, struct dnsr_mx *, int);
+
+/*
+ * dnsr_resolve_mx looks up the mail exchangers of name and their addresses.
+ * On success *exchangers is set to an array of them, in the order they
+ * should be tried: by preference, with equal preferences shuffled as RFC
+ * 5321 section 5.1 asks.  Each exchanger's addresses are in the order
+ * dnsr_resolve_host( ) would give them.  The array is one allocation, to be
+ * freed with dnsr_free_val( ).
+ *
+ * A domain with no MX records has the implicit MX of RFC 5321, the domain
+ * itself.  A domain with a null MX ( RFC 7505 ) has no exchangers, and 0 is
+ * returned.  An exchanger whose address lookup failed has ex_errno set to
+ * why; it is still returned, with whatever addresses were found.
+ *
+ * It waits upto timeout, as dnsr_result does, for everything.  The query
+ * made with dnsr_query, if any, is not touched.
+ *
+ * Return Values:
+ *      >=0     number of exchangers
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_resolve_mx(DNSR *dnsr, const char *name, struct timeval *timeout,
+        struct dnsr_exchanger **exchangers) {
+    struct dnsr_pending   *p;
+    struct dnsr_result    *result;
+    struct dnsr_cursor     c;
+    struct dnsr_mx        *mx;
+    struct dnsr_exchanger *ex;
+    struct dnsr_addr      *a;
+    const uint8_t         *rdata;
+    char                  *names;
+    size_t                 len, size, naddr = 0;
+    uint16_t               rdlength;
+    int                    i, j, n = 0, nnull = 0, err;
+
+    if (!dnsr) {
+        return (-1);
+    }
+    *exchangers = NULL;
+
+    if ((p = dnsr_query_start(dnsr, DNSR_TYPE_MX, DNSR_CLASS_IN, name)) ==
+            NULL) {
+        return (-1);
+    }
+    dnsr_udp_flush(dnsr);
+    if (dnsr_run(dnsr, p, timeout) != 0) {
+        dnsr_pending_free(dnsr, p);
+        return (-1);
+    }
+    if (!p->p_done) {
+        dnsr_pending_free(dnsr, p);
+        dnsr->d_errno = DNSR_ERROR_TIMEOUT;
+        return (-1);
+    }
+    if ((result = p->p_result) == NULL) {
+        dnsr->d_errno = p->p_errno;
+        dnsr_pending_free(dnsr, p);
+        return (-1);
+    }
+    if (result->r_rcode == DNSR_RC_NXDOMAIN) {
+        dnsr_pending_free(dnsr, p);
+        dnsr->d_errno = DNSR_ERROR_NAME;
+        return (-1);
+    }
+
+    if ((mx = calloc(result->r_ancount + 1, sizeof(struct dnsr_mx))) ==
+            NULL) {
+        DEBUG(perror("calloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        dnsr_pending_free(dnsr, p);
+        return (-1);
+    }
+
+    /* CNAMEs on the way are skipped, the MX records are at the end */
+    dnsr_cursor_init(&c, result);
+    while ((n < (int)result->r_ancount) && (dnsr_rr_next(dnsr, &c) == 1)) {
+        if ((dnsr_cursor_section(&c) != DNSR_SECTION_ANSWER) ||
+                (dnsr_cursor_type(&c) != DNSR_TYPE_MX) ||
+                (dnsr_cursor_class(&c) != DNSR_CLASS_IN)) {
+            continue;
+        }
+        rdata = dnsr_cursor_rdata(&c, &rdlength);
+        if ((rdlength < 3) || (dnsr_cursor_target(dnsr, &c, mx[ n ].mx_name,
+                                       sizeof(mx[ n ].mx_name)) != 0)) {
+            continue;
+        }
+        /* A root exchanger says the domain takes no mail, RFC 7505 */
+        if ((mx[ n ].mx_name[ 0 ] == '\0') ||
+                (strcmp(mx[ n ].mx_name, ".") == 0)) {
+            nnull++;
+            continue;
+        }
+        mx[ n ].mx_preference = (rdata[ 0 ] << 8) | rdata[ 1 ];
+        /* An exchanger listed twice is tried at its best preference */
+        if ((i = dnsr_mx_find(mx, n, mx[ n ].mx_name)) >= 0) {
+            if (mx[ n ].mx_preference < mx[ i ].mx_preference) {
+                mx[ i ].mx_preference = mx[ n ].mx_preference;
+            }
+            continue;
+        }
+        mx[ n ].mx_shuffle = dnsr_rand(dnsr);
+        n++;
+    }
+
+    if ((n == 0) && (nnull == 0)) {
+        /* RFC 5321 5.1, the domain is its own exchanger */
+        if ((len = strlen(name)) > DNSR_MAX_NAME) {
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            dnsr_mx_free(dnsr, mx, n);
+            dnsr_pending_free(dnsr, p);
+            return (-1);
+        }
+        memcpy(mx[ 0 ].mx_name, name, len);
+        if ((len > 1) && (mx[ 0 ].mx_name[ len - 1 ] == '.')) {
+            len--;
+        }
+        mx[ 0 ].mx_name[ len ] = '\0';
+        n = 1;
+    }
+
+    if (n == 0) {
+        dnsr_mx_free(dnsr, mx, n);
+        dnsr_pending_free(dnsr, p);
+        return 0;
+    }
+
+    qsort(mx, n, sizeof(struct dnsr_mx), dnsr_mx_cmp);
+
+    /* Count the glue, and send for the addresses that aren't there */
+    dnsr_mx_glue(dnsr, result, mx, n);
+    dnsr_mx_start(dnsr, mx, n);
+
+    for (i = 0; i < n; i++) {
+        if (((mx[ i ].mx_p4 != NULL) &&
+                    (dnsr_run(dnsr, mx[ i ].mx_p4, timeout) != 0)) ||
+                ((mx[ i ].mx_p6 != NULL) &&
+                        (dnsr_run(dnsr, mx[ i ].mx_p6, timeout) != 0))) {
+            dnsr_mx_free(dnsr, mx, n);
+            dnsr_pending_free(dnsr, p);
+            return (-1);
+        }
+        mx[ i ].mx_room = mx[ i ].mx_glue4 + mx[ i ].mx_glue6 +
+                          dnsr_mx_addrmax(mx[ i ].mx_p4) +
+                          dnsr_mx_addrmax(mx[ i ].mx_p6);
+        naddr += mx[ i ].mx_room;
+    }
+
+    /* Exchangers, then addresses, then names */
+    size = naddr * sizeof(struct dnsr_addr);
+    for (i = 0; i < n; i++) {
+        size += sizeof(struct dnsr_exchanger) + strlen(mx[ i ].mx_name) + 1;
+    }
+    if ((ex = malloc(size)) == NULL) {
+        DEBUG(perror("malloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        dnsr_mx_free(dnsr, mx, n);
+        dnsr_pending_free(dnsr, p);
+        return (-1);
+    }
+    a = (struct dnsr_addr *)(ex + n);
+    names = (char *)(a + naddr);
+
+    for (i = 0; i < n; i++) {
+        len = strlen(mx[ i ].mx_name) + 1;
+        memcpy(names, mx[ i ].mx_name, len);
+        ex[ i ].ex_name = names;
+        names += len;
+        ex[ i ].ex_preference = mx[ i ].mx_preference;
+        ex[ i ].ex_addr = mx[ i ].mx_addr = a;
+        ex[ i ].ex_naddr = 0;
+        ex[ i ].ex_errno = DNSR_ERROR_NONE;
+        a += mx[ i ].mx_room;
+    }
+
+    /* Glue first, then what was looked up */
+    dnsr_mx_glue(dnsr, result, mx, n);
+    dnsr_pending_free(dnsr, p);
+
+    for (i = 0; i < n; i++) {
+        ex[ i ].ex_naddr = mx[ i ].mx_naddr;
+        if (mx[ i ].mx_errno != 0) {
+            ex[ i ].ex_errno = mx[ i ].mx_errno;
+        }
+        for (j = 0; j < 2; j++) {
+            if ((p = (j ? mx[ i ].mx_p6 : mx[ i ].mx_p4)) == NULL) {
+                continue;
+            }
+            err = 0;
+            ex[ i ].ex_naddr = dnsr_addr_collect(dnsr, p, ex[ i ].ex_addr,
+                    ex[ i ].ex_naddr, mx[ i ].mx_room, &err);
+            if ((err != 0) && (ex[ i ].ex_errno == DNSR_ERROR_NONE)) {
+                ex[ i ].ex_errno = err;
+            }
+        }
+        if (dnsr_addr_sort(dnsr, ex[ i ].ex_addr, ex[ i ].ex_naddr) != 0) {
+            free(ex);
+            dnsr_mx_free(dnsr, mx, n);
+            return (-1);
+        }
+    }
+
+    dnsr_mx_free(dnsr, mx, n);
+    *exchangers = ex;
+    return (n);
+}
+
+/*
+ * Walks the additional section of result for A and AAAA records owned by
+ * the exchangers.  Until the exchangers have somewhere to put them, in
+ * mx_addr, they are only counted, in mx_glue4 and mx_glue6.
+ */
+
+static void
+dnsr_mx_glue(DNSR *dnsr, struct dnsr_result *result, struct dnsr_mx *mx,
+        int n) {
+    struct dnsr_cursor c;
+    struct dnsr_mx    *m;
+    char               owner[ DNSR_MAX_NAME + 1 ];
+    const void        *rdata;
+    uint16_t           len;
+    sa_family_t        family;
+    int                i;
+
+    dnsr_cursor_init(&c, result);
+    while (dnsr_rr_next(dnsr, &c) == 1) {
+        if ((dnsr_cursor_section(&c) != DNSR_SECTION_ADDITIONAL) ||
+                (dnsr_cursor_class(&c) != DNSR_CLASS_IN)) {
+            continue;
+        }
+        rdata = dnsr_cursor_rdata(&c, &len);
+        if ((dnsr_cursor_type(&c) == DNSR_TYPE_A) &&
+                (len == sizeof(struct in_addr))) {
+            family = AF_INET;
+        } else if ((dnsr_cursor_type(&c) == DNSR_TYPE_AAAA) &&
+                   (len == sizeof(struct in6_addr))) {
+            family = AF_INET6;
+        } else {
+            continue;
+        }
+        if ((dnsr_cursor_name(dnsr, &c, owner, sizeof(owner)) != 0) ||
+                ((i = dnsr_mx_find(mx, n, owner)) < 0)) {
+            continue;
+        }
+        m = &mx[ i ];
+
+        if (m->mx_addr == NULL) {
+            if (family == AF_INET) {
+                m->mx_glue4++;
+            } else {
+                m->mx_glue6++;
+            }
+        } else if (m->mx_naddr < m->mx_glue4 + m->mx_glue6) {
+            m->mx_addr[ m->mx_naddr ].a_family = family;
+            memcpy(&m->mx_addr[ m->mx_naddr++ ].a_u, rdata, len);
+        }
+    }
+}
+
+/*
+ * Starts the A and AAAA lookups for exchangers without glue of that type,
+ * and sends them all at once.  An exchanger whose lookup couldn't be
+ * started has mx_errno set to why.
+ */
+
+static void
+dnsr_mx_start(DNSR *dnsr, struct dnsr_mx *mx, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (mx[ i ].mx_glue4 == 0) {
+            if ((mx[ i ].mx_p4 = dnsr_query_start(dnsr, DNSR_TYPE_A,
+                         DNSR_CLASS_IN, mx[ i ].mx_name)) == NULL) {
+                mx[ i ].mx_errno = dnsr->d_errno;
+            }
+        }
+        if (mx[ i ].mx_glue6 == 0) {
+            if ((mx[ i ].mx_p6 = dnsr_query_start(dnsr, DNSR_TYPE_AAAA,
+                         DNSR_CLASS_IN, mx[ i ].mx_name)) == NULL) {
+                mx[ i ].mx_errno = dnsr->d_errno;
+            }
+        }
+    }
+    /* A failed send finishes its query */
+    dnsr_udp_flush(dnsr);
+}
+
+/*
+ * Most addresses a finished lookup can give.  They are read with a cursor,
+ * so this counts from the message header rather than the result, which
+ * may have had RRs left out by dnsr_config_type( ).
+ */
+
+static int
+dnsr_mx_addrmax(struct dnsr_pending *p) {
+    struct dnsr_header *h;
+
+    if ((p == NULL) || !p->p_done || (p->p_result == NULL)) {
+        return 0;
+    }
+    h = (struct dnsr_header *)((struct dnsr_result_block *)p->p_result)
+                ->rb_msg;
+    return (ntohs(h->h_ancount));
+}
+
+/* The first of n exchangers named name, or -1 */
+static int
+dnsr_mx_find(struct dnsr_mx *mx, int n, const char *name) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (strcasecmp(mx[ i ].mx_name, name) == 0) {
+            return (i);
+        }
+    }
+    return (-1);
+}
+
+static int
+dnsr_mx_cmp(const void *va, const void *vb) {
+    const struct dnsr_mx *a = va, *b = vb;
+
+    if (a->mx_preference != b->mx_preference) {
+        return ((a->mx_preference < b->mx_preference) ? -1 : 1);
+    }
+    if (a->mx_shuffle != b->mx_shuffle) {
+        return ((a->mx_shuffle < b->mx_shuffle) ? -1 : 1);
+    }
+    return 0;
+}
+
+static void
+dnsr_mx_free(DNSR *dnsr, struct dnsr_mx *mx, int n) {
+    int i;
+
+    for (i = 0; i < n; i++) {
+        if (mx[ i ].mx_p4 != NULL) {
+            dnsr_pending_free(dnsr, mx[ i ].mx_p4);
+        }
+        if (mx[ i ].mx_p6 != NULL) {
+            dnsr_pending_free(dnsr, mx[ i ].mx_p6);
+        }
+    }
+    free(mx);
+}
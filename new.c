@@ -14,17 +14,28 @@
 #include <sys/types.h>
 #include <unistd.h>
 
+#ifdef HAVE_GETRANDOM
+#include <sys/random.h>
+#endif /* HAVE_GETRANDOM */
+
+#include "argcargv.h"
 #include "denser.h"
 #include "internal.h"
 
+static uint64_t dnsr_rand_seed(DNSR *);
+
 /*
  * Creates a new DNSR structure which will be used for all future denser
  * calls.  This only fails on system error.  Other functions have been moved
  * out of this routine so they can provide better error reporting via
  * the DNSR->d_errno.
  *
- * The returned dnsr handle is configured for recursion.  Can be changed with
- * dnsr_config( ).
+ * The returned dnsr handle is configured for recursion and to decode every
+ * section of a response.  Can be changed with dnsr_config( ).
+ *
+ * A handle keeps all of its own state, so different handles can be used
+ * from different threads at once without locking.  One handle must not be
+ * used by two threads at the same time.
  *
  * Return Values:
  *      DNSR *  success
@@ -33,19 +44,14 @@
 
 DNSR *
 dnsr_new(void) {
-    DNSR          *dnsr;
-    struct timeval tv;
-
-    if (gettimeofday(&tv, NULL) != 0) {
-        return (NULL);
-    }
-    srand((unsigned int)getpid() ^ tv.tv_usec ^ tv.tv_sec);
+    DNSR *dnsr;
 
     if ((dnsr = calloc(1, sizeof(DNSR))) == NULL) {
         return (NULL);
     }
 
     dnsr->d_nsresp = -1;
+    dnsr->d_rand = dnsr_rand_seed(dnsr);
 
     if ((dnsr->d_fd6 = socket(AF_INET6, SOCK_DGRAM, 0)) < 0) {
         DEBUG(perror("dnsr_open: AF_INET6 socket"));
@@ -62,15 +68,72 @@ dnsr_new(void) {
 
     /* XXX - do we need to check error here? */
     dnsr_config(dnsr, DNSR_FLAG_RECURSION, DNSR_FLAG_ON);
+    dnsr_config(dnsr, DNSR_FLAG_AUTHORITY, DNSR_FLAG_ON);
+    dnsr_config(dnsr, DNSR_FLAG_ADDITIONAL, DNSR_FLAG_ON);
 
     return (dnsr);
 }
 
+/*
+ * Seeds the handle's PRNG, from the kernel if it can, otherwise from the
+ * time, the pid and the handle's address, so that handles made at the same
+ * moment by different threads or processes still differ.
+ */
+
+static uint64_t
+dnsr_rand_seed(DNSR *dnsr) {
+    uint64_t       seed = 0;
+    struct timeval tv;
+
+#ifdef HAVE_GETRANDOM
+    if (getrandom(&seed, sizeof(seed), GRND_NONBLOCK) == sizeof(seed)) {
+        return (seed ? seed : 1);
+    }
+#endif /* HAVE_GETRANDOM */
+
+    gettimeofday(&tv, NULL);
+    seed = ((uint64_t)tv.tv_sec << 20) ^ tv.tv_usec ^
+           ((uint64_t)getpid() << 32) ^ (uint64_t)(uintptr_t)dnsr;
+
+    /* splitmix64 finalizer, so nearby seeds give unrelated states */
+    seed += 0x9e3779b97f4a7c15ULL;
+    seed = (seed ^ (seed >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    seed = (seed ^ (seed >> 27)) * 0x94d049bb133111ebULL;
+    seed ^= seed >> 31;
+
+    return (seed ? seed : 1);
+}
+
+/*
+ * xorshift64*, a few instructions per call and no shared state, in place of
+ * rand( ).  Used for query IDs and the per-server ID masks.
+ */
+
+uint32_t
+dnsr_rand(DNSR *dnsr) {
+    uint64_t x = dnsr->d_rand;
+
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    dnsr->d_rand = x;
+    return ((x * 0x2545f4914f6cdd1dULL) >> 32);
+}
+
 void
 dnsr_free(DNSR *dnsr) {
     if (dnsr == NULL) {
         return;
     }
+    if (dnsr->d_poll != NULL) {
+        dnsr_poll_remove(dnsr->d_poll, dnsr);
+    }
+    dnsr_pending_clear(dnsr);
+    dnsr_uring_free(dnsr);
+    dnsr_free_pool(dnsr);
+    if (dnsr->d_acav != NULL) {
+        acav_free(dnsr->d_acav);
+    }
     if (dnsr->d_fd >= 0) {
         if (close(dnsr->d_fd) != 0) {
             DEBUG(perror("dnsr_free: close"));
@@ -33,7 +33,20 @@ struct rr {
     char    *r_rdata;
 };
 
+static void  dnsr_parse_edns(DNSR *, struct dnsr_result *, uint16_t, uint8_t);
+static int   dnsr_parse_section(DNSR *, struct dnsr_result *, int, unsigned int,
+          struct dnsr_rr *, char **);
+static char *dnsr_parse_name(
+        DNSR *, struct dnsr_result *, char *, char **, int);
+static char *dnsr_parse_string(DNSR *, struct dnsr_result *, char **, char *);
+static char *dnsr_pool_get(struct dnsr_result *, unsigned int);
+static void  dnsr_pool_put(struct dnsr_result *, unsigned int, char *);
+
 /*
+ * Matches a response to the query in flight it answers, by the server it
+ * came from and its ID, and checks that it carries that query's question.
+ * The query is returned in *pending.
+ *
  * Return Values:
  *  <0  fatal error
  *   0  okay
@@ -41,21 +54,20 @@ struct rr {
  */
 
 int
-dnsr_validate_resp(DNSR *dnsr, char *resp, struct sockaddr *reply_from) {
-    int                 ns;
-    struct dnsr_header *h;
-    uint16_t            flags;
-    char                word[ DNSR_MAX_NAME ];
+dnsr_validate_resp(DNSR *dnsr, char *resp, int resplen,
+        struct sockaddr *reply_from, struct dnsr_pending **pending) {
+    int                  ns;
+    struct dnsr_header  *h;
+    struct dnsr_pending *p;
+    uint16_t             flags;
+
+    if (resplen < sizeof(struct dnsr_header)) {
+        DEBUG(fprintf(stderr, "Response too short\n"));
+        return (DNSR_ERROR_NS_INVALID);
+    }
 
     /* Determine which server responded */
     for (ns = 0; ns < dnsr->d_nscount; ns++) {
-
-        /* Skip servers we've not asked */
-        if (!dnsr->d_nsinfo[ ns ].ns_asked) {
-            DEBUG(fprintf(stderr, "ns %d not asked\n", ns));
-            continue;
-        }
-
         if (dnsr->d_nsinfo[ ns ].ns_sa.ss_family != reply_from->sa_family) {
             continue;
         }
@@ -91,14 +103,16 @@ dnsr_validate_resp(DNSR *dnsr, char *resp, struct sockaddr *reply_from) {
         return (DNSR_ERROR_NS_INVALID);
     }
 
-    /* Check ID */
-    if (dnsr->d_id != (dnsr->d_nsinfo[ dnsr->d_nsresp ].ns_id ^
-                              ntohs(((struct dnsr_header *)(resp))->h_id))) {
+    /* Find the query by ID, and skip servers we've not asked */
+    if (((p = dnsr_pending_lookup(dnsr,
+                  dnsr->d_nsinfo[ ns ].ns_id ^
+                          ntohs(((struct dnsr_header *)(resp))->h_id))) ==
+                NULL) ||
+            !(p->p_asked & (1 << ns))) {
         DEBUG(fprintf(stderr, "ID does not match\n"));
         return (DNSR_ERROR_NS_INVALID);
     }
-
-    memset(word, 0, DNSR_MAX_NAME);
+    *pending = p;
 
     h = (struct dnsr_header *)resp;
     DEBUG(dnsr_display_header(h));
@@ -139,9 +153,10 @@ dnsr_validate_resp(DNSR *dnsr, char *resp, struct sockaddr *reply_from) {
     */
 
     /* Check that the answer was for our question */
-    if (memcmp((void *)(dnsr->d_query + sizeof(struct dnsr_header)),
-                (void *)(resp + sizeof(struct dnsr_header)),
-                dnsr->d_questionlen - sizeof(struct dnsr_header)) != 0) {
+    if ((resplen < p->p_questionlen) ||
+            (memcmp((void *)(p->p_query + sizeof(struct dnsr_header)),
+                     (void *)(resp + sizeof(struct dnsr_header)),
+                     p->p_questionlen - sizeof(struct dnsr_header)) != 0)) {
         DEBUG(fprintf(stderr, "Response question does not match query\n"));
         return (DNSR_ERROR_QUESTION_WRONG);
     }
@@ -201,71 +216,114 @@ dnsr_validate_result(DNSR *dnsr, struct dnsr_result *result) {
     return 0;
 }
 
+/*
+ * Every RR takes at least a one octet name and a ten octet fixed part, so
+ * a header claiming more records than that is bogus.
+ */
+#define DNSR_MIN_RR 11
+
 struct dnsr_result *
-dnsr_create_result(DNSR *dnsr, char *resp, int resplen) {
-    char               *resp_cur;
-    struct dnsr_header *h;
-    int                 i, j;
-    struct dnsr_result *result;
-    struct dnsr_rr      temp;
-
-    if ((result = malloc(sizeof(struct dnsr_result))) == NULL) {
-        DEBUG(perror("malloc"));
-        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+dnsr_create_result(
+        DNSR *dnsr, char *resp, int resplen, size_t questionlen) {
+    char                     *resp_cur;
+    struct dnsr_header       *h;
+    int                       i, j, rc;
+    unsigned int              count, slots = 0;
+    size_t                    size;
+    struct dnsr_result       *result;
+    struct dnsr_result_block *rb;
+    struct dnsr_rr            temp;
+    struct dnsr_cursor        c;
+
+    h = (struct dnsr_header *)resp;
+    count = ntohs(h->h_ancount) + ntohs(h->h_nscount) + ntohs(h->h_arcount);
+    if ((resplen < questionlen) ||
+            (count * DNSR_MIN_RR > resplen - questionlen)) {
+        DEBUG(fprintf(stderr, "create_result: %u records: too many\n", count));
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
         return (NULL);
     }
-    memset(result, 0, sizeof(struct dnsr_result));
 
-    h = (struct dnsr_header *)resp;
+    /* Room for a copy of the message, every record, the name pool and for
+     * the names in the message to be decompressed once each.  Lazy results
+     * only need the message.
+     */
+    size = resplen;
+    if (!(dnsr->d_opts & DNSR_OPT_LAZY)) {
+        for (slots = 8; slots < 2 * count; slots <<= 1)
+            ;
+        size += count * sizeof(struct dnsr_rr) +
+                slots * sizeof(struct dnsr_name) + (2 * resplen);
+    }
+    if ((result = dnsr_arena_new(dnsr, size)) == NULL) {
+        return (NULL);
+    }
+    rb = (struct dnsr_result_block *)result;
+
+    /* Keep the message, records are parsed from and can point into it */
+    if ((rb->rb_msg = dnsr_arena_alloc(dnsr, result, resplen)) == NULL) {
+        goto error;
+    }
+    memcpy(rb->rb_msg, resp, resplen);
+    rb->rb_msglen = resplen;
+    rb->rb_first = questionlen;
+    resp = rb->rb_msg;
+
     result->r_rcode = ntohs(h->h_flags) & DNSR_RCODE;
     result->r_ancount = ntohs(h->h_ancount);
     result->r_nscount = ntohs(h->h_nscount);
     result->r_arcount = ntohs(h->h_arcount);
-    resp_cur = resp + dnsr->d_questionlen;
+    resp_cur = resp + questionlen;
+
+    if (dnsr->d_opts & DNSR_OPT_LAZY) {
+        /* Walk the records once to check their bounds and find the OPT RR,
+         * everything else is decoded on demand.
+         */
+        rb->rb_lazy = 1;
+        dnsr_cursor_init(&c, result);
+        while ((rc = dnsr_rr_next(dnsr, &c)) > 0) {
+            if ((c.c_section == DNSR_SECTION_ADDITIONAL) &&
+                    (c.c_type == DNSR_TYPE_OPT)) {
+                dnsr_parse_edns(dnsr, result, c.c_class, c.c_ttl >> 24);
+            }
+        }
+        if (rc < 0) {
+            goto error;
+        }
+        return (result);
+    }
+
+    if ((rb->rb_names = dnsr_arena_calloc(
+                 dnsr, result, slots * sizeof(struct dnsr_name))) == NULL) {
+        goto error;
+    }
+    rb->rb_nameslots = slots;
 
     if (result->r_ancount > 0) {
-        if ((result->r_answer = malloc(
+        if ((result->r_answer = dnsr_arena_calloc(dnsr, result,
                      sizeof(struct dnsr_rr) * result->r_ancount)) == NULL) {
-            DEBUG(perror("malloc"));
-            free(result);
-            dnsr->d_errno = DNSR_ERROR_SYSTEM;
-            return (NULL);
+            goto error;
         }
-        memset(result->r_answer, 0, sizeof(struct dnsr_rr) * result->r_ancount);
     }
-    if (result->r_nscount > 0) {
-        if ((result->r_ns = malloc(
+    if ((result->r_nscount > 0) && (dnsr->d_opts & DNSR_OPT_AUTHORITY)) {
+        if ((result->r_ns = dnsr_arena_calloc(dnsr, result,
                      sizeof(struct dnsr_rr) * result->r_nscount)) == NULL) {
-            DEBUG(perror("malloc"));
-            free(result->r_answer);
-            free(result);
-            dnsr->d_errno = DNSR_ERROR_SYSTEM;
-            return (NULL);
+            goto error;
         }
-        memset(result->r_ns, 0, sizeof(struct dnsr_rr) * result->r_nscount);
     }
-    if (result->r_arcount > 0) {
-        if ((result->r_additional = malloc(
+    if ((result->r_arcount > 0) && (dnsr->d_opts & DNSR_OPT_ADDITIONAL)) {
+        if ((result->r_additional = dnsr_arena_calloc(dnsr, result,
                      sizeof(struct dnsr_rr) * result->r_arcount)) == NULL) {
-            DEBUG(perror("malloc"));
-            free(result->r_answer);
-            free(result->r_ns);
-            free(result);
-            dnsr->d_errno = DNSR_ERROR_SYSTEM;
-            return (NULL);
+            goto error;
         }
-        memset(result->r_additional, 0,
-                sizeof(struct dnsr_rr) * result->r_arcount);
     }
 
     DEBUG(fprintf(stderr, "Answer section\n"));
-    for (i = 0; i < result->r_ancount; i++) {
-        if (dnsr_parse_rr(dnsr, &result->r_answer[ i ], result, resp, &resp_cur,
-                    resplen) != 0) {
-            DEBUG(fprintf(stderr, "parse_rr failed\n"));
-            goto error;
-        }
+    if ((rc = dnsr_parse_section(dnsr, result, DNSR_SECTION_ANSWER,
+                 result->r_ancount, result->r_answer, &resp_cur)) < 0) {
+        goto error;
     }
+    result->r_ancount = rc;
 
     if (result->r_ancount > 0) {
         /* XXX - move into dnsr_sort_result( ) */
@@ -277,8 +335,10 @@ dnsr_create_result(DNSR *dnsr, char *resp, int resplen) {
                 if (result->r_answer[ j ].rr_type != DNSR_TYPE_MX) {
                     continue;
                 }
-                if (strcmp(result->r_answer[ i ].rr_name,
-                            result->r_answer[ j ].rr_name) != 0) {
+                if ((result->r_answer[ i ].rr_name !=
+                            result->r_answer[ j ].rr_name) &&
+                        (strcmp(result->r_answer[ i ].rr_name,
+                                 result->r_answer[ j ].rr_name) != 0)) {
                     continue;
                 }
                 if (result->r_answer[ i ].rr_mx.mx_preference >
@@ -295,35 +355,87 @@ dnsr_create_result(DNSR *dnsr, char *resp, int resplen) {
     }
 
     DEBUG(fprintf(stderr, "\nNS Authority\n"));
-    for (i = 0; i < result->r_nscount; i++) {
-        if (dnsr_parse_rr(dnsr, &result->r_ns[ i ], result, resp, &resp_cur,
-                    resplen) != 0) {
-            DEBUG(fprintf(stderr, "parse_rr failed\n"));
-            goto error;
-        }
+    if ((rc = dnsr_parse_section(dnsr, result, DNSR_SECTION_AUTHORITY,
+                 result->r_nscount, result->r_ns, &resp_cur)) < 0) {
+        goto error;
     }
+    result->r_nscount = rc;
 
-    for (i = 0; i < result->r_arcount; i++) {
-        if (dnsr_parse_rr(dnsr, &result->r_additional[ i ], result, resp,
-                    &resp_cur, resplen) != 0) {
-            DEBUG(fprintf(stderr, "parse_rr failed\n"));
-            goto error;
-        }
+    if ((rc = dnsr_parse_section(dnsr, result, DNSR_SECTION_ADDITIONAL,
+                 result->r_arcount, result->r_additional, &resp_cur)) < 0) {
+        goto error;
     }
+    result->r_arcount = rc;
 
     return (result);
 
 error:
-    dnsr_free_result(result);
+    dnsr_release_result(dnsr, result);
     return (NULL);
 }
 
+/*
+ * Parses count RRs of a section into rrs.  RRs of types turned off with
+ * dnsr_config_type( ), and all of them if rrs is NULL, are stepped over
+ * using their rdlength and left out.  The OPT RR is always looked at.
+ *
+ * Return Values:
+ *      >=0     number of RRs in rrs
+ *      -1      error - check dnsr_errno
+ */
+
+static int
+dnsr_parse_section(DNSR *dnsr, struct dnsr_result *result, int section,
+        unsigned int count, struct dnsr_rr *rrs, char **resp_cur) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    char                     *rr_begin;
+    char                     *resp_end = rb->rb_msg + rb->rb_msglen;
+    unsigned int              i, kept = 0;
+    uint16_t                  type, class, rdlength;
+    uint32_t                  ttl;
+
+    for (i = 0; i < count; i++) {
+        rr_begin = *resp_cur;
+        if (dnsr_skip_name(dnsr, rb->rb_msg, resp_cur, rb->rb_msglen) != 0) {
+            return (-1);
+        }
+        if (dnsr_parse_header(dnsr, resp_cur, resp_end, &type, &class, &ttl,
+                    &rdlength) != 0) {
+            return (-1);
+        }
+        if (*resp_cur + rdlength > resp_end) {
+            DEBUG(fprintf(stderr, "parse_section: invalid rdlength\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+
+        if ((section == DNSR_SECTION_ADDITIONAL) && (type == DNSR_TYPE_OPT)) {
+            dnsr_parse_edns(dnsr, result, class, ttl >> 24);
+        }
+
+        if ((rrs == NULL) || dnsr_skip_type(dnsr, type)) {
+            DEBUG(fprintf(stderr, "parse_section: skipping type %d\n", type));
+            *resp_cur += rdlength;
+            continue;
+        }
+
+        *resp_cur = rr_begin;
+        if (dnsr_parse_rr(dnsr, &rrs[ kept ], result, rb->rb_msg, resp_cur,
+                    rb->rb_msglen) != 0) {
+            DEBUG(fprintf(stderr, "parse_rr failed\n"));
+            return (-1);
+        }
+        kept++;
+    }
+
+    return (kept);
+}
+
 int
 dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
         char *resp_begin, char **resp_cur, int resplen)
 
 {
-    char *dn_cur;
     char *resp_end;
     DEBUG(char buf[ INET6_ADDRSTRLEN ]);
     resp_end = resp_begin + resplen;
@@ -331,37 +443,16 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
     /* Parse common RR info */
 
     /* Name */
-    dn_cur = rr->rr_name;
-    if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen, rr->rr_name,
-                &dn_cur, rr->rr_name + DNSR_MAX_NAME) < 0) {
+    if ((rr->rr_name = dnsr_parse_name(
+                 dnsr, result, resp_begin, resp_cur, resplen)) == NULL) {
         return (-1);
     }
     DEBUG(fprintf(stderr, "%s\n", rr->rr_name));
 
-    /* Check for size of header */
-    if (*resp_cur + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) +
-                    sizeof(uint16_t) >
-            resp_end) {
-        DEBUG(fprintf(stderr, "parse_rr: no room for header\n"));
-        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+    if (dnsr_parse_header(dnsr, resp_cur, resp_end, &rr->rr_type,
+                &rr->rr_class, &rr->rr_ttl, &rr->rr_rdlength) != 0) {
         return (-1);
     }
-    /* Type */
-    memcpy(&rr->rr_type, *resp_cur, sizeof(uint16_t));
-    rr->rr_type = htons(rr->rr_type);
-    *resp_cur += sizeof(uint16_t);
-    /* Class */
-    memcpy(&rr->rr_class, *resp_cur, sizeof(uint16_t));
-    rr->rr_class = htons(rr->rr_class);
-    *resp_cur += sizeof(uint16_t);
-    /* TTL */
-    memcpy(&rr->rr_ttl, *resp_cur, sizeof(uint32_t));
-    rr->rr_ttl = htonl(rr->rr_ttl);
-    *resp_cur += sizeof(uint32_t);
-    /* RD Length */
-    memcpy(&rr->rr_rdlength, *resp_cur, sizeof(uint16_t));
-    rr->rr_rdlength = htons(rr->rr_rdlength);
-    *resp_cur += sizeof(uint16_t);
     /* RFC 1035 3.3
      * The following RR definitions are expected to occur, at least
      * potentially, in all classes.  In particular, NS, SOA, CNAME and PTR
@@ -382,26 +473,21 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
     case DNSR_TYPE_MR:
     case DNSR_TYPE_NS:
     case DNSR_TYPE_PTR:
-
-        dn_cur = rr->rr_dn.dn_name;
-        if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen,
-                    rr->rr_dn.dn_name, &dn_cur,
-                    rr->rr_dn.dn_name + DNSR_MAX_NAME) < 0) {
+        if ((rr->rr_dn.dn_name = dnsr_parse_name(
+                     dnsr, result, resp_begin, resp_cur, resplen)) == NULL) {
             return (-1);
         }
         DEBUG(fprintf(stderr, "%-21s", rr->rr_dn.dn_name));
         break;
 
     case DNSR_TYPE_HINFO:
-        dn_cur = rr->rr_hinfo.hi_cpu;
-        if (dnsr_labels_to_string(dnsr, resp_cur, resp_begin + resplen,
-                    rr->rr_hinfo.hi_cpu) < 0) {
+        if ((rr->rr_hinfo.hi_cpu = dnsr_parse_string(
+                     dnsr, result, resp_cur, resp_end)) == NULL) {
             return (-1);
         }
         DEBUG(fprintf(stderr, "%s ", rr->rr_hinfo.hi_cpu));
-        dn_cur = rr->rr_hinfo.hi_os;
-        if (dnsr_labels_to_string(dnsr, resp_cur, resp_begin + resplen,
-                    rr->rr_hinfo.hi_os) < 0) {
+        if ((rr->rr_hinfo.hi_os = dnsr_parse_string(
+                     dnsr, result, resp_cur, resp_end)) == NULL) {
             return (-1);
         }
 
@@ -418,10 +504,8 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
         memcpy(&rr->rr_mx.mx_preference, *resp_cur, sizeof(uint16_t));
         rr->rr_mx.mx_preference = ntohs(rr->rr_mx.mx_preference);
         *resp_cur += sizeof(uint16_t);
-        dn_cur = rr->rr_mx.mx_exchange;
-        if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen,
-                    rr->rr_mx.mx_exchange, &dn_cur,
-                    rr->rr_mx.mx_exchange + DNSR_MAX_NAME) < 0) {
+        if ((rr->rr_mx.mx_exchange = dnsr_parse_name(
+                     dnsr, result, resp_begin, resp_cur, resplen)) == NULL) {
             return (-1);
         }
         DEBUG(fprintf(stderr, "%s\tpreference: %d\n", rr->rr_mx.mx_exchange,
@@ -429,16 +513,12 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
         break;
 
     case DNSR_TYPE_SOA:
-        dn_cur = rr->rr_soa.soa_mname;
-        if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen,
-                    rr->rr_soa.soa_mname, &dn_cur,
-                    rr->rr_soa.soa_mname + DNSR_MAX_NAME) < 0) {
+        if ((rr->rr_soa.soa_mname = dnsr_parse_name(
+                     dnsr, result, resp_begin, resp_cur, resplen)) == NULL) {
             return (-1);
         }
-        dn_cur = rr->rr_soa.soa_rname;
-        if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen,
-                    rr->rr_soa.soa_rname, &dn_cur,
-                    rr->rr_soa.soa_rname + DNSR_MAX_NAME) < 0) {
+        if ((rr->rr_soa.soa_rname = dnsr_parse_name(
+                     dnsr, result, resp_begin, resp_cur, resplen)) == NULL) {
             return (-1);
         }
         /* Check for size of prefernce */
@@ -475,22 +555,56 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
         /* RFC 1035 3.3.14 TXT RDATA format
              * TXT-DATA        One or more <character-string>s.
              */
-        char                *txt_end = *resp_cur + rr->rr_rdlength;
-        struct dnsr_string **dnsr_string = &rr->rr_txt.txt_data;
-        while (*resp_cur < txt_end) {
-            *dnsr_string = malloc(sizeof(struct dnsr_string));
-            memset(*dnsr_string, 0, sizeof(struct dnsr_string));
-            if (dnsr_labels_to_string(dnsr, resp_cur, txt_end,
-                        (*dnsr_string)->s_string) < 0) {
+        char    *txt_end = *resp_cur + rr->rr_rdlength;
+        char    *txt_cur;
+        uint16_t count = 0, len = 0, i;
+
+        if (txt_end > resp_end) {
+            DEBUG(fprintf(stderr, "parse_rr: invalid rdlength\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+
+        /* Size everything up first, the strings are then copied once */
+        for (txt_cur = *resp_cur; txt_cur < txt_end;
+                txt_cur += (uint8_t)*txt_cur + 1) {
+            if (txt_cur + (uint8_t)*txt_cur + 1 > txt_end) {
+                DEBUG(fprintf(stderr, "parse_rr: invalid txt length\n"));
+                dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
                 return (-1);
             }
-            DEBUG(fprintf(stderr, "txt: %s\n", (*dnsr_string)->s_string));
-            dnsr_string = &(*dnsr_string)->s_next;
+            count++;
+            len += (uint8_t)*txt_cur;
+        }
+
+        if (((rr->rr_txt.txt_off = dnsr_arena_alloc(dnsr, result,
+                      (count + 1) * sizeof(uint16_t))) == NULL) ||
+                ((rr->rr_txt.txt_data = dnsr_arena_alloc(
+                          dnsr, result, len + 1)) == NULL)) {
+            return (-1);
+        }
+        rr->rr_txt.txt_count = count;
+
+        len = 0;
+        for (i = 0; i < count; i++) {
+            rr->rr_txt.txt_off[ i ] = len;
+            memcpy(rr->rr_txt.txt_data + len, *resp_cur + 1,
+                    (uint8_t)**resp_cur);
+            len += (uint8_t)**resp_cur;
+            *resp_cur += (uint8_t)**resp_cur + 1;
         }
+        rr->rr_txt.txt_off[ count ] = len;
+        rr->rr_txt.txt_data[ len ] = '\0';
+        DEBUG(fprintf(stderr, "txt: %s\n", rr->rr_txt.txt_data));
         break;
     }
     /* XXX - this case needs review */
     case DNSR_TYPE_A: {
+        if (rr->rr_rdlength != sizeof(int32_t)) {
+            DEBUG(fprintf(stderr, "parse_rr: invalid rdlength\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
         if (rr->rr_class == DNSR_CLASS_IN) {
             memcpy(&(rr->rr_a.a_address.s_addr), *resp_cur, sizeof(int32_t));
             *resp_cur += sizeof(int32_t);
@@ -506,6 +620,11 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
     }
 
     case DNSR_TYPE_AAAA: {
+        if (rr->rr_rdlength != 16) {
+            DEBUG(fprintf(stderr, "parse_rr: invalid rdlength\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
         if (rr->rr_class == DNSR_CLASS_IN) {
             memcpy(&(rr->rr_aaaa.aaaa_address.s6_addr), *resp_cur, 16);
             *resp_cur += 16;
@@ -521,12 +640,8 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
     }
 
     case DNSR_TYPE_OPT:
-        DEBUG(fprintf(stderr, "edns: max udp payload: %d\n", rr->rr_class));
-        dnsr->d_nsinfo[ dnsr->d_nsresp ].ns_udp = rr->rr_class;
         rr->rr_opt.opt_udp = rr->rr_class;
         rr->rr_opt.opt_rcode = (rr->rr_ttl >> 24);
-        result->r_rcode |= (rr->rr_opt.opt_rcode << 4);
-        DEBUG(fprintf(stderr, "edns: real rcode: %d\n", result->r_rcode));
         rr->rr_opt.opt_version = (rr->rr_ttl >> 16 & 0x00ff);
         rr->rr_opt.opt_flags = (rr->rr_ttl & 0x0000ffff);
         DEBUG(fprintf(stderr, "edns: flags: %x\n", rr->rr_ttl));
@@ -547,12 +662,10 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
                     dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
                     return (-1);
                 }
-                if ((opt = malloc(sizeof(struct edns_opt))) == NULL) {
-                    DEBUG(perror("malloc"));
-                    dnsr->d_errno = DNSR_ERROR_SYSTEM;
+                if ((opt = dnsr_arena_calloc(
+                             dnsr, result, sizeof(struct edns_opt))) == NULL) {
                     return (-1);
                 }
-                memset(opt, 0, sizeof(struct edns_opt));
                 memcpy(&opt->opt_code, *resp_cur, sizeof(uint16_t));
                 opt->opt_code = ntohs(opt->opt_code);
                 *resp_cur += sizeof(uint16_t);
@@ -566,12 +679,10 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
                     return (-1);
                 }
                 if (opt->opt_len > 0) {
-                    if ((opt->opt_data = malloc(opt->opt_len)) == NULL) {
-                        DEBUG(perror("malloc"));
-                        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+                    if ((opt->opt_data = dnsr_arena_alloc(
+                                 dnsr, result, opt->opt_len)) == NULL) {
                         return (-1);
                     }
-                    memset(opt->opt_data, 0, opt->opt_len);
                     memcpy(opt->opt_data, *resp_cur, opt->opt_len);
                     *resp_cur += opt->opt_len;
                 }
@@ -607,10 +718,8 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
         rr->rr_srv.srv_port = ntohs(rr->rr_srv.srv_port);
         *resp_cur += sizeof(uint16_t);
 
-        dn_cur = rr->rr_srv.srv_target;
-        if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen,
-                    rr->rr_srv.srv_target, &dn_cur,
-                    rr->rr_srv.srv_target + DNSR_MAX_NAME) < 0) {
+        if ((rr->rr_srv.srv_target = dnsr_parse_name(
+                     dnsr, result, resp_begin, resp_cur, resplen)) == NULL) {
             return (-1);
         }
         DEBUG(fprintf(stderr, "%s\tpriority: %d\tweight: %d\tport: %d\n",
@@ -618,7 +727,7 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
                 rr->rr_srv.srv_weight, rr->rr_srv.srv_port));
         break;
 
-    /* Also catches TYPE_NULL */
+    /* Also catches TYPE_NULL, whose RDATA is left in the message */
     default:
         DEBUG(fprintf(stderr, "parse_rr: %d: unknown type\n", rr->rr_type));
         DEBUG(fprintf(
@@ -629,6 +738,9 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
             return (-1);
         }
 
+        if (rr->rr_rdlength > 0) {
+            rr->rr_null.null_name = *resp_cur;
+        }
         *resp_cur += rr->rr_rdlength;
     }
 
@@ -643,6 +755,59 @@ dnsr_parse_rr(DNSR *dnsr, struct dnsr_rr *rr, struct dnsr_result *result,
     return 0;
 }
 
+/*
+ * RFC 6891 6.1.3 OPT Record TTL Field Use
+ * The extended RCODE forms the upper 8 bits of the response code, and the
+ * requestor's UDP payload size is carried in CLASS.  A cached response came
+ * from no server in particular, and d_nsresp is -1.
+ */
+
+static void
+dnsr_parse_edns(DNSR *dnsr, struct dnsr_result *result, uint16_t udp,
+        uint8_t rcode) {
+    DEBUG(fprintf(stderr, "edns: max udp payload: %d\n", udp));
+    if (dnsr->d_nsresp >= 0) {
+        dnsr->d_nsinfo[ dnsr->d_nsresp ].ns_udp = udp;
+    }
+    result->r_rcode |= (rcode << 4);
+    DEBUG(fprintf(stderr, "edns: real rcode: %d\n", result->r_rcode));
+}
+
+/*
+ * Reads the fixed part of an RR, leaving *resp_cur at the RDATA.
+ */
+
+int
+dnsr_parse_header(DNSR *dnsr, char **resp_cur, char *resp_end, uint16_t *type,
+        uint16_t *class, uint32_t *ttl, uint16_t *rdlength) {
+    /* Check for size of header */
+    if (*resp_cur + sizeof(uint16_t) + sizeof(uint16_t) + sizeof(uint32_t) +
+                    sizeof(uint16_t) >
+            resp_end) {
+        DEBUG(fprintf(stderr, "parse_rr: no room for header\n"));
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+        return (-1);
+    }
+    /* Type */
+    memcpy(type, *resp_cur, sizeof(uint16_t));
+    *type = ntohs(*type);
+    *resp_cur += sizeof(uint16_t);
+    /* Class */
+    memcpy(class, *resp_cur, sizeof(uint16_t));
+    *class = ntohs(*class);
+    *resp_cur += sizeof(uint16_t);
+    /* TTL */
+    memcpy(ttl, *resp_cur, sizeof(uint32_t));
+    *ttl = ntohl(*ttl);
+    *resp_cur += sizeof(uint32_t);
+    /* RD Length */
+    memcpy(rdlength, *resp_cur, sizeof(uint16_t));
+    *rdlength = ntohs(*rdlength);
+    *resp_cur += sizeof(uint16_t);
+
+    return 0;
+}
+
 int
 dnsr_display_header(struct dnsr_header *h) {
     uint16_t flags;
@@ -767,6 +932,24 @@ dnsr_labels_to_string(
     return 0;
 }
 
+/*
+ * Decode a <character-string> into a NUL terminated copy sized to fit.
+ */
+
+static char *
+dnsr_parse_string(DNSR *dnsr, struct dnsr_result *result, char **resp_cur,
+        char *resp_end) {
+    char  buf[ DNSR_MAX_STRING + 1 ];
+    char *begin = *resp_cur;
+
+    if (dnsr_labels_to_string(dnsr, resp_cur, resp_end, buf) < 0) {
+        return (NULL);
+    }
+
+    /* length octet plus data */
+    return (dnsr_arena_strndup(dnsr, result, buf, *resp_cur - begin - 1));
+}
+
 /* rfc 1035 3.1 Name space definitions
  * Domain names in messages are expressed in terms of a sequence of labels.
  * Each label is represented as a one octet length field followed by that
@@ -790,12 +973,22 @@ dnsr_labels_to_name(DNSR *dnsr, char *resp_begin, char **resp_cur, uint resplen,
     char    *offset_cur;
 
     for (;;) {
-        memcpy(&offset, *resp_cur, sizeof(offset));
-        offset = ntohs(offset);
+        if (*resp_cur >= resp_begin + resplen) {
+            DEBUG(fprintf(stderr, "labels_to_name: no resp\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+        offset = (uint8_t)**resp_cur << 8;
 
         /* if first two bits are 11, then the remaining 6 bits are offset */
         if ((offset & DNSR_OFFSET) == DNSR_OFFSET) {
             /* Compression */
+            if (*resp_cur + 2 > resp_begin + resplen) {
+                DEBUG(fprintf(stderr, "labels_to_name: no room for offset\n"));
+                dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+                return (-1);
+            }
+            offset |= (uint8_t)(*resp_cur)[ 1 ];
             offset &= ~DNSR_OFFSET;
 
             if (offset > resplen) {
@@ -805,6 +998,14 @@ dnsr_labels_to_name(DNSR *dnsr, char *resp_begin, char **resp_cur, uint resplen,
                 return (-1);
             }
 
+            /* Only point backwards, so a pointer can't loop */
+            if (resp_begin + offset >= *resp_cur) {
+                DEBUG(fprintf(stderr, "labels_to_name: forward offset: %d\n",
+                        offset));
+                dnsr->d_errno = DNSR_ERROR_PARSE;
+                return (-1);
+            }
+
             offset_cur = resp_begin + offset;
             if (dnsr_labels_to_name(dnsr, resp_begin, &offset_cur, resplen,
                         dn_begin, dn_cur, dn_end) < 0) {
@@ -819,11 +1020,6 @@ dnsr_labels_to_name(DNSR *dnsr, char *resp_begin, char **resp_cur, uint resplen,
             dnsr->d_errno = DNSR_ERROR_PARSE;
             return (-1);
         } else {
-            if (*resp_cur >= resp_begin + resplen) {
-                DEBUG(fprintf(stderr, "labels_to_string: no resp\n"));
-                dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
-                return (-1);
-            }
             /* XXX - Do we need to convert from network byte order? */
             len = **resp_cur;
             (*resp_cur)++;
@@ -864,3 +1060,141 @@ dnsr_labels_to_name(DNSR *dnsr, char *resp_begin, char **resp_cur, uint resplen,
         }
     }
 }
+
+/*
+ * Steps over a <domain-name> without decoding it, with the same checks as
+ * dnsr_labels_to_name( ).
+ */
+
+int
+dnsr_skip_name(DNSR *dnsr, char *resp_begin, char **resp_cur, uint resplen) {
+    uint8_t len;
+    uint    dnlen = 0;
+
+    for (;;) {
+        if (*resp_cur >= resp_begin + resplen) {
+            DEBUG(fprintf(stderr, "skip_name: no resp\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+        len = **resp_cur;
+
+        if ((len & (DNSR_OFFSET >> 8)) == (DNSR_OFFSET >> 8)) {
+            /* Compression ends the name */
+            if (*resp_cur + 2 > resp_begin + resplen) {
+                DEBUG(fprintf(stderr, "skip_name: no room for offset\n"));
+                dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+                return (-1);
+            }
+            (*resp_cur) += 2;
+            return 0;
+        } else if (len & (DNSR_EXTENDED_LABEL >> 8)) {
+            DEBUG(fprintf(stderr, "skip_name: extended label found\n"));
+            dnsr->d_errno = DNSR_ERROR_PARSE;
+            return (-1);
+        }
+        (*resp_cur)++;
+
+        if (len == 0) {
+            return 0;
+        }
+
+        dnlen += len + 1;
+        if (len > DNSR_MAX_LABEL || *resp_cur + len > resp_begin + resplen ||
+                dnlen > DNSR_MAX_NAME) {
+            DEBUG(fprintf(stderr, "skip_name: invalid length\n"));
+            dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+            return (-1);
+        }
+        (*resp_cur) += len;
+    }
+}
+
+/*
+ * Names are pooled per result, keyed by the offset in the message their
+ * labels start at.  Owner names are nearly always a pointer back to the
+ * question or to an earlier RDATA name, so RRs mostly share one copy and
+ * only the first of them pays for decompressing it.  The pool is a small
+ * open addressed table that simply stops taking names when it gets full.
+ */
+
+static char *
+dnsr_pool_get(struct dnsr_result *result, unsigned int offset) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    unsigned int              i, mask;
+
+    if (rb->rb_names == NULL) {
+        return (NULL);
+    }
+
+    mask = rb->rb_nameslots - 1;
+    for (i = offset & mask; rb->rb_names[ i ].n_name != NULL;
+            i = (i + 1) & mask) {
+        if (rb->rb_names[ i ].n_offset == offset) {
+            return (rb->rb_names[ i ].n_name);
+        }
+    }
+    return (NULL);
+}
+
+static void
+dnsr_pool_put(struct dnsr_result *result, unsigned int offset, char *name) {
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    unsigned int              i, mask;
+
+    if ((rb->rb_names == NULL) ||
+            (rb->rb_namecount >= (rb->rb_nameslots / 4) * 3)) {
+        return;
+    }
+
+    mask = rb->rb_nameslots - 1;
+    for (i = offset & mask; rb->rb_names[ i ].n_name != NULL;
+            i = (i + 1) & mask)
+        ;
+    rb->rb_names[ i ].n_name = name;
+    rb->rb_names[ i ].n_offset = offset;
+    rb->rb_namecount++;
+}
+
+/*
+ * Decode a <domain-name> into a pooled copy sized to fit.
+ */
+
+static char *
+dnsr_parse_name(DNSR *dnsr, struct dnsr_result *result, char *resp_begin,
+        char **resp_cur, int resplen) {
+    char         buf[ DNSR_MAX_NAME + 1 ];
+    char        *dn_cur = buf;
+    char        *name;
+    unsigned int offset;
+
+    /* A name that is only a pointer is the name it points to */
+    offset = *resp_cur - resp_begin;
+    if ((offset + 1 < resplen) &&
+            (((uint8_t)**resp_cur & (DNSR_OFFSET >> 8)) ==
+                    (DNSR_OFFSET >> 8))) {
+        offset = (((uint8_t)(*resp_cur)[ 0 ] << 8) |
+                         (uint8_t)(*resp_cur)[ 1 ]) &
+                 ~DNSR_OFFSET;
+    }
+
+    /* Names are only pooled once decoded, and so already checked */
+    if ((name = dnsr_pool_get(result, offset)) != NULL) {
+        if (dnsr_skip_name(dnsr, resp_begin, resp_cur, resplen) != 0) {
+            return (NULL);
+        }
+        return (name);
+    }
+
+    if (dnsr_labels_to_name(dnsr, resp_begin, resp_cur, resplen, buf, &dn_cur,
+                buf + DNSR_MAX_NAME) < 0) {
+        return (NULL);
+    }
+
+    /* dn_cur is past the trailing NUL */
+    if ((name = dnsr_arena_strndup(dnsr, result, buf, dn_cur - buf - 1)) !=
+            NULL) {
+        dnsr_pool_put(result, offset, name);
+    }
+    return (name);
+}
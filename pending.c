@@ -0,0 +1,255 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * A handle can have many queries in flight.  Each one is a dnsr_pending,
+ * found by its ID in a small chained hash table when a response comes in,
+ * and kept on the handle's active list so timers can be run for all of
+ * them.  Finished tagged queries wait on the done queue, in the order they
+ * finished, to be collected.  Pendings are recycled through a free list.
+ */
+
+#define DNSR_PENDING_POOL 64 /* Most pendings a handle keeps for reuse */
+
+static void dnsr_pending_unhash(DNSR *, struct dnsr_pending *);
+static void dnsr_pending_unlink(DNSR *, struct dnsr_pending *);
+static void dnsr_pending_queue(DNSR *, struct dnsr_pending *);
+
+struct dnsr_pending *
+dnsr_pending_new(DNSR *dnsr) {
+    struct dnsr_pending *p;
+    uint16_t             id;
+
+    if (dnsr->d_npending >= DNSR_MAX_PENDING) {
+        DEBUG(fprintf(stderr, "pending_new: too many queries\n"));
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+        return (NULL);
+    }
+
+    if ((p = dnsr->d_pendfree) != NULL) {
+        dnsr->d_pendfree = p->p_next;
+        dnsr->d_npendfree--;
+    } else if ((p = malloc(sizeof(struct dnsr_pending))) == NULL) {
+        DEBUG(perror("malloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (NULL);
+    }
+    memset(p, 0, offsetof(struct dnsr_pending, p_query));
+
+    /* IDs are unique among the queries in flight */
+    do {
+        id = dnsr_rand(dnsr) & 0xffff;
+    } while (dnsr_pending_lookup(dnsr, id) != NULL);
+    p->p_id = id;
+
+    p->p_hnext = dnsr->d_pending[ id % DNSR_PENDING_HASH ];
+    dnsr->d_pending[ id % DNSR_PENDING_HASH ] = p;
+
+    p->p_next = dnsr->d_active;
+    if (dnsr->d_active != NULL) {
+        dnsr->d_active->p_prev = p;
+    }
+    dnsr->d_active = p;
+    dnsr->d_npending++;
+
+    return (p);
+}
+
+struct dnsr_pending *
+dnsr_pending_lookup(DNSR *dnsr, uint16_t id) {
+    struct dnsr_pending *p;
+
+    for (p = dnsr->d_pending[ id % DNSR_PENDING_HASH ]; p != NULL;
+            p = p->p_hnext) {
+        if (p->p_id == id) {
+            return (p);
+        }
+    }
+    return (NULL);
+}
+
+/*
+ * Gives p, which is in flight, a new ID, so that responses to the question
+ * it was asking before are no longer matched to it.
+ */
+
+void
+dnsr_pending_rekey(DNSR *dnsr, struct dnsr_pending *p) {
+    uint16_t id;
+
+    dnsr_pending_unhash(dnsr, p);
+
+    do {
+        id = dnsr_rand(dnsr) & 0xffff;
+    } while ((id == p->p_id) || (dnsr_pending_lookup(dnsr, id) != NULL));
+    p->p_id = id;
+
+    p->p_hnext = dnsr->d_pending[ id % DNSR_PENDING_HASH ];
+    dnsr->d_pending[ id % DNSR_PENDING_HASH ] = p;
+}
+
+/* Takes p out of the hash table */
+static void
+dnsr_pending_unhash(DNSR *dnsr, struct dnsr_pending *p) {
+    struct dnsr_pending **h;
+
+    for (h = &dnsr->d_pending[ p->p_id % DNSR_PENDING_HASH ]; *h != NULL;
+            h = &(*h)->p_hnext) {
+        if (*h == p) {
+            *h = p->p_hnext;
+            break;
+        }
+    }
+}
+
+/* Takes p out of the hash table and off the active list */
+static void
+dnsr_pending_unlink(DNSR *dnsr, struct dnsr_pending *p) {
+    dnsr_pending_unhash(dnsr, p);
+
+    if (p->p_prev != NULL) {
+        p->p_prev->p_next = p->p_next;
+    } else {
+        dnsr->d_active = p->p_next;
+    }
+    if (p->p_next != NULL) {
+        p->p_next->p_prev = p->p_prev;
+    }
+    p->p_next = p->p_prev = p->p_hnext = NULL;
+    dnsr->d_npending--;
+}
+
+/*
+ * Finishes a query, with a result or with the error in err.  Responses
+ * for it are no longer accepted.  A tagged query goes on the done queue.
+ */
+
+void
+dnsr_pending_done(DNSR *dnsr, struct dnsr_pending *p,
+        struct dnsr_result *result, int err) {
+    if (p->p_done) {
+        return;
+    }
+
+    dnsr_pending_unlink(dnsr, p);
+    dnsr_tcp_close(dnsr, p);
+    p->p_done = 1;
+    p->p_result = result;
+    p->p_errno = err;
+
+    if (p->p_tagged) {
+        dnsr_pending_queue(dnsr, p);
+    }
+}
+
+/*
+ * Tags p for dnsr_result_tagged( ).  It may have been answered from the
+ * cache as it started, and then goes straight on the done queue.
+ */
+
+void
+dnsr_pending_tag(DNSR *dnsr, struct dnsr_pending *p, int tag) {
+    p->p_tagged = 1;
+    p->p_tag = tag;
+    dnsr->d_ntagged++;
+
+    if (p->p_done) {
+        dnsr_pending_queue(dnsr, p);
+    }
+}
+
+/* Puts p, which is done, on the end of the done queue */
+static void
+dnsr_pending_queue(DNSR *dnsr, struct dnsr_pending *p) {
+    if (dnsr->d_donetail != NULL) {
+        dnsr->d_donetail->p_next = p;
+    } else {
+        dnsr->d_done = p;
+    }
+    dnsr->d_donetail = p;
+}
+
+/* Takes the first finished tagged query off the done queue */
+struct dnsr_pending *
+dnsr_pending_next_done(DNSR *dnsr) {
+    struct dnsr_pending *p;
+
+    if ((p = dnsr->d_done) != NULL) {
+        if ((dnsr->d_done = p->p_next) == NULL) {
+            dnsr->d_donetail = NULL;
+        }
+        p->p_next = NULL;
+    }
+    return (p);
+}
+
+/*
+ * Recycles p.  A query still in flight is abandoned, and a result that was
+ * not collected is released.
+ */
+
+void
+dnsr_pending_free(DNSR *dnsr, struct dnsr_pending *p) {
+    if (p == NULL) {
+        return;
+    }
+
+    if (!p->p_done) {
+        dnsr_pending_unlink(dnsr, p);
+        dnsr_udp_forget(dnsr, p);
+        dnsr_tcp_close(dnsr, p);
+    }
+    if (p->p_result != NULL) {
+        dnsr_release_result(dnsr, p->p_result);
+    }
+    if (p->p_chain != NULL) {
+        dnsr_release_result(dnsr, p->p_chain);
+    }
+    if (dnsr->d_current == p) {
+        dnsr->d_current = NULL;
+    }
+    if (p->p_tagged) {
+        dnsr->d_ntagged--;
+    }
+
+    if (dnsr->d_npendfree >= DNSR_PENDING_POOL) {
+        free(p);
+        return;
+    }
+    p->p_next = dnsr->d_pendfree;
+    dnsr->d_pendfree = p;
+    dnsr->d_npendfree++;
+}
+
+/* Drops every query on the handle, for dnsr_free( ) */
+void
+dnsr_pending_clear(DNSR *dnsr) {
+    struct dnsr_pending *p;
+
+    dnsr_pending_free(dnsr, dnsr->d_current);
+    while ((p = dnsr->d_active) != NULL) {
+        dnsr_pending_free(dnsr, p);
+    }
+    while ((p = dnsr_pending_next_done(dnsr)) != NULL) {
+        dnsr_pending_free(dnsr, p);
+    }
+    while ((p = dnsr->d_pendfree) != NULL) {
+        dnsr->d_pendfree = p->p_next;
+        free(p);
+    }
+    dnsr->d_npendfree = 0;
+}
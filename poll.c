@@ -0,0 +1,343 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifdef HAVE_EPOLL_CREATE1
+#include <sys/epoll.h>
+#else /* HAVE_EPOLL_CREATE1 */
+#include <poll.h>
+#endif /* HAVE_EPOLL_CREATE1 */
+
+#include "denser.h"
+#include "internal.h"
+#include "timeval.h"
+
+/*
+ * A DNSR_POLL waits on the sockets of many handles at once, for
+ * applications that keep more queries in flight than one handle or one
+ * select( ) can manage.  The sockets are registered once in an epoll set,
+ * so there is no limit on descriptor numbers and the cost of a wait does
+ * not grow with the number of idle sockets.  Where epoll is missing,
+ * poll( ) is used.
+ *
+ * Each descriptor from dnsr_fds( ) is registered with the index of its
+ * handle in dp_handles and its place in what dnsr_fds( ) returned.
+ */
+
+#define DNSR_POLL_EVENTS 64 /* Most events taken per epoll_wait( ) */
+
+struct dnsr_poll {
+    int    dp_fd; /* epoll set */
+    DNSR **dp_handles;
+    int    dp_count;
+    int    dp_size;
+};
+
+#ifdef HAVE_EPOLL_CREATE1
+static int dnsr_poll_ctl(DNSR_POLL *, int, DNSR *);
+#endif /* HAVE_EPOLL_CREATE1 */
+static int dnsr_poll_ready(DNSR *);
+
+/*
+ * Return Values:
+ *      DNSR_POLL *     success
+ *      NULL            system error - check errno
+ */
+
+DNSR_POLL *
+dnsr_poll_new(void) {
+    DNSR_POLL *dp;
+
+    if ((dp = calloc(1, sizeof(DNSR_POLL))) == NULL) {
+        return (NULL);
+    }
+
+#ifdef HAVE_EPOLL_CREATE1
+    if ((dp->dp_fd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        DEBUG(perror("epoll_create1"));
+        free(dp);
+        return (NULL);
+    }
+#else  /* HAVE_EPOLL_CREATE1 */
+    dp->dp_fd = -1;
+#endif /* HAVE_EPOLL_CREATE1 */
+
+    return (dp);
+}
+
+/*
+ * Drops every handle from dp and frees it.  The handles are not freed.
+ */
+
+void
+dnsr_poll_free(DNSR_POLL *dp) {
+    if (dp == NULL) {
+        return;
+    }
+
+    while (dp->dp_count > 0) {
+        dnsr_poll_remove(dp, dp->dp_handles[ dp->dp_count - 1 ]);
+    }
+    if (dp->dp_fd >= 0) {
+        close(dp->dp_fd);
+    }
+    free(dp->dp_handles);
+    free(dp);
+}
+
+/*
+ * Adds dnsr to dp.  A handle can be in one DNSR_POLL at a time, and is
+ * removed by dnsr_free( ).
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_poll_add(DNSR_POLL *dp, DNSR *dnsr) {
+    DNSR **handles;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if (dnsr->d_poll != NULL) {
+        DEBUG(fprintf(stderr, "dnsr_poll_add: already added\n"));
+        dnsr->d_errno = DNSR_ERROR_CONFIG;
+        return (-1);
+    }
+
+    if (dp->dp_count == dp->dp_size) {
+        if ((handles = realloc(dp->dp_handles,
+                     (dp->dp_size ? dp->dp_size * 2 : 16) * sizeof(DNSR *))) ==
+                NULL) {
+            DEBUG(perror("realloc"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
+        dp->dp_handles = handles;
+        dp->dp_size = dp->dp_size ? dp->dp_size * 2 : 16;
+    }
+
+    dnsr->d_pollindex = dp->dp_count;
+#ifdef HAVE_EPOLL_CREATE1
+    if (dnsr_poll_ctl(dp, EPOLL_CTL_ADD, dnsr) != 0) {
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+#endif /* HAVE_EPOLL_CREATE1 */
+    dp->dp_handles[ dp->dp_count++ ] = dnsr;
+    dnsr->d_poll = dp;
+
+    return 0;
+}
+
+/*
+ * Removes dnsr from dp.  Queries in flight on it are not touched.
+ */
+
+int
+dnsr_poll_remove(DNSR_POLL *dp, DNSR *dnsr) {
+    DNSR *last;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if (dnsr->d_poll != dp) {
+        DEBUG(fprintf(stderr, "dnsr_poll_remove: not added\n"));
+        dnsr->d_errno = DNSR_ERROR_CONFIG;
+        return (-1);
+    }
+
+#ifdef HAVE_EPOLL_CREATE1
+    dnsr_poll_ctl(dp, EPOLL_CTL_DEL, dnsr);
+#endif /* HAVE_EPOLL_CREATE1 */
+
+    /* Move the last handle into the hole, its index changes */
+    last = dp->dp_handles[ --dp->dp_count ];
+    if (last != dnsr) {
+        last->d_pollindex = dnsr->d_pollindex;
+        dp->dp_handles[ last->d_pollindex ] = last;
+#ifdef HAVE_EPOLL_CREATE1
+        dnsr_poll_ctl(dp, EPOLL_CTL_MOD, last);
+#endif /* HAVE_EPOLL_CREATE1 */
+    }
+    dnsr->d_poll = NULL;
+
+    return 0;
+}
+
+#ifdef HAVE_EPOLL_CREATE1
+static int
+dnsr_poll_ctl(DNSR_POLL *dp, int op, DNSR *dnsr) {
+    struct epoll_event ev;
+    int                i, nfds, fds[ 2 ];
+
+    memset(&ev, 0, sizeof(struct epoll_event));
+    ev.events = EPOLLIN;
+
+    nfds = dnsr_fds(dnsr, fds, 2);
+    for (i = 0; i < nfds; i++) {
+        ev.data.u64 = ((uint64_t)dnsr->d_pollindex << 1) | i;
+        if (epoll_ctl(dp->dp_fd, op, fds[ i ], &ev) != 0) {
+            DEBUG(perror("epoll_ctl"));
+            if ((op == EPOLL_CTL_ADD) && (i > 0)) {
+                epoll_ctl(dp->dp_fd, EPOLL_CTL_DEL, fds[ 0 ], &ev);
+            }
+            return (-1);
+        }
+    }
+    return 0;
+}
+#endif /* HAVE_EPOLL_CREATE1 */
+
+/* A handle is ready when a query on it has finished, or it had an error */
+static int
+dnsr_poll_ready(DNSR *dnsr) {
+    return ((dnsr->d_done != NULL) ||
+            ((dnsr->d_current != NULL) && dnsr->d_current->p_done) ||
+            dnsr->d_pollerr);
+}
+
+/*
+ * dnsr_poll waits upto timeout, as dnsr_result does, for queries on any of
+ * the handles in dp to finish.  The handles with finished queries are
+ * returned in ready, and their results are collected without waiting by
+ * calling dnsr_result, dnsr_result_tagged or dnsr_result_batch with a zero
+ * timeout.  A handle that had an error is returned too, and the error is
+ * in its dnsr_errno.
+ *
+ * Return Values:
+ *      >0      number of handles in ready
+ *      0       timed out, or no queries in flight
+ *      -1      system error - check errno
+ */
+
+int
+dnsr_poll(DNSR_POLL *dp, DNSR **ready, int max, struct timeval *timeout) {
+    int            i, n, rc, ms, active, last = 0, fds[ 2 ];
+    DNSR          *dnsr;
+    struct timeval cur, end, wait, tv;
+#ifdef HAVE_EPOLL_CREATE1
+    struct epoll_event events[ DNSR_POLL_EVENTS ];
+#else  /* HAVE_EPOLL_CREATE1 */
+    struct pollfd *pfd;
+    int            nfds;
+#endif /* HAVE_EPOLL_CREATE1 */
+
+    if (timeout != NULL) {
+        if (gettimeofday(&cur, NULL) < 0) {
+            return (-1);
+        }
+        tv_add(&cur, timeout, &end);
+    }
+
+    for (;;) {
+        /* Run timers that are due, find the next one, and find the handles
+         * with something to collect.
+         */
+        n = 0;
+        active = 0;
+        wait.tv_sec = -1;
+        for (i = 0; i < dp->dp_count; i++) {
+            dnsr = dp->dp_handles[ i ];
+            if (dnsr_next_timeout(dnsr, &tv) == 1) {
+                if ((tv.tv_sec == 0) && (tv.tv_usec == 0)) {
+                    if (dnsr_process(dnsr, -1) != 0) {
+                        dnsr->d_pollerr = 1;
+                    }
+                }
+                if (dnsr_next_timeout(dnsr, &tv) == 1) {
+                    active = 1;
+                    if ((wait.tv_sec < 0) || tv_lt(&tv, &wait)) {
+                        wait = tv;
+                    }
+                }
+            }
+            if ((n < max) && dnsr_poll_ready(dnsr)) {
+                dnsr->d_pollerr = 0;
+                ready[ n++ ] = dnsr;
+            }
+        }
+        if ((n > 0) || !active || last) {
+            return (n);
+        }
+
+        /* Never wait past timeout */
+        if (timeout != NULL) {
+            if (gettimeofday(&cur, NULL) < 0) {
+                return (-1);
+            }
+            if (tv_sub(&end, &cur, timeout) != 0) {
+                timeout->tv_sec = 0;
+                timeout->tv_usec = 0;
+                last = 1;
+            }
+            if (tv_gt(&wait, timeout)) {
+                wait = *timeout;
+            }
+        }
+        ms = wait.tv_sec * 1000 + (wait.tv_usec + 999) / 1000;
+
+#ifdef HAVE_EPOLL_CREATE1
+        if ((rc = epoll_wait(dp->dp_fd, events, DNSR_POLL_EVENTS, ms)) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            DEBUG(perror("epoll_wait"));
+            return (-1);
+        }
+        for (i = 0; i < rc; i++) {
+            dnsr = dp->dp_handles[ events[ i ].data.u64 >> 1 ];
+            dnsr_fds(dnsr, fds, 2);
+            if (dnsr_process(dnsr, fds[ events[ i ].data.u64 & 1 ]) != 0) {
+                dnsr->d_pollerr = 1;
+            }
+        }
+#else  /* HAVE_EPOLL_CREATE1 */
+        if ((pfd = calloc(dp->dp_count * 2, sizeof(struct pollfd))) == NULL) {
+            return (-1);
+        }
+        /* Two slots per handle, poll( ) skips the negative ones */
+        for (nfds = 0, i = 0; i < dp->dp_count; i++) {
+            fds[ 0 ] = fds[ 1 ] = -1;
+            dnsr_fds(dp->dp_handles[ i ], fds, 2);
+            pfd[ nfds ].fd = fds[ 0 ];
+            pfd[ nfds++ ].events = POLLIN;
+            pfd[ nfds ].fd = fds[ 1 ];
+            pfd[ nfds++ ].events = POLLIN;
+        }
+        if ((rc = poll(pfd, nfds, ms)) < 0) {
+            free(pfd);
+            if (errno == EINTR) {
+                continue;
+            }
+            DEBUG(perror("poll"));
+            return (-1);
+        }
+        for (i = 0; (rc > 0) && (i < nfds); i++) {
+            if (pfd[ i ].revents & (POLLIN | POLLERR)) {
+                rc--;
+                dnsr = dp->dp_handles[ i / 2 ];
+                if (dnsr_process(dnsr, pfd[ i ].fd) != 0) {
+                    dnsr->d_pollerr = 1;
+                }
+            }
+        }
+        free(pfd);
+#endif /* HAVE_EPOLL_CREATE1 */
+    }
+}
@@ -26,6 +26,9 @@
 #include "timeval.h"
 
 static int dn_to_labels(DNSR *dnsr, char *dn, char *labels);
+static int dnsr_query_build(DNSR *dnsr, struct dnsr_pending *p,
+        uint16_t qtype, uint16_t qclass, const char *dn);
+static int dnsr_query_send(DNSR *dnsr, struct dnsr_pending *p);
 
 struct question {
     uint16_t q_type;
@@ -245,7 +248,8 @@ dn_to_labels(DNSR *dnsr, char *dn, char *labels) {
 }
 
 /*
- * This function sends a query to a nameserver.
+ * This function sends the query last made with dnsr_query( ) to a
+ * nameserver.
  *
  * Arguments:
  *      A dnsr that has been initalized with dnsr_new and a query.
@@ -261,23 +265,29 @@ dn_to_labels(DNSR *dnsr, char *dn, char *labels) {
 
 int
 dnsr_send_query(DNSR *dnsr, int ns) {
-    struct dnsr_header *h;
-    char               *query;
-    char                buf[ DNSR_MAX_UDP ];
-    size_t              querylen;
-    ssize_t             rc;
+    if (dnsr->d_current == NULL) {
+        DEBUG(fprintf(stderr, "dnsr_send_query: no query\n"));
+        dnsr->d_errno = DNSR_ERROR_NO_QUERY;
+        return (-1);
+    }
+    if (dnsr_send_pending(dnsr, dnsr->d_current, ns) != 0) {
+        return (-1);
+    }
+    return (dnsr_udp_flush(dnsr));
+}
+
+int
+dnsr_send_pending(DNSR *dnsr, struct dnsr_pending *p, int ns) {
+    size_t querylen;
+    int    noedns = 0;
 
     if (dnsr->d_nsinfo[ ns ].ns_edns == DNSR_EDNS_BAD) {
         /* EDNS is bad, strip it off */
         DEBUG(fprintf(stderr, "stripping EDNS\n"));
-        querylen = dnsr->d_questionlen;
-        memcpy(buf, dnsr->d_query, querylen);
-        query = buf;
-        h = (struct dnsr_header *)query;
-        h->h_arcount = htons(ntohs(h->h_arcount) - 1);
+        querylen = p->p_questionlen;
+        noedns = 1;
     } else {
-        query = dnsr->d_query;
-        querylen = dnsr->d_querylen;
+        querylen = p->p_querylen;
     }
 
     if (querylen > dnsr->d_nsinfo[ ns ].ns_udp) {
@@ -286,40 +296,54 @@ dnsr_send_query(DNSR *dnsr, int ns) {
         return (-1);
     }
 
-    /* Set unique ID for query */
-    h = (struct dnsr_header *)query;
-    h->h_id = htons(dnsr->d_id ^ dnsr->d_nsinfo[ ns ].ns_id);
+    /* Queue query, it goes out with the next dnsr_udp_flush( ) */
+    dnsr_udp_queue(dnsr, p, ns, noedns);
 
-    /* Send query */
-    if (dnsr->d_nsinfo[ ns ].ns_sa.ss_family == AF_INET) {
-        rc = sendto(dnsr->d_fd, query, querylen, 0,
-                (struct sockaddr *)&dnsr->d_nsinfo[ ns ].ns_sa,
-                sizeof(struct sockaddr_in));
-    } else {
-        rc = sendto(dnsr->d_fd6, query, querylen, 0,
-                (struct sockaddr *)&dnsr->d_nsinfo[ ns ].ns_sa,
-                sizeof(struct sockaddr_in6));
-    }
-    if (rc != querylen) {
-        DEBUG(perror("sendto"));
+    if (gettimeofday(&p->p_querytime, NULL) < 0) {
+        DEBUG(perror("gettimeofday"));
         dnsr->d_errno = DNSR_ERROR_SYSTEM;
         return (-1);
     }
+    /* A response can only be timed if there was one send to time it by */
+    if (p->p_asked & (1 << ns)) {
+        timerclear(&p->p_sent[ ns ]);
+    } else {
+        p->p_sent[ ns ] = p->p_querytime;
+    }
+    p->p_asked |= (1 << ns);
+    p->p_ns = ns;
 
-    DEBUG(dnsr_display_header((struct dnsr_header *)query));
+    return 0;
+}
 
-    if (gettimeofday(&dnsr->d_querytime, NULL) < 0) {
-        DEBUG(perror("gettimeofday"));
-        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+/*
+ * Queues p for every name server at once.  The first good response
+ * finishes p, and the rest are then dropped by dnsr_validate_resp( ), as
+ * their ID no longer matches a query in flight.
+ *
+ * Return Values:
+ *      0       at least one server was asked
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_send_all(DNSR *dnsr, struct dnsr_pending *p) {
+    int ns, sent = 0;
+
+    for (ns = 0; ns < dnsr->d_nscount; ns++) {
+        if (dnsr_send_pending(dnsr, p, ns) == 0) {
+            sent++;
+        } else if (dnsr->d_errno == DNSR_ERROR_SYSTEM) {
+            return (-1);
+        }
+    }
+    if (sent == 0) {
         return (-1);
     }
-    dnsr->d_querysent = 1;
-    dnsr->d_nsinfo[ ns ].ns_asked = 1;
-
+    dnsr->d_errno = DNSR_ERROR_NONE;
     return 0;
 }
 
-
 /* rfc 1035 4.2.2
  * Messages sent over TCP connections use server port 53 (decimal).  The
  * message is prefixed with a two byte length field which gives the message
@@ -329,13 +353,14 @@ dnsr_send_query(DNSR *dnsr, int ns) {
  */
 
 char *
-dnsr_send_query_tcp(DNSR *dnsr, int ns, int *resplen) {
+dnsr_send_query_tcp(
+        DNSR *dnsr, struct dnsr_pending *p, int ns, int *resplen) {
 
     char               *resp_tcp = NULL;
     int                 fd;
     ssize_t             size = 0, rc;
     struct dnsr_header *h;
-    char                buf[ DNSR_MAX_UDP ];
+    char                buf[ DNSR_MAX_UDP_BASIC ];
     char               *query;
     uint16_t            querylen, len;
 
@@ -356,15 +381,18 @@ dnsr_send_query_tcp(DNSR *dnsr, int ns, int *resplen) {
     if (dnsr->d_nsinfo[ ns ].ns_edns == DNSR_EDNS_BAD) {
         /* EDNS is bad, strip it off */
         DEBUG(fprintf(stderr, "stripping EDNS\n"));
-        querylen = dnsr->d_questionlen;
-        memcpy(buf, dnsr->d_query, DNSR_MAX_UDP);
+        querylen = p->p_questionlen;
+        memcpy(buf, p->p_query, querylen);
         query = buf;
         h = (struct dnsr_header *)query;
         h->h_arcount = htons(ntohs(h->h_arcount) - 1);
     } else {
-        querylen = dnsr->d_querylen;
-        query = dnsr->d_query;
+        querylen = p->p_querylen;
+        query = p->p_query;
     }
+    /* Same ID as over UDP to the same server */
+    h = (struct dnsr_header *)query;
+    h->h_id = htons(p->p_id ^ dnsr->d_nsinfo[ ns ].ns_id);
 
     len = htons(querylen);
     if (write(fd, &len, sizeof(len)) != sizeof(len)) {
@@ -391,14 +419,21 @@ dnsr_send_query_tcp(DNSR *dnsr, int ns, int *resplen) {
     *resplen = len;
     DEBUG(fprintf(stderr, "response len: %d\n", len));
 
-    if ((resp_tcp = malloc(len)) == NULL) {
-        DEBUG(perror("malloc"));
-        dnsr->d_errno = DNSR_ERROR_SYSTEM;
-        goto error;
+    /* The receive buffer belongs to the handle and only ever grows */
+    if ((dnsr->d_tcpbuf == NULL) || (dnsr->d_tcpbufsize < len)) {
+        if ((resp_tcp = realloc(dnsr->d_tcpbuf, MAX(len, DNSR_MAX_UDP))) ==
+                NULL) {
+            DEBUG(perror("realloc"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            goto error;
+        }
+        dnsr->d_tcpbuf = resp_tcp;
+        dnsr->d_tcpbufsize = MAX(len, DNSR_MAX_UDP);
     }
+    resp_tcp = dnsr->d_tcpbuf;
 
     while (size < len) {
-        if ((rc = read(fd, &resp_tcp[ size ], len)) <= 0) {
+        if ((rc = read(fd, &resp_tcp[ size ], len - size)) <= 0) {
             if (rc == 0) {
                 DEBUG(fprintf(stderr, "dnsr_send_query_tcp: read: closed"));
                 dnsr->d_errno = DNSR_ERROR_CONNECTION_CLOSED;
@@ -418,25 +453,114 @@ dnsr_send_query_tcp(DNSR *dnsr, int ns, int *resplen) {
     return (resp_tcp);
 
 error:
-    free(resp_tcp);
     close(fd);
     return (NULL);
 }
 
+/*
+ * Starts a query for dn.  Only one query made with dnsr_query( ) is in
+ * flight at a time: a new one replaces the last, and its result is read
+ * with dnsr_result( ).  Any number of queries made with dnsr_query_tagged( )
+ * can be in flight alongside it; their results are read in the order they
+ * arrive with dnsr_result_tagged( ).
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
 int
 dnsr_query(DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn) {
-    int                 i, len;
-    struct dnsr_header *h;
-    struct question     q;
+    struct dnsr_pending *p;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if ((p = dnsr_query_start(dnsr, qtype, qclass, dn)) == NULL) {
+        return (-1);
+    }
+    if ((dnsr_udp_flush(dnsr) != 0) && p->p_done) {
+        dnsr_pending_free(dnsr, p);
+        return (-1);
+    }
+
+    dnsr_pending_free(dnsr, dnsr->d_current);
+    dnsr->d_current = p;
+
+    return 0;
+}
+
+int
+dnsr_query_tagged(DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn,
+        int tag) {
+    struct dnsr_pending *p;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if ((p = dnsr_query_start(dnsr, qtype, qclass, dn)) == NULL) {
+        return (-1);
+    }
+    /* Tagged only once sent, a send that failed is not on the done queue */
+    if ((dnsr_udp_flush(dnsr) != 0) && p->p_done) {
+        dnsr_pending_free(dnsr, p);
+        return (-1);
+    }
+    dnsr_pending_tag(dnsr, p, tag);
+
+    return 0;
+}
+
+/*
+ * Starts every query in queries, tagged with its index, so that their
+ * results can be read as they arrive with dnsr_result_batch( ).  They are
+ * tagged queries, and can be collected with dnsr_result_tagged( ) too.
+ *
+ * Return Values:
+ *      count   success
+ *      <count  error - check dnsr_errno.  Queries before the one that
+ *              failed were started.
+ */
+
+int
+dnsr_query_batch(
+        DNSR *dnsr, const struct dnsr_batch_query *queries, int count) {
+    struct dnsr_pending *p;
+    int                  i;
 
     if (!dnsr) {
         return (-1);
     }
 
+    /* Queries are queued as they are built, and sent together */
+    for (i = 0; i < count; i++) {
+        if ((p = dnsr_query_start(dnsr, queries[ i ].bq_type,
+                     queries[ i ].bq_class, queries[ i ].bq_name)) == NULL) {
+            break;
+        }
+        dnsr_pending_tag(dnsr, p, i);
+    }
+    dnsr_udp_flush(dnsr);
+
+    return (i);
+}
+
+/*
+ * Builds a query and queues it for the first name server, unless it can be
+ * answered from the handle's cache.  The caller flushes the send queue.
+ * The retry schedule in eventlist takes it from there.
+ */
+
+struct dnsr_pending *
+dnsr_query_start(DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn) {
+    struct dnsr_pending *p;
+
     /* If dnsr handle has not been configured, do so now */
     if (dnsr->d_nscount == 0) {
         if (dnsr_nameserver(dnsr, NULL) != 0) {
-            return (-1);
+            return (NULL);
         }
     }
 
@@ -444,57 +568,162 @@ dnsr_query(DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn) {
     if ((qtype <= 0) || (qtype > DNSR_MAX_TYPE) ||
             (lookup_type[ qtype ].l_value != qtype)) {
         dnsr->d_errno = DNSR_ERROR_TYPE;
-        return (-1);
+        return (NULL);
     }
 
     /* Check for valid type */
     if ((qclass <= 0) || (qclass > DNSR_MAX_CLASS) ||
             (lookup_class[ qclass ].l_value != qclass)) {
         dnsr->d_errno = DNSR_ERROR_CLASS;
-        return (-1);
+        return (NULL);
     }
 
-    if ((len = strlen(dn)) > DNSR_MAX_NAME) {
+    if (strlen(dn) > DNSR_MAX_NAME) {
         DEBUG(fprintf(stderr, "dnsr_query: dn too long\n"));
+        dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
+        return (NULL);
+    }
+
+    if ((p = dnsr_pending_new(dnsr)) == NULL) {
+        return (NULL);
+    }
+
+    if (dnsr_query_build(dnsr, p, qtype, qclass, dn) != 0) {
+        dnsr_pending_free(dnsr, p);
+        return (NULL);
+    }
+
+    if (dnsr->d_opts & DNSR_OPT_RACE) {
+        p->p_events = eventlist_race;
+    } else if (dnsr->d_hedge != 0) {
+        p->p_events = eventlist_hedge;
+    } else {
+        p->p_events = eventlist;
+    }
+
+    if ((dnsr->d_cache != NULL) && (dnsr_cache_answer(dnsr, p) == 1)) {
+        return (p);
+    }
+
+    DEBUG(fprintf(stderr, "nscount: %d\n", dnsr->d_nscount));
+
+    if (dnsr_query_send(dnsr, p) != 0) {
+        if (dnsr->d_errno == DNSR_ERROR_SYSTEM) {
+            dnsr_pending_free(dnsr, p);
+            return (NULL);
+        }
+    }
+
+    p->p_state = 0;
+
+    return (p);
+}
+
+/*
+ * Asks the question of p again for dn, with the same type and class, as a
+ * fresh query under a new ID, for following a CNAME.  Responses to the old
+ * question are no longer accepted.  The caller flushes the send queue.  If
+ * dn is cached, p may be done when this returns.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_query_restart(DNSR *dnsr, struct dnsr_pending *p, const char *dn) {
+    struct question q;
+
+    if (strlen(dn) > DNSR_MAX_NAME) {
         dnsr->d_errno = DNSR_ERROR_SIZELIMIT_EXCEEDED;
         return (-1);
     }
-    strcpy(dnsr->d_dn, dn);
-    if (dnsr->d_dn[ len - 1 ] == '.') {
-        dnsr->d_dn[ len ] = '\0';
-        len--;
+
+    memcpy(&q, &p->p_query[ p->p_questionlen - sizeof(q) ], sizeof(q));
+
+    /* Nothing queued may go out with the new question and the old ID */
+    dnsr_udp_forget(dnsr, p);
+    dnsr_tcp_close(dnsr, p);
+    dnsr_pending_rekey(dnsr, p);
+
+    if (dnsr_query_build(dnsr, p, ntohs(q.q_type), ntohs(q.q_class), dn) !=
+            0) {
+        return (-1);
     }
 
-    dnsr->d_id = rand() & 0xffff;
-    dnsr->d_querylen = 0;
-    dnsr->d_querysent = 0;
-    dnsr->d_state = 0;
-    memset(&dnsr->d_querytime, 0, sizeof(struct timeval));
+    p->p_state = 0;
+    p->p_asked = 0;
+    p->p_resp_errno = DNSR_ERROR_NONE;
+    if ((dnsr->d_cache != NULL) && (dnsr_cache_answer(dnsr, p) == 1)) {
+        return 0;
+    }
+    if (dnsr_query_send(dnsr, p) != 0) {
+        if (dnsr->d_errno == DNSR_ERROR_SYSTEM) {
+            return (-1);
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Queues a new query for the first name server, or for all of them with
+ * DNSR_FLAG_RACE.
+ */
+
+static int
+dnsr_query_send(DNSR *dnsr, struct dnsr_pending *p) {
+    if (p->p_events == eventlist_race) {
+        DEBUG(fprintf(stderr, "sending query to: all\n"));
+        return (dnsr_send_all(dnsr, p));
+    }
+
+    /* Send query to NS 0 */
+    DEBUG(fprintf(stderr, "sending query to: 0\n"));
+    return (dnsr_send_pending(dnsr, p, 0));
+}
+
+/*
+ * Writes the query for dn into p.  dn has been checked for length.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+static int
+dnsr_query_build(DNSR *dnsr, struct dnsr_pending *p, uint16_t qtype,
+        uint16_t qclass, const char *dn) {
+    int                 i;
+    char                name[ DNSR_MAX_NAME + 1 ];
+    struct dnsr_header *h;
+    struct question     q;
+
+    strcpy(name, dn);
 
     /* Create header */
-    h = (struct dnsr_header *)dnsr->d_query;
-    memset(h, 0, DNSR_MAX_UDP);
+    h = (struct dnsr_header *)p->p_query;
+    memset(h, 0, sizeof(struct dnsr_header));
     h->h_flags = htons(dnsr->d_flags);
     h->h_qdcount = htons(1);
     h->h_arcount = htons(1);
 
-    dnsr->d_querylen += sizeof(struct dnsr_header);
+    p->p_querylen = sizeof(struct dnsr_header);
 
     /* Create question */
     /* Since we have already checked the length of dn, we know
      * it's corresponding query can't be too big, so we don't have
      * to check the size.
      */
-    if ((i = dn_to_labels(
-                 dnsr, dnsr->d_dn, &dnsr->d_query[ dnsr->d_querylen ])) < 0) {
+    if ((i = dn_to_labels(dnsr, name, &p->p_query[ p->p_querylen ])) < 0) {
         return (-1);
     }
-    dnsr->d_querylen += i;
+    p->p_querylen += i;
     q.q_type = htons(qtype);
     q.q_class = htons(qclass);
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &q, sizeof(q));
-    dnsr->d_querylen += sizeof(q);
-    dnsr->d_questionlen = dnsr->d_querylen;
+    memcpy(&p->p_query[ p->p_querylen ], &q, sizeof(q));
+    p->p_querylen += sizeof(q);
+    p->p_questionlen = p->p_querylen;
 
     /* RFC 6891 6.1.2 Wire Format
      * The fixed part of an OPT RR is structured as follows:
@@ -509,39 +738,27 @@ dnsr_query(DNSR *dnsr, uint16_t qtype, uint16_t qclass, const char *dn) {
      */
 
     /* FIXME: this whole thing is ugly. */
-    dnsr->d_query[ dnsr->d_querylen++ ] = 0;
+    p->p_query[ p->p_querylen++ ] = 0;
     uint16_t temp;
     uint32_t tempflags;
     temp = htons(DNSR_TYPE_OPT);
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &temp, sizeof(uint16_t));
-    dnsr->d_querylen += sizeof(uint16_t);
+    memcpy(&p->p_query[ p->p_querylen ], &temp, sizeof(uint16_t));
+    p->p_querylen += sizeof(uint16_t);
     temp = htons(DNSR_MAX_UDP);
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &temp, sizeof(uint16_t));
-    dnsr->d_querylen += sizeof(uint16_t);
+    memcpy(&p->p_query[ p->p_querylen ], &temp, sizeof(uint16_t));
+    p->p_querylen += sizeof(uint16_t);
     tempflags = 0;
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &tempflags, sizeof(uint32_t));
-    dnsr->d_querylen += sizeof(uint32_t);
+    memcpy(&p->p_query[ p->p_querylen ], &tempflags, sizeof(uint32_t));
+    p->p_querylen += sizeof(uint32_t);
     temp = htons(sizeof(uint16_t) * 2);
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &temp, sizeof(uint16_t));
-    dnsr->d_querylen += sizeof(uint16_t);
+    memcpy(&p->p_query[ p->p_querylen ], &temp, sizeof(uint16_t));
+    p->p_querylen += sizeof(uint16_t);
     temp = htons(DNSR_EDNS_OPT_NSID);
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &temp, sizeof(uint16_t));
-    dnsr->d_querylen += sizeof(uint16_t);
+    memcpy(&p->p_query[ p->p_querylen ], &temp, sizeof(uint16_t));
+    p->p_querylen += sizeof(uint16_t);
     temp = htons(0);
-    memcpy(&dnsr->d_query[ dnsr->d_querylen ], &temp, sizeof(uint16_t));
-    dnsr->d_querylen += sizeof(uint16_t);
-
-    DEBUG(fprintf(stderr, "nscount: %d\n", dnsr->d_nscount));
-
-    /* Send query to NS 0 */
-    DEBUG(fprintf(stderr, "sending query to: 0\n"));
-    if (dnsr_send_query(dnsr, 0) != 0) {
-        if (dnsr->d_errno == DNSR_ERROR_SYSTEM) {
-            return (-1);
-        }
-    }
-
-    dnsr->d_state = 0;
+    memcpy(&p->p_query[ p->p_querylen ], &temp, sizeof(uint16_t));
+    p->p_querylen += sizeof(uint16_t);
 
     return 0;
 }
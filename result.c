@@ -8,6 +8,7 @@
 #include <inttypes.h>
 #include <netdb.h>
 #include <netinet/in.h>
+#include <poll.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -26,358 +27,660 @@
 #include "internal.h"
 #include "timeval.h"
 
-extern struct event eventlist[ 32 ];
+static void dnsr_timers(DNSR *, struct timeval *, struct timeval *);
+static void dnsr_advance(
+        DNSR *, struct dnsr_pending *, struct timeval *, struct timeval *);
+static int  dnsr_receive(DNSR *, int);
 
 /*
  * dnsr_result waits upto timeout for a result from a previous
  * query.  If timeout is NULL, dnsr_result will block, if timeout is
  * 0, dnsr_result will poll.  Non-null timeout is modified on return
  * with the amount of time elapsed.
+ *
+ * If the query timed out because of timeout it is still in flight, and
+ * dnsr_result can be called again to keep waiting for it.
+ *
+ * The result is freed with dnsr_free_result( ), or handed back to dnsr for
+ * reuse with dnsr_release_result( ).
  */
 
 struct dnsr_result *
 dnsr_result(DNSR *dnsr, struct timeval *timeout) {
-    char                    resp[ DNSR_MAX_UDP ];
-    char                   *resp_tcp = NULL;
-    int                     rc, error, resplen, resp_errno = DNSR_ERROR_NONE;
-    int                     fd;
-    fd_set                  fdset;
-    struct dnsr_result     *result = NULL;
-    struct timeval          cur;  /* Current time */
-    struct timeval          end;  /* Time of timeout */
-    struct timeval          ext;  /* Time passed since last query */
-    struct timeval          wait; /* Calculated wait time */
-    struct sockaddr_storage reply_from;
-    socklen_t               socklen;
+    struct dnsr_pending *p;
+    struct dnsr_result  *result;
 
     if (!dnsr) {
         return (NULL);
     }
 
-    if (!dnsr->d_querysent) {
+    if ((p = dnsr->d_current) == NULL) {
         DEBUG(fprintf(stderr, "dnsr_result: query not sent\n"));
         dnsr->d_errno = DNSR_ERROR_NO_QUERY;
         return (NULL);
     }
-    socklen = sizeof(struct sockaddr_storage);
+
+    if (dnsr_run(dnsr, p, timeout) != 0) {
+        return (NULL);
+    }
+
+    if (!p->p_done) {
+        DEBUG(fprintf(stderr, "dnsr_result: timed out\n"));
+        dnsr->d_errno = DNSR_ERROR_TIMEOUT;
+        return (NULL);
+    }
+
+    if ((result = p->p_result) == NULL) {
+        dnsr->d_errno = p->p_errno;
+    }
+    p->p_result = NULL;
+    dnsr_pending_free(dnsr, p);
+
+    return (result);
+}
+
+/*
+ * dnsr_result_tagged waits upto timeout, as dnsr_result does, for any query
+ * made with dnsr_query_tagged to finish.  Its tag is returned in tag, and
+ * its result in result.  A query that failed has a NULL result, and the
+ * reason is in dnsr_errno.
+ *
+ * Return Values:
+ *      1       a query finished
+ *      0       timed out
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_result_tagged(DNSR *dnsr, struct timeval *timeout, int *tag,
+        struct dnsr_result **result) {
+    struct dnsr_pending *p;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if (dnsr->d_ntagged == 0) {
+        DEBUG(fprintf(stderr, "dnsr_result_tagged: no queries\n"));
+        dnsr->d_errno = DNSR_ERROR_NO_QUERY;
+        return (-1);
+    }
+
+    if (dnsr_run(dnsr, NULL, timeout) != 0) {
+        return (-1);
+    }
+
+    if ((p = dnsr_pending_next_done(dnsr)) == NULL) {
+        DEBUG(fprintf(stderr, "dnsr_result_tagged: timed out\n"));
+        dnsr->d_errno = DNSR_ERROR_TIMEOUT;
+        return 0;
+    }
+
+    if (tag != NULL) {
+        *tag = p->p_tag;
+    }
+    if ((*result = p->p_result) == NULL) {
+        dnsr->d_errno = p->p_errno;
+    }
+    p->p_result = NULL;
+    dnsr_pending_free(dnsr, p);
+
+    return 1;
+}
+
+/*
+ * dnsr_result_batch waits upto timeout, as dnsr_result does, for queries
+ * started with dnsr_query_batch to finish, and returns as many as max of
+ * them in results, in the order they finished.  Each is returned once.
+ *
+ * Return Values:
+ *      >0      number of queries in results
+ *      0       timed out
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_result_batch(DNSR *dnsr, struct timeval *timeout,
+        struct dnsr_batch_result *results, int max) {
+    struct dnsr_pending *p;
+    int                  n;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if (dnsr->d_ntagged == 0) {
+        DEBUG(fprintf(stderr, "dnsr_result_batch: no queries\n"));
+        dnsr->d_errno = DNSR_ERROR_NO_QUERY;
+        return (-1);
+    }
+
+    if (dnsr_run(dnsr, NULL, timeout) != 0) {
+        return (-1);
+    }
+
+    for (n = 0; n < max; n++) {
+        if ((p = dnsr_pending_next_done(dnsr)) == NULL) {
+            break;
+        }
+        results[ n ].br_index = p->p_tag;
+        results[ n ].br_errno = p->p_errno;
+        results[ n ].br_result = p->p_result;
+        p->p_result = NULL;
+        dnsr_pending_free(dnsr, p);
+    }
+
+    if (n == 0) {
+        DEBUG(fprintf(stderr, "dnsr_result_batch: timed out\n"));
+        dnsr->d_errno = DNSR_ERROR_TIMEOUT;
+    }
+
+    return (n);
+}
+
+/*
+ * dnsr_fds, dnsr_next_timeout and dnsr_process let an application run
+ * dnsr from its own event loop instead of waiting in dnsr_result.  It
+ * watches the descriptors from dnsr_fds for reading, and calls
+ * dnsr_process when one is readable or when the time from
+ * dnsr_next_timeout has passed.  Finished queries are then collected
+ * without waiting, by calling dnsr_result, dnsr_result_tagged or
+ * dnsr_result_batch with a zero timeout.
+ *
+ * The descriptors do not change for the life of the handle, except when
+ * DNSR_FLAG_URING is turned on or off: with io_uring there is one
+ * descriptor, the ring's.
+ *
+ * Return Values:
+ *      number of descriptors in fds
+ */
+
+int
+dnsr_fds(DNSR *dnsr, int *fds, int max) {
+    int n = 0;
+
+    if (!dnsr) {
+        return 0;
+    }
+
+    if (dnsr->d_uring != NULL) {
+        if (n < max) {
+            fds[ n++ ] = dnsr_uring_fd(dnsr);
+        }
+        return (n);
+    }
+
+    if ((dnsr->d_fd >= 0) && (n < max)) {
+        fds[ n++ ] = dnsr->d_fd;
+    }
+    if ((dnsr->d_fd6 >= 0) && (n < max)) {
+        fds[ n++ ] = dnsr->d_fd6;
+    }
+    return (n);
+}
+
+/*
+ * Sets tv to how long until dnsr_process needs to be called to run the
+ * retry timers, which is zero if they are overdue.
+ *
+ * Return Values:
+ *      1       tv is set
+ *      0       no queries in flight, no timer needed
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_next_timeout(DNSR *dnsr, struct timeval *tv) {
+    struct dnsr_pending *p;
+    struct timeval       cur, end, deadline;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if (dnsr->d_active == NULL) {
+        return 0;
+    }
+
+    if (gettimeofday(&cur, NULL) < 0) {
+        DEBUG(perror("gettimeofday"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+
+    deadline = cur;
+    for (p = dnsr->d_active; p != NULL; p = p->p_next) {
+        if ((p->p_events[ p->p_state ].e_type != DNSR_STATE_WAIT) &&
+                (p->p_events[ p->p_state ].e_type != DNSR_STATE_HEDGE)) {
+            /* Due now */
+            deadline = cur;
+            break;
+        }
+        dnsr_hedge_end(dnsr, p, &end);
+        if ((p == dnsr->d_active) || tv_lt(&end, &deadline)) {
+            deadline = end;
+        }
+    }
+
+    if (tv_sub(&deadline, &cur, tv) < 0) {
+        tv->tv_sec = 0;
+        tv->tv_usec = 0;
+    }
+    return 1;
+}
+
+/*
+ * Reads the responses waiting on fd, if fd is one of dnsr's descriptors,
+ * and runs the retry timers.  fd is -1 when only a timer fired.  It does
+ * not wait for UDP responses, but a truncated response is still retried
+ * over TCP before it returns.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_process(DNSR *dnsr, int fd) {
+    struct timeval cur, deadline;
+
+    if (!dnsr) {
+        return (-1);
+    }
+
+    if ((fd >= 0) && (dnsr->d_uring != NULL)) {
+        if (fd != dnsr_uring_fd(dnsr)) {
+            DEBUG(fprintf(stderr, "dnsr_process: not our fd\n"));
+            dnsr->d_errno = DNSR_ERROR_FD_SET;
+            return (-1);
+        }
+        if (dnsr_uring_wait(dnsr, 0) != 0) {
+            return (-1);
+        }
+    } else if (fd >= 0) {
+        if ((fd != dnsr->d_fd) && (fd != dnsr->d_fd6)) {
+            DEBUG(fprintf(stderr, "dnsr_process: not our fd\n"));
+            dnsr->d_errno = DNSR_ERROR_FD_SET;
+            return (-1);
+        }
+        if (dnsr_receive(dnsr, fd) != 0) {
+            return (-1);
+        }
+    }
+
+    if (gettimeofday(&cur, NULL) < 0) {
+        DEBUG(perror("gettimeofday"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+    dnsr_timers(dnsr, &cur, &deadline);
+
+    return 0;
+}
+
+/*
+ * Runs the timers of every query in flight and reads responses for any of
+ * them until want is done, or, if want is NULL, until a tagged query is done.
+ * timeout is as for dnsr_result.
+ *
+ * Return Values:
+ *      0       done or timed out
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_run(DNSR *dnsr, struct dnsr_pending *want, struct timeval *timeout) {
+    int            i, rc, nfds, fds[ 2 ], last = 0;
+    struct pollfd  pfd[ 2 ];
+    struct timeval cur;  /* Current time */
+    struct timeval end;  /* Time of timeout */
+    struct timeval wait; /* Calculated wait time */
+    struct timeval deadline;
 
     /* Calculate end */
     if (timeout != NULL) {
         if (gettimeofday(&cur, NULL) < 0) {
             DEBUG(perror("gettimeofday"));
             dnsr->d_errno = DNSR_ERROR_SYSTEM;
-            return (NULL);
+            return (-1);
         }
         if (tv_add(&cur, timeout, &end) != 0) {
             DEBUG(fprintf(stderr, "tv_add failed\n"));
             dnsr->d_errno = DNSR_ERROR_TV;
-            return (NULL);
+            return (-1);
         }
     }
 
-    memset(&resp, 0, DNSR_MAX_UDP);
-
-    while (eventlist[ dnsr->d_state ].e_type != DNSR_STATE_DONE) {
-        error = 0;
+    for (;;) {
+        if (gettimeofday(&cur, NULL) < 0) {
+            DEBUG(perror("gettimeofday"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
 
-        switch (eventlist[ dnsr->d_state ].e_type) {
+        dnsr_timers(dnsr, &cur, &deadline);
 
-        case DNSR_STATE_WAIT:
+        if ((want != NULL) ? want->p_done : (dnsr->d_done != NULL)) {
+            break;
+        }
+        if ((dnsr->d_active == NULL) || last) {
+            break;
+        }
 
-            /* Convert wait event value into timeval struct */
-            DEBUG(fprintf(stderr, "WAIT_STATE\n"));
-            wait.tv_sec = eventlist[ dnsr->d_state ].e_value;
+        if (tv_sub(&deadline, &cur, &wait) < 0) {
+            wait.tv_sec = 0;
             wait.tv_usec = 0;
-            DEBUG(fprintf(stderr, "event time: %ld.%ld\n",
-                    (long int)wait.tv_sec, (long int)wait.tv_usec));
-
-            /* Get current time */
-            if (gettimeofday(&cur, NULL) < 0) {
-                DEBUG(perror("gettimeofday"));
-                dnsr->d_errno = DNSR_ERROR_SYSTEM;
-                return (NULL);
-            }
-
-            /* Adjust wait to account for pass*/
-            if (tv_sub(&cur, &dnsr->d_querytime, &ext) < 0) {
-                DEBUG(fprintf(stderr, "tv_sub failed\n"));
-                dnsr->d_errno = DNSR_ERROR_TV;
-                return (NULL);
-            }
-            DEBUG(fprintf(stderr, "ext time: %ld.%06ld\n", (long int)ext.tv_sec,
-                    (long int)ext.tv_usec));
+        }
 
-            if (tv_sub(&wait, &ext, &wait) < 0) {
-                /* wait is negative, we can't have that */
-                /* Why can't I just say wait = {0,0} */
+        /* Check endtime and make sure we never wait past it */
+        if (timeout != NULL) {
+            if (tv_sub(&end, &cur, timeout) != 0) {
+                /* timedout - but let's check an answer one last time */
+                timeout->tv_sec = 0;
+                timeout->tv_usec = 0;
                 wait.tv_sec = 0;
                 wait.tv_usec = 0;
+                last = 1;
+            } else if (tv_gt(&wait, timeout)) {
+                /* The end is near; wait for it, but no longer */
+                wait.tv_sec = timeout->tv_sec;
+                wait.tv_usec = timeout->tv_usec;
             }
-            DEBUG(fprintf(stderr, "ext adjusted time: %ld.%ld\n",
-                    (long int)wait.tv_sec, (long int)wait.tv_usec));
-
-            /* Check endtime and make sure we never wait past it */
-            if (timeout != NULL) {
-                if (tv_sub(&end, &cur, timeout) != 0) {
-                    /* timedout - but let's check an answer one last time */
-                    wait.tv_sec = 0;
-                    wait.tv_usec = 0;
-                } else {
-                    if (tv_gt(&wait, timeout)) {
-                        /* The end is near; wait for it, but no longer */
-                        wait.tv_sec = timeout->tv_sec;
-                        wait.tv_usec = timeout->tv_usec;
-                    }
-                }
-            }
+        }
 
-            DEBUG(fprintf(stderr, "select time: %ld.%ld\n", (long)wait.tv_sec,
-                    (long)wait.tv_usec));
-            /*
-             * "On successful completion,  the  object  pointed  to  by  the
-             * timeout argument may be modified" so we don't know how
-             * much time has passed when we return.  ( select(3c) )
-             *
-             * To look for error we could:
-             *   1 - use errorfds to get error condition
-             *   2 - look at result, if any, to see if it's good
-             *
-             * In either case, we could select again on same NS if it is just
-             * a temp error, or mark is down if it is fatal.
-             */
-            FD_ZERO(&fdset);
-            if (dnsr->d_fd >= 0) {
-                FD_SET(dnsr->d_fd, &fdset);
-            }
-            if (dnsr->d_fd6 >= 0) {
-                FD_SET(dnsr->d_fd6, &fdset);
-            }
-            if ((rc = select(
-                         (dnsr->d_fd > dnsr->d_fd6 ? dnsr->d_fd : dnsr->d_fd6) +
-                                 1,
-                         &fdset, NULL, NULL, &wait)) < 0) {
-                if (errno == EINTR) {
-                    /* Break out to recalculate timeout */
-                    break;
-                }
-                DEBUG(perror("select"));
-                dnsr->d_errno = DNSR_ERROR_SYSTEM;
-                return (NULL);
+        DEBUG(fprintf(stderr, "poll time: %ld.%ld\n", (long)wait.tv_sec,
+                (long)wait.tv_usec));
+        if (dnsr->d_uring != NULL) {
+            /* Waits for and handles responses itself */
+            if (dnsr_uring_wait(dnsr,
+                        wait.tv_sec * 1000 + (wait.tv_usec + 999) / 1000) !=
+                    0) {
+                return (-1);
             }
+            continue;
+        }
 
-            if (rc == 0) {
-                /* Break out of wait state */
-                DEBUG(fprintf(stderr, "dnsr_result: select timed out\n"));
-                DEBUG(fprintf(stderr, "advancing state\n"));
-                dnsr->d_state++;
-                break;
+        /* poll( ) rather than select( ), which can't take descriptors
+         * past FD_SETSIZE.
+         */
+        nfds = dnsr_fds(dnsr, fds, 2);
+        for (i = 0; i < nfds; i++) {
+            pfd[ i ].fd = fds[ i ];
+            pfd[ i ].events = POLLIN;
+            pfd[ i ].revents = 0;
+        }
+        if ((rc = poll(pfd, nfds,
+                     wait.tv_sec * 1000 + (wait.tv_usec + 999) / 1000)) < 0) {
+            if (errno == EINTR) {
+                /* Go round to recalculate timeout */
+                continue;
             }
+            DEBUG(perror("poll"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
 
-            if (FD_ISSET(dnsr->d_fd6, &fdset)) {
-                fd = dnsr->d_fd6;
-            } else if (FD_ISSET(dnsr->d_fd, &fdset)) {
-                fd = dnsr->d_fd;
-            } else {
-                DEBUG(fprintf(stderr, "select: wrong fd\n"));
-                /* XXX - error value? */
-                dnsr->d_errno = DNSR_ERROR_FD_SET;
-                return (NULL);
-            }
-            /* Get response */
-
-            /* XXX - OS X doesn't have socklen_t */
-            while ((resplen = recvfrom(fd, &resp, DNSR_MAX_UDP, 0,
-                            (struct sockaddr *)&reply_from, &socklen)) < 0) {
-                if (resplen != EINTR) {
-                    DEBUG(perror("recvfrom"));
-                    dnsr->d_errno = DNSR_ERROR_SYSTEM;
-                    return (NULL);
-                }
-            }
-            DEBUG(fprintf(stderr, "received %d bytes\n", resplen));
-            DEBUG({
-                char buf[ INET6_ADDRSTRLEN ];
-                if (getnameinfo((struct sockaddr *)&reply_from,
-                            sizeof(struct sockaddr_storage), buf,
-                            INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST) == 0) {
-                    fprintf(stderr, "reply: %s\n", buf);
-                }
-            })
-
-            if ((rc = dnsr_validate_resp(
-                         dnsr, resp, (struct sockaddr *)&reply_from)) != 0) {
-                DEBUG(dnsr_perror(dnsr, "dnsr_validate_resp"));
-                if (rc == DNSR_ERROR_NS_INVALID) {
-                    break;
-                } else if (rc == DNSR_ERROR_TRUNCATION) {
-                    if (((resp_tcp = dnsr_send_query_tcp(
-                                  dnsr, dnsr->d_nsresp, &resplen)) == NULL)) {
-                        return (NULL);
-                    }
-                    if ((dnsr_validate_resp(dnsr, resp_tcp,
-                                (struct sockaddr *)&reply_from)) != 0) {
-                        error = 1;
-                    }
-
-                } else {
-                    error = 1;
-                }
-            }
+        if (rc == 0) {
+            DEBUG(fprintf(stderr, "dnsr_run: poll timed out\n"));
+            continue;
+        }
 
-            if (resp_tcp != NULL) {
-                result = dnsr_create_result(dnsr, resp_tcp, resplen);
-            } else {
-                result = dnsr_create_result(dnsr, resp, resplen);
-            }
-            if (result == NULL) {
-                if (dnsr->d_errno == DNSR_ERROR_SYSTEM) {
-                    DEBUG(fprintf(stderr, "create_result failed\n"));
-                    free(resp_tcp);
-                    resp_tcp = NULL;
-                    return (NULL);
-                } else {
-                    /* Bad result - goto top of loop, but save error */
-                    free(resp_tcp);
-                    resp_tcp = NULL;
-                    resp_errno = dnsr->d_errno;
-                    dnsr->d_errno = DNSR_ERROR_NONE;
-                    break;
+        for (i = 0; i < nfds; i++) {
+            if (pfd[ i ].revents & (POLLIN | POLLERR)) {
+                if (dnsr_receive(dnsr, pfd[ i ].fd) != 0) {
+                    return (-1);
                 }
-            } else {
-                free(resp_tcp);
-                resp_tcp = NULL;
             }
-            if ((rc = dnsr_validate_result(dnsr, result)) != 0) {
-                DEBUG(fprintf(stderr, "dnsr_validate_result failed\n"));
-                if (rc == DNSR_ERROR_NAME) {
-                    return (result);
-                }
-                error = 1;
-            }
-            if (dnsr_match_additional(dnsr, result) != 0) {
-                DEBUG(fprintf(stderr, "dnsr_match_additional failed\n"));
-                dnsr_free_result(result);
-                return (NULL);
-            }
-            if (error == 1) {
-                dnsr_free_result(result);
-                break;
-            }
-            return (result);
+        }
+    }
+
+    if ((timeout != NULL) && !last) {
+        if (tv_sub(&end, &cur, timeout) != 0) {
+            timeout->tv_sec = 0;
+            timeout->tv_usec = 0;
+        }
+    }
+
+    return 0;
+}
+
+/*
+ * Moves every query along its schedule, sends what that asks for, and
+ * finds the soonest time one of them needs attention again.
+ */
 
+static void
+dnsr_timers(DNSR *dnsr, struct timeval *cur, struct timeval *deadline) {
+    struct dnsr_pending *p, *next;
+
+    deadline->tv_sec = 0;
+    deadline->tv_usec = 0;
+    for (p = dnsr->d_active; p != NULL; p = next) {
+        next = p->p_next;
+        dnsr_advance(dnsr, p, cur, deadline);
+    }
+    dnsr_udp_flush(dnsr);
+}
+
+/*
+ * Steps p through eventlist as far as the time cur allows.  If p is left
+ * waiting, deadline is moved up to when its wait ends.
+ */
+
+static void
+dnsr_advance(DNSR *dnsr, struct dnsr_pending *p, struct timeval *cur,
+        struct timeval *deadline) {
+    struct timeval end;
+
+    for (;;) {
+        switch (p->p_events[ p->p_state ].e_type) {
         case DNSR_STATE_ASK:
             DEBUG(fprintf(stderr, "ASK_STATE\n"));
-            if (eventlist[ dnsr->d_state ].e_value < dnsr->d_nscount) {
-                /* Check if NS is valid & alive */
-                if (dnsr_send_query(dnsr, eventlist[ dnsr->d_state ].e_value) !=
-                        0) {
-                    return (NULL);
+            if (p->p_events[ p->p_state ].e_value == DNSR_ASK_ALL) {
+                if (dnsr_send_all(dnsr, p) != 0) {
+                    dnsr_pending_done(dnsr, p, NULL, dnsr->d_errno);
+                    return;
                 }
-                /* Set query time */
-                if (gettimeofday(&dnsr->d_querytime, NULL) < 0) {
-                    DEBUG(perror("gettimeofday"));
-                    dnsr->d_errno = DNSR_ERROR_SYSTEM;
-                    return (NULL);
+            } else if (p->p_events[ p->p_state ].e_value < dnsr->d_nscount) {
+                if (dnsr_send_pending(
+                            dnsr, p, p->p_events[ p->p_state ].e_value) != 0) {
+                    dnsr_pending_done(dnsr, p, NULL, dnsr->d_errno);
+                    return;
                 }
             }
-
-            dnsr->d_state++;
-            DEBUG(fprintf(stderr, "advancing state\n"));
+            p->p_state++;
             break;
 
+        case DNSR_STATE_WAIT:
+        case DNSR_STATE_HEDGE:
+            dnsr_hedge_end(dnsr, p, &end);
+            if (!tv_gt(&end, cur)) {
+                DEBUG(fprintf(stderr, "advancing state\n"));
+                p->p_state++;
+                break;
+            }
+            if (((deadline->tv_sec == 0) && (deadline->tv_usec == 0)) ||
+                    tv_lt(&end, deadline)) {
+                *deadline = end;
+            }
+            return;
+
         case DNSR_STATE_DONE:
             DEBUG(fprintf(stderr, "STATE_DONE\n"));
-            goto done;
+            dnsr_pending_done(dnsr, p, NULL,
+                    (p->p_resp_errno != DNSR_ERROR_NONE) ? p->p_resp_errno
+                                                        : DNSR_ERROR_TIMEOUT);
+            return;
 
         default:
             DEBUG(fprintf(stderr, "Unknown state\n"));
-            dnsr->d_errno = DNSR_ERROR_STATE;
-            return (NULL);
+            dnsr_pending_done(dnsr, p, NULL, DNSR_ERROR_STATE);
+            return;
         }
-
-        /* Check and update timeout */
-        if (timeout != NULL) {
-            if (gettimeofday(&cur, NULL) < 0) {
-                dnsr->d_errno = DNSR_ERROR_SYSTEM;
-                return (NULL);
-            }
-            if (tv_sub(&end, &cur, timeout) < 0) {
-                DEBUG(fprintf(stderr, "dnsr_result: timed out\n"));
-                goto done;
-            }
-        }
-    }
-
-done:
-    if (resp_errno != DNSR_ERROR_NONE) {
-        dnsr->d_errno = resp_errno;
-    } else {
-        dnsr->d_errno = DNSR_ERROR_TIMEOUT;
     }
-    return (NULL);
 }
 
-void
-dnsr_free_result(struct dnsr_result *result) {
-    int i;
+/*
+ * Reads every response waiting on fd and hands each to the query it
+ * answers.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
 
-    if (result == NULL) {
-        return;
-    }
+static int
+dnsr_receive(DNSR *dnsr, int fd) {
+    int                  i, n;
+    struct dnsr_udprecv *r;
 
-    if (result->r_ancount > 0) {
-        for (i = 0; i < result->r_ancount; i++) {
-            dnsr_free_ip_info(result->r_answer[ i ].rr_ip);
-            if (result->r_answer[ i ].rr_type == DNSR_TYPE_TXT) {
-                dnsr_free_dnsr_string(result->r_answer[ i ].rr_txt.txt_data);
-            }
+    do {
+        if ((n = dnsr_udp_recv(dnsr, fd)) < 0) {
+            return (-1);
         }
-        free(result->r_answer);
-    }
+        for (i = 0; i < n; i++) {
+            r = &dnsr->d_recvq[ i ];
+            dnsr_response(
+                    dnsr, r->r_buf, r->r_len, (struct sockaddr *)&r->r_from);
+        }
+    } while (n == DNSR_RECV_BATCH);
+
+    return 0;
+}
 
-    if (result->r_nscount > 0) {
-        for (i = 0; i < result->r_nscount; i++) {
-            dnsr_free_ip_info(result->r_ns[ i ].rr_ip);
+/*
+ * Hands a response to the query it answers.  Responses that are not usable
+ * are dropped, and the query keeps waiting.  Also called by uring.c.
+ */
+
+void
+dnsr_response(
+        DNSR *dnsr, char *resp, int resplen, struct sockaddr *reply_from) {
+    char                *resp_tcp = NULL;
+    int                  rc, error = 0;
+    struct dnsr_pending *p = NULL;
+
+    DEBUG(fprintf(stderr, "received %d bytes\n", resplen));
+    DEBUG({
+        char buf[ INET6_ADDRSTRLEN ];
+        if (getnameinfo(reply_from, sizeof(struct sockaddr_storage), buf,
+                    INET6_ADDRSTRLEN, NULL, 0, NI_NUMERICHOST) == 0) {
+            fprintf(stderr, "reply: %s\n", buf);
         }
-        free(result->r_ns);
+    })
+
+    rc = dnsr_validate_resp(dnsr, resp, resplen, reply_from, &p);
+    if ((p != NULL) && (rc != DNSR_ERROR_NS_INVALID)) {
+        /* Any response from the server times it */
+        dnsr_hedge_sample(dnsr, p, dnsr->d_nsresp);
     }
+    if (rc != 0) {
+        DEBUG(dnsr_perror(dnsr, "dnsr_validate_resp"));
+        if ((rc == DNSR_ERROR_NS_INVALID) || (p == NULL)) {
+            return;
+        } else if (rc == DNSR_ERROR_TRUNCATION) {
+            if (dnsr->d_opts & DNSR_OPT_TCPASYNC) {
+                /* Asked again without waiting, see tcp.c */
+                if (dnsr_tcp_start(dnsr, p, dnsr->d_nsresp) != 0) {
+                    dnsr_pending_done(dnsr, p, NULL, dnsr->d_errno);
+                }
+                return;
+            }
+            if (((resp_tcp = dnsr_send_query_tcp(
+                          dnsr, p, dnsr->d_nsresp, &resplen)) == NULL)) {
+                dnsr_pending_done(dnsr, p, NULL, dnsr->d_errno);
+                return;
+            }
+            if ((dnsr_validate_resp(dnsr, resp_tcp, resplen,
+                        reply_from, &p)) != 0) {
+                error = 1;
+            }
 
-    if (result->r_arcount > 0) {
-        for (i = 0; i < result->r_arcount; i++) {
-            dnsr_free_ip_info(result->r_additional[ i ].rr_ip);
+        } else {
+            error = 1;
         }
-        free(result->r_additional);
     }
 
-    free(result);
+    /* The TCP buffer is the handle's, and is copied into the result */
+    dnsr_response_use(dnsr, p, (resp_tcp != NULL) ? resp_tcp : resp, resplen,
+            error);
 }
 
+/*
+ * Makes a result of resp, a response to p that has been through
+ * dnsr_validate_resp( ), and finishes p with it.  If error is set the
+ * response is not usable, and p keeps waiting.  Also called by tcp.c.
+ */
+
 void
-dnsr_free_ip_info(struct ip_info *i) {
-    struct ip_info *next;
+dnsr_response_use(DNSR *dnsr, struct dnsr_pending *p, char *resp,
+        int resplen, int error) {
+    struct dnsr_result *result;
+    int                 rc;
+
+    if ((result = dnsr_create_result(
+                 dnsr, resp, resplen, p->p_questionlen)) == NULL) {
+        if (dnsr->d_errno == DNSR_ERROR_SYSTEM) {
+            DEBUG(fprintf(stderr, "create_result failed\n"));
+            dnsr_pending_done(dnsr, p, NULL, DNSR_ERROR_SYSTEM);
+        } else {
+            /* Bad result - keep waiting, but save error */
+            p->p_resp_errno = dnsr->d_errno;
+        }
+        dnsr->d_errno = DNSR_ERROR_NONE;
+        return;
+    }
+    ((struct dnsr_result_block *)result)->rb_querytime = p->p_querytime;
+
+    if ((rc = dnsr_validate_result(dnsr, result)) != 0) {
+        DEBUG(fprintf(stderr, "dnsr_validate_result failed\n"));
+        /* Only a usable NXDOMAIN finishes the query */
+        if ((rc == DNSR_ERROR_NAME) && (error == 0)) {
+            if (dnsr->d_cache != NULL) {
+                dnsr_cache_put(dnsr, p, result);
+            }
+            /* The end of a CNAME chain may not exist */
+            dnsr_cname_follow(dnsr, p, result);
+            dnsr_pending_done(dnsr, p, result, DNSR_ERROR_NONE);
+            return;
+        }
+        error = 1;
+    }
+    if (dnsr_match_additional(dnsr, result) != 0) {
+        DEBUG(fprintf(stderr, "dnsr_match_additional failed\n"));
+        dnsr_release_result(dnsr, result);
+        dnsr_pending_done(dnsr, p, NULL, dnsr->d_errno);
+        return;
+    }
+    if (error == 1) {
+        dnsr_release_result(dnsr, result);
+        return;
+    }
 
-    while (i != NULL) {
-        next = i->ip_next;
-        free(i);
-        i = next;
+    if (dnsr->d_cache != NULL) {
+        dnsr_cache_put(dnsr, p, result);
+    }
+    if (dnsr_cname_follow(dnsr, p, result) == 1) {
+        return;
     }
+    dnsr_pending_done(dnsr, p, result, DNSR_ERROR_NONE);
 }
 
 void
-dnsr_free_dnsr_string(struct dnsr_string *t) {
-    struct dnsr_string *next;
-
-    while (t != NULL) {
-        next = t->s_next;
-        free(t);
-        t = next;
+dnsr_free_result(struct dnsr_result *result) {
+    if (result == NULL) {
+        return;
     }
+
+    dnsr_arena_free(result);
 }
 
 int
 dnsr_result_expired(DNSR *dnsr, struct dnsr_result *result) {
-    int            i;
-    struct timeval tv_current, tv_expire;
+    int                       i;
+    struct timeval            tv_current, tv_expire;
+    struct dnsr_result_block *rb = (struct dnsr_result_block *)result;
+    struct dnsr_cursor        c;
 
     if (gettimeofday(&tv_current, NULL) != 0) {
         return (-1);
@@ -385,9 +688,21 @@ dnsr_result_expired(DNSR *dnsr, struct dnsr_result *result) {
 
     tv_expire.tv_usec = 0;
 
+    if (rb->rb_lazy) {
+        dnsr_cursor_init(&c, result);
+        while ((dnsr_rr_next(dnsr, &c) > 0) &&
+                (c.c_section == DNSR_SECTION_ANSWER)) {
+            tv_expire.tv_sec = c.c_ttl + rb->rb_querytime.tv_sec;
+            if (tv_gt(&tv_current, &tv_expire)) {
+                return 1;
+            }
+        }
+        return 0;
+    }
+
     for (i = 0; i < result->r_ancount; i++) {
         tv_expire.tv_sec =
-                result->r_answer[ i ].rr_ttl + dnsr->d_querytime.tv_sec;
+                result->r_answer[ i ].rr_ttl + rb->rb_querytime.tv_sec;
 
         if (tv_gt(&tv_current, &tv_expire)) {
             return 1;
@@ -396,3 +711,105 @@ dnsr_result_expired(DNSR *dnsr, struct dnsr_result *result) {
 
     return 0;
 }
+
+/*
+ * Returns the domain name carried in the RDATA of rr, e.g. the exchange of
+ * an MX or the target of a CNAME, or NULL if the type does not carry one.
+ */
+
+const char *
+dnsr_rr_target(const struct dnsr_rr *rr) {
+    switch (rr->rr_type) {
+    case DNSR_TYPE_CNAME:
+    case DNSR_TYPE_MB:
+    case DNSR_TYPE_MD:
+    case DNSR_TYPE_MF:
+    case DNSR_TYPE_MG:
+    case DNSR_TYPE_MR:
+    case DNSR_TYPE_NS:
+    case DNSR_TYPE_PTR:
+        return (rr->rr_dn.dn_name);
+
+    case DNSR_TYPE_MX:
+        return (rr->rr_mx.mx_exchange);
+
+    case DNSR_TYPE_SOA:
+        return (rr->rr_soa.soa_mname);
+
+    case DNSR_TYPE_SRV:
+        return (rr->rr_srv.srv_target);
+
+    default:
+        return (NULL);
+    }
+}
+
+/*
+ * Returns the raw RDATA of rr for types that are not decoded, or NULL.
+ */
+
+const void *
+dnsr_rr_rdata(const struct dnsr_rr *rr, uint16_t *len) {
+    switch (rr->rr_type) {
+    case DNSR_TYPE_CNAME:
+    case DNSR_TYPE_MB:
+    case DNSR_TYPE_MD:
+    case DNSR_TYPE_MF:
+    case DNSR_TYPE_MG:
+    case DNSR_TYPE_MR:
+    case DNSR_TYPE_NS:
+    case DNSR_TYPE_PTR:
+    case DNSR_TYPE_HINFO:
+    case DNSR_TYPE_MX:
+    case DNSR_TYPE_SOA:
+    case DNSR_TYPE_TXT:
+    case DNSR_TYPE_A:
+    case DNSR_TYPE_AAAA:
+    case DNSR_TYPE_OPT:
+    case DNSR_TYPE_SRV:
+        return (NULL);
+
+    default:
+        break;
+    }
+
+    if (rr->rr_null.null_name == NULL) {
+        return (NULL);
+    }
+    if (len != NULL) {
+        *len = rr->rr_rdlength;
+    }
+    return (rr->rr_null.null_name);
+}
+
+/*
+ * Returns the strings of a TXT RR joined together, e.g. a DKIM key that was
+ * split to fit, without copying.  NULL if rr is not a TXT RR.
+ */
+
+const char *
+dnsr_txt_joined(const struct dnsr_rr *rr, uint16_t *len) {
+    if (rr->rr_type != DNSR_TYPE_TXT) {
+        return (NULL);
+    }
+    if (len != NULL) {
+        *len = rr->rr_txt.txt_off[ rr->rr_txt.txt_count ];
+    }
+    return (rr->rr_txt.txt_data);
+}
+
+/*
+ * Returns string i of a TXT RR.  It is not NUL terminated, use len.
+ */
+
+const char *
+dnsr_txt_string(const struct dnsr_rr *rr, int i, uint16_t *len) {
+    if ((rr->rr_type != DNSR_TYPE_TXT) || (i < 0) ||
+            (i >= rr->rr_txt.txt_count)) {
+        return (NULL);
+    }
+    if (len != NULL) {
+        *len = rr->rr_txt.txt_off[ i + 1 ] - rr->rr_txt.txt_off[ i ];
+    }
+    return (rr->rr_txt.txt_data + rr->rr_txt.txt_off[ i ]);
+}
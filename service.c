@@ -0,0 +1,517 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "denser.h"
+#include "internal.h"
+#include "timeval.h"
+
+/*
+ * A DNSR_SERVICE owns a handle and a thread that does all of its I/O, so
+ * that any number of application threads can resolve without blocking in
+ * dnsr_result( ) and without sharing a handle.
+ *
+ * dnsr_submit( ) pushes onto an intrusive multi-producer, single-consumer
+ * queue ( Vyukov's ) with one atomic exchange, and writes a byte to the
+ * service's pipe only if the I/O thread has not already been woken.  The
+ * I/O thread moves what was submitted into its own backlog, starts as many
+ * as DNSR_SERVICE_INFLIGHT of them with dnsr_query_tagged( ), and collects
+ * them with dnsr_result_batch( ).  Each finished lookup is handed to its
+ * callback on the I/O thread, or, if it had none, put on the completion
+ * queue for dnsr_service_completions( ).
+ *
+ * A truncated response is asked again over a non-blocking TCP connection,
+ * see tcp.c, which the I/O thread polls alongside its UDP sockets, so that
+ * one large answer does not hold up every other lookup.
+ */
+
+#define DNSR_SERVICE_INFLIGHT 4096 /* Lookups in flight on the handle */
+#define DNSR_SERVICE_BATCH 64      /* Results collected at a time */
+
+struct dnsr_submission {
+    struct dnsr_submission *s_next;
+    dnsr_callback           s_cb;
+    void                   *s_arg;
+    struct dnsr_result     *s_result;
+    int                     s_errno;
+    uint16_t                s_type;
+    char                    s_name[ DNSR_MAX_NAME + 1 ];
+};
+
+struct dnsr_service {
+    DNSR     *sv_dnsr;
+    pthread_t sv_thread;
+    int       sv_pipe[ 2 ];
+    int       sv_wake; /* I/O thread has been woken */
+    int       sv_stop;
+
+    /* Submission queue, pushed at sv_head and popped at sv_tail */
+    struct dnsr_submission *sv_head;
+    struct dnsr_submission *sv_tail;
+    struct dnsr_submission  sv_stub;
+
+    /* I/O thread only */
+    struct dnsr_submission  *sv_backlog;
+    struct dnsr_submission  *sv_backlogtail;
+    struct dnsr_submission **sv_slots; /* by tag */
+    int                     *sv_free;  /* free tags */
+    int                      sv_nfree;
+
+    /* Completion queue */
+    pthread_mutex_t         sv_lock;
+    pthread_cond_t          sv_cond;
+    struct dnsr_submission *sv_done;
+    struct dnsr_submission *sv_donetail;
+};
+
+static void                    dnsr_service_push(
+                           DNSR_SERVICE *, struct dnsr_submission *);
+static struct dnsr_submission *dnsr_service_pop(DNSR_SERVICE *);
+static void                    dnsr_service_wake(DNSR_SERVICE *);
+static void                   *dnsr_service_run(void *);
+static void                    dnsr_service_start(DNSR_SERVICE *);
+static void                    dnsr_service_collect(DNSR_SERVICE *);
+static void                    dnsr_service_cancel(DNSR_SERVICE *);
+static void                    dnsr_service_finish(
+                           DNSR_SERVICE *, struct dnsr_submission *);
+
+/*
+ * Starts a service on dnsr, which must be set up with dnsr_nameserver( )
+ * and any dnsr_config( ) flags first.  The service owns dnsr from then on;
+ * it is used only by the I/O thread, and freed by dnsr_service_free( ).
+ *
+ * Return Values:
+ *      DNSR_SERVICE *  success
+ *      NULL            system error - check errno
+ */
+
+DNSR_SERVICE *
+dnsr_service_new(DNSR *dnsr) {
+    DNSR_SERVICE *svc;
+    int           i, rc;
+
+    if (dnsr == NULL) {
+        errno = EINVAL;
+        return (NULL);
+    }
+
+    if ((svc = calloc(1, sizeof(DNSR_SERVICE))) == NULL) {
+        return (NULL);
+    }
+    svc->sv_pipe[ 0 ] = svc->sv_pipe[ 1 ] = -1;
+    svc->sv_head = svc->sv_tail = &svc->sv_stub;
+
+    if (((svc->sv_slots = calloc(DNSR_SERVICE_INFLIGHT,
+                  sizeof(struct dnsr_submission *))) == NULL) ||
+            ((svc->sv_free = calloc(DNSR_SERVICE_INFLIGHT, sizeof(int))) ==
+                    NULL)) {
+        goto error;
+    }
+    for (i = 0; i < DNSR_SERVICE_INFLIGHT; i++) {
+        svc->sv_free[ i ] = DNSR_SERVICE_INFLIGHT - 1 - i;
+    }
+    svc->sv_nfree = DNSR_SERVICE_INFLIGHT;
+
+    if (pipe(svc->sv_pipe) != 0) {
+        DEBUG(perror("pipe"));
+        goto error;
+    }
+    for (i = 0; i < 2; i++) {
+        fcntl(svc->sv_pipe[ i ], F_SETFD, FD_CLOEXEC);
+        fcntl(svc->sv_pipe[ i ], F_SETFL,
+                fcntl(svc->sv_pipe[ i ], F_GETFL) | O_NONBLOCK);
+    }
+
+    pthread_mutex_init(&svc->sv_lock, NULL);
+    pthread_cond_init(&svc->sv_cond, NULL);
+
+    svc->sv_dnsr = dnsr;
+    dnsr->d_opts |= DNSR_OPT_TCPASYNC;
+    if ((rc = pthread_create(
+                 &svc->sv_thread, NULL, dnsr_service_run, svc)) != 0) {
+        DEBUG(fprintf(stderr, "pthread_create: %s\n", strerror(rc)));
+        dnsr->d_opts &= ~DNSR_OPT_TCPASYNC;
+        pthread_mutex_destroy(&svc->sv_lock);
+        pthread_cond_destroy(&svc->sv_cond);
+        errno = rc;
+        goto error;
+    }
+
+    return (svc);
+
+error:
+    rc = errno;
+    if (svc->sv_pipe[ 0 ] >= 0) {
+        close(svc->sv_pipe[ 0 ]);
+        close(svc->sv_pipe[ 1 ]);
+    }
+    free(svc->sv_slots);
+    free(svc->sv_free);
+    free(svc);
+    errno = rc;
+    return (NULL);
+}
+
+/*
+ * Stops the I/O thread and frees the service and its handle.  Lookups that
+ * have not finished are finished with DNSR_ERROR_TIMEOUT, and their
+ * callbacks are run, before it returns.  Results on the completion queue
+ * that were not collected are freed.
+ *
+ * No other thread may be in dnsr_submit( ) or dnsr_service_completions( )
+ * for svc, and it must not be called from a callback.
+ */
+
+void
+dnsr_service_free(DNSR_SERVICE *svc) {
+    struct dnsr_submission *s;
+
+    if (svc == NULL) {
+        return;
+    }
+
+    __atomic_store_n(&svc->sv_stop, 1, __ATOMIC_SEQ_CST);
+    /* Always write, the thread may be asleep with sv_wake still set */
+    while ((write(svc->sv_pipe[ 1 ], "", 1) < 0) && (errno == EINTR))
+        ;
+    pthread_join(svc->sv_thread, NULL);
+
+    while ((s = svc->sv_done) != NULL) {
+        svc->sv_done = s->s_next;
+        dnsr_free_result(s->s_result);
+        free(s);
+    }
+
+    dnsr_free(svc->sv_dnsr);
+    close(svc->sv_pipe[ 0 ]);
+    close(svc->sv_pipe[ 1 ]);
+    pthread_mutex_destroy(&svc->sv_lock);
+    pthread_cond_destroy(&svc->sv_cond);
+    free(svc->sv_slots);
+    free(svc->sv_free);
+    free(svc);
+}
+
+/*
+ * Queues a lookup of name for qtype in class IN, and returns at once.  It
+ * can be called from any thread, and from callbacks.
+ *
+ * When the lookup finishes, cb is called on the service's I/O thread with
+ * arg, the result and a DNSR_ERROR_* code.  The result is NULL when the
+ * lookup failed, and is the callee's to free with dnsr_free_result( ).
+ * Callbacks should be quick: no other lookup is serviced while one runs.
+ * If cb is NULL the same is put on the completion queue instead.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check errno
+ */
+
+int
+dnsr_submit(DNSR_SERVICE *svc, uint16_t qtype, const char *name,
+        dnsr_callback cb, void *arg) {
+    struct dnsr_submission *s;
+    size_t                  len;
+
+    if ((svc == NULL) || (name == NULL)) {
+        errno = EINVAL;
+        return (-1);
+    }
+    if ((len = strlen(name)) > DNSR_MAX_NAME) {
+        errno = ENAMETOOLONG;
+        return (-1);
+    }
+
+    if ((s = malloc(sizeof(struct dnsr_submission))) == NULL) {
+        return (-1);
+    }
+    s->s_cb = cb;
+    s->s_arg = arg;
+    s->s_result = NULL;
+    s->s_errno = DNSR_ERROR_NONE;
+    s->s_type = qtype;
+    memcpy(s->s_name, name, len + 1);
+
+    dnsr_service_push(svc, s);
+    if (__atomic_exchange_n(&svc->sv_wake, 1, __ATOMIC_ACQ_REL) == 0) {
+        dnsr_service_wake(svc);
+    }
+
+    return 0;
+}
+
+/*
+ * Takes as many as max finished lookups that had no callback off the
+ * completion queue, waiting upto timeout, or forever if timeout is NULL,
+ * for the first.  Any number of threads may wait at once.
+ *
+ * Return Values:
+ *      >0      number of lookups in completions
+ *      0       timed out
+ */
+
+int
+dnsr_service_completions(DNSR_SERVICE *svc,
+        struct dnsr_completion *completions, int max,
+        struct timeval *timeout) {
+    struct dnsr_submission *s;
+    struct timeval          cur, end;
+    struct timespec         ts;
+    int                     n = 0;
+
+    if (timeout != NULL) {
+        gettimeofday(&cur, NULL);
+        tv_add(&cur, timeout, &end);
+        ts.tv_sec = end.tv_sec;
+        ts.tv_nsec = end.tv_usec * 1000;
+    }
+
+    pthread_mutex_lock(&svc->sv_lock);
+    while (svc->sv_done == NULL) {
+        if (timeout == NULL) {
+            pthread_cond_wait(&svc->sv_cond, &svc->sv_lock);
+        } else if (pthread_cond_timedwait(&svc->sv_cond, &svc->sv_lock, &ts) ==
+                   ETIMEDOUT) {
+            break;
+        }
+    }
+    while ((n < max) && ((s = svc->sv_done) != NULL)) {
+        if ((svc->sv_done = s->s_next) == NULL) {
+            svc->sv_donetail = NULL;
+        }
+        completions[ n ].dc_arg = s->s_arg;
+        completions[ n ].dc_errno = s->s_errno;
+        completions[ n ].dc_result = s->s_result;
+        free(s);
+        n++;
+    }
+    pthread_mutex_unlock(&svc->sv_lock);
+
+    if (timeout != NULL) {
+        gettimeofday(&cur, NULL);
+        if (tv_sub(&end, &cur, timeout) != 0) {
+            timeout->tv_sec = 0;
+            timeout->tv_usec = 0;
+        }
+    }
+
+    return (n);
+}
+
+static void
+dnsr_service_push(DNSR_SERVICE *svc, struct dnsr_submission *s) {
+    struct dnsr_submission *prev;
+
+    __atomic_store_n(&s->s_next, NULL, __ATOMIC_RELAXED);
+    prev = __atomic_exchange_n(&svc->sv_head, s, __ATOMIC_ACQ_REL);
+    /* Until this store s can't be popped, see dnsr_service_pop( ) */
+    __atomic_store_n(&prev->s_next, s, __ATOMIC_RELEASE);
+}
+
+/*
+ * Pops the oldest submission, on the I/O thread only.  NULL means the queue
+ * is empty, or a push is half done; that producer then wakes the thread.
+ */
+
+static struct dnsr_submission *
+dnsr_service_pop(DNSR_SERVICE *svc) {
+    struct dnsr_submission *tail, *next;
+
+    tail = svc->sv_tail;
+    next = __atomic_load_n(&tail->s_next, __ATOMIC_ACQUIRE);
+    if (tail == &svc->sv_stub) {
+        if (next == NULL) {
+            return (NULL);
+        }
+        svc->sv_tail = tail = next;
+        next = __atomic_load_n(&tail->s_next, __ATOMIC_ACQUIRE);
+    }
+    if (next != NULL) {
+        svc->sv_tail = next;
+        return (tail);
+    }
+    if (tail != __atomic_load_n(&svc->sv_head, __ATOMIC_ACQUIRE)) {
+        return (NULL);
+    }
+    /* tail is the last one, put the stub behind it so it can be taken */
+    dnsr_service_push(svc, &svc->sv_stub);
+    if ((next = __atomic_load_n(&tail->s_next, __ATOMIC_ACQUIRE)) != NULL) {
+        svc->sv_tail = next;
+        return (tail);
+    }
+    return (NULL);
+}
+
+static void
+dnsr_service_wake(DNSR_SERVICE *svc) {
+    /* A full pipe is already enough to wake the thread */
+    while ((write(svc->sv_pipe[ 1 ], "", 1) < 0) && (errno == EINTR))
+        ;
+}
+
+/* The I/O thread */
+static void *
+dnsr_service_run(void *arg) {
+    DNSR_SERVICE           *svc = arg;
+    struct dnsr_submission *s;
+    struct pollfd           pfd[ 3 + DNSR_TCP_MAX ];
+    struct timeval          tv;
+    char                    buf[ 64 ];
+    int                     i, rc, nfds, ntcp, fds[ 2 ], ms;
+
+    for (;;) {
+        /* Clear the flag before popping, so a push after this wakes us */
+        while (read(svc->sv_pipe[ 0 ], buf, sizeof(buf)) > 0)
+            ;
+        __atomic_store_n(&svc->sv_wake, 0, __ATOMIC_SEQ_CST);
+        while ((s = dnsr_service_pop(svc)) != NULL) {
+            s->s_next = NULL;
+            if (svc->sv_backlog == NULL) {
+                svc->sv_backlog = s;
+            } else {
+                svc->sv_backlogtail->s_next = s;
+            }
+            svc->sv_backlogtail = s;
+        }
+
+        if (__atomic_load_n(&svc->sv_stop, __ATOMIC_SEQ_CST)) {
+            break;
+        }
+
+        dnsr_service_start(svc);
+        dnsr_service_collect(svc);
+
+        /* Wait for responses, TCP retries, the next retry, or a
+         * submission.  The TCP connections go last.
+         */
+        nfds = dnsr_fds(svc->sv_dnsr, fds, 2);
+        for (i = 0; i < nfds; i++) {
+            pfd[ i ].fd = fds[ i ];
+            pfd[ i ].events = POLLIN;
+        }
+        pfd[ nfds ].fd = svc->sv_pipe[ 0 ];
+        pfd[ nfds++ ].events = POLLIN;
+        ntcp = dnsr_tcp_fds(svc->sv_dnsr, &pfd[ nfds ], DNSR_TCP_MAX);
+
+        ms = -1;
+        if (dnsr_next_timeout(svc->sv_dnsr, &tv) == 1) {
+            ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        }
+        if ((rc = poll(pfd, nfds + ntcp, ms)) < 0) {
+            if (errno != EINTR) {
+                DEBUG(perror("dnsr_service_run: poll"));
+            }
+            continue;
+        }
+        for (i = nfds; (rc > 0) && (i < nfds + ntcp); i++) {
+            if (pfd[ i ].revents != 0) {
+                dnsr_tcp_process(svc->sv_dnsr, pfd[ i ].fd);
+            }
+        }
+    }
+
+    dnsr_service_cancel(svc);
+    return (NULL);
+}
+
+/* Starts lookups from the backlog while there are tags for them */
+static void
+dnsr_service_start(DNSR_SERVICE *svc) {
+    struct dnsr_submission *s;
+    int                     tag;
+
+    while ((svc->sv_nfree > 0) && ((s = svc->sv_backlog) != NULL)) {
+        svc->sv_backlog = s->s_next;
+        tag = svc->sv_free[ --svc->sv_nfree ];
+        if (dnsr_query_tagged(svc->sv_dnsr, s->s_type, DNSR_CLASS_IN,
+                    s->s_name, tag) != 0) {
+            svc->sv_free[ svc->sv_nfree++ ] = tag;
+            s->s_errno = dnsr_errno(svc->sv_dnsr);
+            dnsr_service_finish(svc, s);
+            continue;
+        }
+        svc->sv_slots[ tag ] = s;
+    }
+}
+
+/* Reads responses, runs retries, and finishes every lookup that is done */
+static void
+dnsr_service_collect(DNSR_SERVICE *svc) {
+    struct dnsr_batch_result results[ DNSR_SERVICE_BATCH ];
+    struct dnsr_submission  *s;
+    struct timeval           zero;
+    int                      i, n;
+
+    while (svc->sv_nfree < DNSR_SERVICE_INFLIGHT) {
+        zero.tv_sec = 0;
+        zero.tv_usec = 0;
+        if ((n = dnsr_result_batch(svc->sv_dnsr, &zero, results,
+                     DNSR_SERVICE_BATCH)) <= 0) {
+            return;
+        }
+        for (i = 0; i < n; i++) {
+            s = svc->sv_slots[ results[ i ].br_index ];
+            svc->sv_slots[ results[ i ].br_index ] = NULL;
+            svc->sv_free[ svc->sv_nfree++ ] = results[ i ].br_index;
+            s->s_result = results[ i ].br_result;
+            s->s_errno = results[ i ].br_errno;
+            dnsr_service_finish(svc, s);
+        }
+        /* Tags came free, use them before waiting */
+        dnsr_service_start(svc);
+    }
+}
+
+/* Finishes everything not yet done, for dnsr_service_free( ) */
+static void
+dnsr_service_cancel(DNSR_SERVICE *svc) {
+    struct dnsr_submission *s;
+    int                     i;
+
+    for (i = 0; i < DNSR_SERVICE_INFLIGHT; i++) {
+        if ((s = svc->sv_slots[ i ]) != NULL) {
+            svc->sv_slots[ i ] = NULL;
+            s->s_errno = DNSR_ERROR_TIMEOUT;
+            dnsr_service_finish(svc, s);
+        }
+    }
+    while ((s = svc->sv_backlog) != NULL) {
+        svc->sv_backlog = s->s_next;
+        s->s_errno = DNSR_ERROR_TIMEOUT;
+        dnsr_service_finish(svc, s);
+    }
+}
+
+static void
+dnsr_service_finish(DNSR_SERVICE *svc, struct dnsr_submission *s) {
+    if (s->s_cb != NULL) {
+        s->s_cb(s->s_arg, s->s_result, s->s_errno);
+        free(s);
+        return;
+    }
+
+    s->s_next = NULL;
+    pthread_mutex_lock(&svc->sv_lock);
+    if (svc->sv_done == NULL) {
+        svc->sv_done = s;
+    } else {
+        svc->sv_donetail->s_next = s;
+    }
+    svc->sv_donetail = s;
+    pthread_cond_signal(&svc->sv_cond);
+    pthread_mutex_unlock(&svc->sv_lock);
+}
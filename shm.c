@@ -0,0 +1,248 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/param.h>
+#include <sys/time.h>
+
+#include "denser.h"
+#include "internal.h"
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif /* MAP_ANONYMOUS */
+
+/*
+ * The backend of dnsr_cache_shm_new( ): a fixed table of slots in an
+ * anonymous shared mapping, which processes forked after it is made see
+ * as their own, so that pre-forked workers share one cache without a
+ * daemon in between.  Nothing in the mapping is a pointer.
+ *
+ * A slot holds one response of up to DNSR_SHM_MSG octets, and is found by
+ * linear probing from the hash of its question, at most DNSR_SHM_PROBE
+ * slots along.  Nothing is deleted: an insert takes the slot with the same
+ * question, or else an empty or expired one, or else the one that expires
+ * first.
+ *
+ * Each slot is a seqlock.  Its sequence is odd while it is written, and a
+ * writer makes it so with a compare and swap, or gives up if another got
+ * there first, as a cache may drop what it is given.  Readers take no lock:
+ * they copy the slot, and use the copy only if the sequence was even and
+ * unchanged around it.  A process that dies while writing leaves its slot
+ * odd, and unused, for the life of the mapping.
+ */
+
+#define DNSR_SHM_MSG 1024  /* Larger responses are not cached */
+#define DNSR_SHM_PROBE 8   /* Slots looked at for a question */
+#define DNSR_SHM_RETRY 4   /* Reads of a slot that is being written */
+
+struct dnsr_shm_slot {
+    uint32_t ss_seq;
+    uint32_t ss_hash;
+    time_t   ss_stored; /* TTLs in ss_msg count from here */
+    time_t   ss_expires;
+    uint16_t ss_questionlen;
+    uint16_t ss_msglen; /* 0 if empty */
+    char     ss_msg[ DNSR_SHM_MSG ];
+};
+
+struct dnsr_shm {
+    struct dnsr_shm_slot *sh_slots;
+    unsigned int          sh_mask; /* slots - 1 */
+    size_t                sh_size; /* of the mapping */
+};
+
+static int dnsr_shm_read(struct dnsr_shm_slot *, struct dnsr_shm_slot *, int);
+
+/*
+ * Maps a table of at least size slots.
+ *
+ * Return Values:
+ *      struct dnsr_shm *       success
+ *      NULL                    error - check errno
+ */
+
+struct dnsr_shm *
+dnsr_shm_new(int size) {
+    struct dnsr_shm *sh;
+    unsigned int     slots;
+
+    if ((sh = malloc(sizeof(struct dnsr_shm))) == NULL) {
+        return (NULL);
+    }
+
+    for (slots = DNSR_SHM_PROBE; slots < size; slots <<= 1)
+        ;
+    sh->sh_mask = slots - 1;
+    sh->sh_size = slots * sizeof(struct dnsr_shm_slot);
+
+    /* Zero filled, every slot is empty */
+    if ((sh->sh_slots = mmap(NULL, sh->sh_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        DEBUG(perror("mmap"));
+        free(sh);
+        return (NULL);
+    }
+
+    return (sh);
+}
+
+/* Unmaps sh from this process only */
+void
+dnsr_shm_free(struct dnsr_shm *sh) {
+    munmap(sh->sh_slots, sh->sh_size);
+    free(sh);
+}
+
+/*
+ * Copies the response for the question key into msg, which has room for
+ * DNSR_SHM_MSG octets, if there is one that has not expired by now.
+ *
+ * Return Values:
+ *      >0      length of msg, *stored is when it was stored
+ *      0       not cached
+ */
+
+unsigned int
+dnsr_shm_get(struct dnsr_shm *sh, uint32_t hash, const char *key,
+        unsigned int keylen, time_t now, char *msg, time_t *stored) {
+    struct dnsr_shm_slot *ss, copy;
+    unsigned int          i;
+
+    for (i = 0; i < DNSR_SHM_PROBE; i++) {
+        ss = &sh->sh_slots[ (hash + i) & sh->sh_mask ];
+        /* Only slots that look right are copied */
+        if ((__atomic_load_n(&ss->ss_hash, __ATOMIC_RELAXED) != hash) ||
+                (dnsr_shm_read(ss, &copy, 0) != 0)) {
+            continue;
+        }
+        if ((copy.ss_hash != hash) || (copy.ss_msglen == 0) ||
+                (copy.ss_questionlen - sizeof(struct dnsr_header) != keylen) ||
+                !dnsr_cache_samekey(
+                        copy.ss_msg + sizeof(struct dnsr_header), key, keylen)) {
+            continue;
+        }
+        if (now >= copy.ss_expires) {
+            return 0;
+        }
+        memcpy(msg, copy.ss_msg, copy.ss_msglen);
+        *stored = copy.ss_stored;
+        return (copy.ss_msglen);
+    }
+
+    return 0;
+}
+
+/*
+ * Stores msg, the response to a question of questionlen octets with hash,
+ * until expires, unless it is too big or its slot is being written.
+ */
+
+void
+dnsr_shm_put(struct dnsr_shm *sh, uint32_t hash, const char *msg,
+        unsigned int msglen, unsigned int questionlen, time_t stored,
+        time_t expires) {
+    struct dnsr_shm_slot *ss, *victim = NULL, copy;
+    unsigned int          i;
+    uint32_t              seq;
+    time_t                first = 0;
+
+    if (msglen > DNSR_SHM_MSG) {
+        return;
+    }
+
+    for (i = 0; i < DNSR_SHM_PROBE; i++) {
+        ss = &sh->sh_slots[ (hash + i) & sh->sh_mask ];
+        if (dnsr_shm_read(ss, &copy, 1) != 0) {
+            continue;
+        }
+        if ((copy.ss_msglen == 0) || (copy.ss_expires <= stored)) {
+            /* Better than any live slot, first is 0 once one is found */
+            if ((victim == NULL) || (first != 0)) {
+                victim = ss;
+                first = 0;
+            }
+            continue;
+        }
+        if ((copy.ss_hash == hash) && (copy.ss_questionlen == questionlen) &&
+                dnsr_cache_samekey(copy.ss_msg + sizeof(struct dnsr_header),
+                        msg + sizeof(struct dnsr_header),
+                        questionlen - sizeof(struct dnsr_header))) {
+            victim = ss;
+            break;
+        }
+        if ((victim == NULL) ||
+                ((first != 0) && (copy.ss_expires < first))) {
+            victim = ss;
+            first = copy.ss_expires;
+        }
+    }
+    if (victim == NULL) {
+        return;
+    }
+
+    seq = __atomic_load_n(&victim->ss_seq, __ATOMIC_RELAXED);
+    if ((seq & 1) || !__atomic_compare_exchange_n(&victim->ss_seq, &seq,
+                             seq + 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        DEBUG(fprintf(stderr, "shm_put: slot busy\n"));
+        return;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+
+    victim->ss_hash = hash;
+    victim->ss_stored = stored;
+    victim->ss_expires = expires;
+    victim->ss_questionlen = questionlen;
+    victim->ss_msglen = msglen;
+    memcpy(victim->ss_msg, msg, msglen);
+
+    __atomic_store_n(&victim->ss_seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+/*
+ * Copies ss into copy, only as far as its question if head is set, retrying
+ * while it is being written.
+ *
+ * Return Values:
+ *      0       copy is consistent
+ *      -1      ss kept changing
+ */
+
+static int
+dnsr_shm_read(struct dnsr_shm_slot *ss, struct dnsr_shm_slot *copy, int head) {
+    uint32_t seq;
+    size_t   len;
+    int      i;
+
+    for (i = 0; i < DNSR_SHM_RETRY; i++) {
+        seq = __atomic_load_n(&ss->ss_seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;
+        }
+        len = offsetof(struct dnsr_shm_slot, ss_msg);
+        if (!head) {
+            /* The length is only trusted once the copy is */
+            len += MIN(ss->ss_msglen, DNSR_SHM_MSG);
+        } else {
+            /* Enough of the message for its question */
+            len += MIN(ss->ss_questionlen, DNSR_SHM_MSG);
+        }
+        memcpy(copy, ss, len);
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&ss->ss_seq, __ATOMIC_RELAXED) == seq) {
+            copy->ss_questionlen = MIN(copy->ss_questionlen, DNSR_SHM_MSG);
+            copy->ss_msglen = MIN(copy->ss_msglen, DNSR_SHM_MSG);
+            return 0;
+        }
+    }
+    return (-1);
+}
@@ -0,0 +1,320 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#include "bprint.h"
+#include "denser.h"
+#include "internal.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif /* MSG_NOSIGNAL */
+
+/*
+ * A truncated response is asked again over TCP.  dnsr_send_query_tcp( )
+ * does that in place, and blocks until the answer is read.  A handle with
+ * DNSR_OPT_TCPASYNC, which is what a DNSR_SERVICE owns, opens a
+ * non-blocking connection here instead, and whoever runs its event loop
+ * watches the connections from dnsr_tcp_fds( ) and moves them along with
+ * dnsr_tcp_process( ).
+ *
+ * The query stays in flight while its connection is open, and its retry
+ * timers keep running.  It is finished by the first usable response over
+ * either transport, or by its timers, and the connection is then closed.
+ * A query has one connection at a time, and a handle at most DNSR_TCP_MAX:
+ * a truncated response past that is dropped, and the query is asked again
+ * over UDP when its timers say.
+ */
+
+struct dnsr_tcp {
+    struct dnsr_tcp     *t_next; /* handle's connections */
+    struct dnsr_tcp     *t_prev;
+    struct dnsr_pending *t_pending;
+    int                  t_fd;
+    int                  t_ns;
+    int                  t_reading; /* the query is written */
+    size_t               t_off;     /* into t_out, or into what is read */
+    size_t               t_outlen;
+    uint16_t             t_resplen;
+    char                 t_lenbuf[ sizeof(uint16_t) ];
+    char                *t_resp;
+    char                 t_out[ sizeof(uint16_t) + DNSR_MAX_UDP_BASIC ];
+};
+
+static int  dnsr_tcp_io(DNSR *, struct dnsr_tcp *);
+static void dnsr_tcp_unlink(DNSR *, struct dnsr_tcp *);
+static void dnsr_tcp_free(DNSR *, struct dnsr_tcp *);
+
+/*
+ * Opens a connection to name server ns to ask the question of p, unless p
+ * has one already or the handle has too many.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_tcp_start(DNSR *dnsr, struct dnsr_pending *p, int ns) {
+    struct dnsr_tcp    *t;
+    struct dnsr_header *h;
+    uint16_t            len;
+    size_t              querylen;
+
+    if (p->p_tcp != NULL) {
+        return 0;
+    }
+    if (dnsr->d_ntcp >= DNSR_TCP_MAX) {
+        DEBUG(fprintf(stderr, "dnsr_tcp_start: too many connections\n"));
+        return 0;
+    }
+
+    if ((t = malloc(sizeof(struct dnsr_tcp))) == NULL) {
+        DEBUG(perror("malloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+    memset(t, 0, offsetof(struct dnsr_tcp, t_out));
+    t->t_pending = p;
+    t->t_ns = ns;
+
+    if ((t->t_fd = socket(dnsr->d_nsinfo[ ns ].ns_sa.ss_family, SOCK_STREAM,
+                 0)) < 0) {
+        DEBUG(perror("dnsr_tcp_start: socket"));
+        free(t);
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+    fcntl(t->t_fd, F_SETFD, FD_CLOEXEC);
+    if ((fcntl(t->t_fd, F_SETFL, fcntl(t->t_fd, F_GETFL) | O_NONBLOCK) < 0) ||
+            ((connect(t->t_fd, (struct sockaddr *)&dnsr->d_nsinfo[ ns ].ns_sa,
+                      sizeof(struct sockaddr_storage)) != 0) &&
+                    (errno != EINPROGRESS))) {
+        DEBUG(perror("dnsr_tcp_start: connect"));
+        close(t->t_fd);
+        free(t);
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+
+    /* Length first, rfc 1035 4.2.2, and the same ID as over UDP */
+    if (dnsr->d_nsinfo[ ns ].ns_edns == DNSR_EDNS_BAD) {
+        querylen = p->p_questionlen;
+    } else {
+        querylen = p->p_querylen;
+    }
+    len = htons(querylen);
+    memcpy(t->t_out, &len, sizeof(uint16_t));
+    memcpy(t->t_out + sizeof(uint16_t), p->p_query, querylen);
+    t->t_outlen = sizeof(uint16_t) + querylen;
+    h = (struct dnsr_header *)(t->t_out + sizeof(uint16_t));
+    h->h_id = htons(p->p_id ^ dnsr->d_nsinfo[ ns ].ns_id);
+    if (dnsr->d_nsinfo[ ns ].ns_edns == DNSR_EDNS_BAD) {
+        DEBUG(fprintf(stderr, "stripping EDNS\n"));
+        h->h_arcount = htons(ntohs(h->h_arcount) - 1);
+    }
+
+    if ((t->t_next = dnsr->d_tcp) != NULL) {
+        t->t_next->t_prev = t;
+    }
+    dnsr->d_tcp = t;
+    dnsr->d_ntcp++;
+    p->p_tcp = t;
+
+    return 0;
+}
+
+/* Closes the connection of p, if it has one */
+void
+dnsr_tcp_close(DNSR *dnsr, struct dnsr_pending *p) {
+    if (p->p_tcp != NULL) {
+        dnsr_tcp_free(dnsr, p->p_tcp);
+    }
+}
+
+/*
+ * Fills pfd with as many as max of the handle's connections, each waiting
+ * to be written to or read from.
+ *
+ * Return Values:
+ *      number of descriptors in pfd
+ */
+
+int
+dnsr_tcp_fds(DNSR *dnsr, struct pollfd *pfd, int max) {
+    struct dnsr_tcp *t;
+    int              n = 0;
+
+    for (t = dnsr->d_tcp; (t != NULL) && (n < max); t = t->t_next) {
+        pfd[ n ].fd = t->t_fd;
+        pfd[ n ].events = t->t_reading ? POLLIN : POLLOUT;
+        pfd[ n++ ].revents = 0;
+    }
+    return (n);
+}
+
+/*
+ * Moves the connection on fd along, and hands its response, once it is all
+ * read, to the query it answers.  A connection that fails finishes its
+ * query, as dnsr_send_query_tcp( ) failing does.
+ */
+
+void
+dnsr_tcp_process(DNSR *dnsr, int fd) {
+    struct dnsr_tcp     *t;
+    struct dnsr_pending *p, *q = NULL;
+    int                  rc;
+
+    for (t = dnsr->d_tcp; t != NULL; t = t->t_next) {
+        if (t->t_fd == fd) {
+            break;
+        }
+    }
+    if (t == NULL) {
+        return;
+    }
+    p = t->t_pending;
+
+    if ((rc = dnsr_tcp_io(dnsr, t)) == 0) {
+        return;
+    }
+    if (rc < 0) {
+        dnsr_pending_done(dnsr, p, NULL, dnsr->d_errno);
+        return;
+    }
+
+    /* Off the handle, so that finishing p doesn't free what is parsed */
+    dnsr_tcp_unlink(dnsr, t);
+
+    DEBUG(fprintf(stderr, "tcp response\n"));
+    DEBUG(bprint(t->t_resp, t->t_resplen));
+
+    /* A response that is truncated even so is not used */
+    rc = dnsr_validate_resp(dnsr, t->t_resp, t->t_resplen,
+            (struct sockaddr *)&dnsr->d_nsinfo[ t->t_ns ].ns_sa, &q);
+    if ((rc != DNSR_ERROR_NS_INVALID) && (q == p)) {
+        dnsr_response_use(dnsr, p, t->t_resp, t->t_resplen, (rc != 0));
+    }
+
+    dnsr_tcp_free(dnsr, t);
+}
+
+/*
+ * Writes the query and reads the response, as far as the connection
+ * allows without waiting.
+ *
+ * Return Values:
+ *      1       the response is read
+ *      0       not yet
+ *      -1      error - check dnsr_errno
+ */
+
+static int
+dnsr_tcp_io(DNSR *dnsr, struct dnsr_tcp *t) {
+    ssize_t  rc;
+    uint16_t len;
+
+    /* A connect( ) that failed fails this */
+    while (!t->t_reading) {
+        if ((rc = send(t->t_fd, t->t_out + t->t_off, t->t_outlen - t->t_off,
+                     MSG_NOSIGNAL)) < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                    (errno == EINTR)) {
+                return 0;
+            }
+            DEBUG(perror("dnsr_tcp_io: send"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
+        if ((t->t_off += rc) == t->t_outlen) {
+            t->t_reading = 1;
+            t->t_off = 0;
+        }
+    }
+
+    /* t_off counts the length too */
+    for (;;) {
+        if (t->t_off < sizeof(uint16_t)) {
+            rc = read(t->t_fd, t->t_lenbuf + t->t_off,
+                    sizeof(uint16_t) - t->t_off);
+        } else {
+            rc = read(t->t_fd, t->t_resp + t->t_off - sizeof(uint16_t),
+                    t->t_resplen - (t->t_off - sizeof(uint16_t)));
+        }
+        if (rc < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+                    (errno == EINTR)) {
+                return 0;
+            }
+            DEBUG(perror("dnsr_tcp_io: read"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
+        if (rc == 0) {
+            DEBUG(fprintf(stderr, "dnsr_tcp_io: read: closed\n"));
+            dnsr->d_errno = DNSR_ERROR_CONNECTION_CLOSED;
+            return (-1);
+        }
+
+        t->t_off += rc;
+        if (t->t_off == sizeof(uint16_t)) {
+            memcpy(&len, t->t_lenbuf, sizeof(uint16_t));
+            t->t_resplen = ntohs(len);
+            DEBUG(fprintf(stderr, "response len: %d\n", t->t_resplen));
+            if ((t->t_resp = malloc(t->t_resplen + 1)) == NULL) {
+                DEBUG(perror("malloc"));
+                dnsr->d_errno = DNSR_ERROR_SYSTEM;
+                return (-1);
+            }
+        }
+        if ((t->t_off >= sizeof(uint16_t)) &&
+                (t->t_off - sizeof(uint16_t) == t->t_resplen)) {
+            return 1;
+        }
+    }
+}
+
+/* Takes t off the handle and its query */
+static void
+dnsr_tcp_unlink(DNSR *dnsr, struct dnsr_tcp *t) {
+    if (t->t_pending == NULL) {
+        return;
+    }
+
+    if (t->t_prev != NULL) {
+        t->t_prev->t_next = t->t_next;
+    } else {
+        dnsr->d_tcp = t->t_next;
+    }
+    if (t->t_next != NULL) {
+        t->t_next->t_prev = t->t_prev;
+    }
+    t->t_next = t->t_prev = NULL;
+    dnsr->d_ntcp--;
+    t->t_pending->p_tcp = NULL;
+    t->t_pending = NULL;
+}
+
+/* Closes t, taking it off the handle first if it is still on it */
+static void
+dnsr_tcp_free(DNSR *dnsr, struct dnsr_tcp *t) {
+    dnsr_tcp_unlink(dnsr, t);
+    close(t->t_fd);
+    free(t->t_resp);
+    free(t);
+}
@@ -0,0 +1,311 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+
+#include "denser.h"
+#include "event.h"
+#include "internal.h"
+
+/*
+ * UDP queries are not sent one at a time.  dnsr_udp_queue( ) puts them on
+ * the send queue of their socket, and dnsr_udp_flush( ) hands each queue to
+ * the kernel with as few sendmmsg( ) calls as it can.  Responses are read
+ * the same way, as many as are waiting with each recvmmsg( ), into a ring
+ * of buffers kept by the handle.  Where sendmmsg( ) and recvmmsg( ) are
+ * missing, sendto( ) and recvfrom( ) are called in a loop instead.
+ *
+ * With DNSR_FLAG_URING the queues are handed to the io_uring transport in
+ * uring.c instead, and dnsr_udp_recv( ) is not used.
+ */
+
+static int  dnsr_udp_send(DNSR *, int, struct dnsr_udpsend *, int);
+
+/*
+ * Queues query p for name server ns.  The query itself is not copied, only
+ * its header, which differs between name servers.
+ */
+
+void
+dnsr_udp_queue(DNSR *dnsr, struct dnsr_pending *p, int ns, int noedns) {
+    int                  q;
+    struct dnsr_udpsend *s;
+
+    q = (dnsr->d_nsinfo[ ns ].ns_sa.ss_family == AF_INET) ? 0 : 1;
+    /* Queries that fail to go out here are finished by the flush */
+    if (dnsr->d_sendcount[ q ] >= DNSR_SEND_BATCH) {
+        dnsr_udp_flush(dnsr);
+    }
+
+    s = &dnsr->d_sendq[ q ][ dnsr->d_sendcount[ q ]++ ];
+    s->s_pending = p;
+    s->s_ns = ns;
+    memcpy(&s->s_header, p->p_query, sizeof(struct dnsr_header));
+    s->s_header.h_id = htons(p->p_id ^ dnsr->d_nsinfo[ ns ].ns_id);
+    if (noedns) {
+        s->s_header.h_arcount = htons(ntohs(s->s_header.h_arcount) - 1);
+        s->s_len = p->p_questionlen;
+    } else {
+        s->s_len = p->p_querylen;
+    }
+}
+
+/*
+ * Sends everything on the send queues.  A query that could not be sent is
+ * finished with DNSR_ERROR_SYSTEM.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      a query could not be sent
+ */
+
+int
+dnsr_udp_flush(DNSR *dnsr) {
+    int rc = 0;
+
+    if (dnsr->d_sendcount[ 0 ] > 0) {
+        if (dnsr_udp_send(dnsr, dnsr->d_fd, dnsr->d_sendq[ 0 ],
+                    dnsr->d_sendcount[ 0 ]) != 0) {
+            rc = -1;
+        }
+        dnsr->d_sendcount[ 0 ] = 0;
+    }
+    if (dnsr->d_sendcount[ 1 ] > 0) {
+        if (dnsr_udp_send(dnsr, dnsr->d_fd6, dnsr->d_sendq[ 1 ],
+                    dnsr->d_sendcount[ 1 ]) != 0) {
+            rc = -1;
+        }
+        dnsr->d_sendcount[ 1 ] = 0;
+    }
+
+    if (rc != 0) {
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+    }
+    return (rc);
+}
+
+static int
+dnsr_udp_send(DNSR *dnsr, int fd, struct dnsr_udpsend *sq, int count) {
+    int                  i, rc = 0;
+    struct dnsr_udpsend *s;
+    struct iovec         iov[ DNSR_SEND_BATCH ][ 2 ];
+#ifdef HAVE_SENDMMSG
+    struct mmsghdr       msg[ DNSR_SEND_BATCH ];
+    int                  j, done;
+#else  /* HAVE_SENDMMSG */
+    struct msghdr        mh;
+    ssize_t              sent;
+#endif /* HAVE_SENDMMSG */
+
+    for (i = 0; i < count; i++) {
+        s = &sq[ i ];
+        iov[ i ][ 0 ].iov_base = &s->s_header;
+        iov[ i ][ 0 ].iov_len = sizeof(struct dnsr_header);
+        iov[ i ][ 1 ].iov_base =
+                s->s_pending->p_query + sizeof(struct dnsr_header);
+        iov[ i ][ 1 ].iov_len = s->s_len - sizeof(struct dnsr_header);
+    }
+
+    if (fd < 0) {
+        DEBUG(fprintf(stderr, "dnsr_udp_send: no socket\n"));
+        for (i = 0; i < count; i++) {
+            dnsr_udp_failed(dnsr, sq[ i ].s_pending, sq[ i ].s_ns);
+        }
+        return (-1);
+    }
+
+    if (dnsr->d_uring != NULL) {
+        return (dnsr_uring_send(dnsr, sq, count));
+    }
+
+#ifdef HAVE_SENDMMSG
+    memset(msg, 0, count * sizeof(struct mmsghdr));
+    for (i = 0; i < count; i++) {
+        msg[ i ].msg_hdr.msg_name = &dnsr->d_nsinfo[ sq[ i ].s_ns ].ns_sa;
+        msg[ i ].msg_hdr.msg_namelen =
+                (dnsr->d_nsinfo[ sq[ i ].s_ns ].ns_sa.ss_family == AF_INET)
+                        ? sizeof(struct sockaddr_in)
+                        : sizeof(struct sockaddr_in6);
+        msg[ i ].msg_hdr.msg_iov = iov[ i ];
+        msg[ i ].msg_hdr.msg_iovlen = 2;
+    }
+
+    for (i = 0; i < count; i += done) {
+        if ((done = sendmmsg(fd, &msg[ i ], count - i, 0)) < 0) {
+            if (errno == EINTR) {
+                done = 0;
+                continue;
+            }
+            /* The first unsent message is the one that failed */
+            DEBUG(perror("sendmmsg"));
+            dnsr_udp_failed(dnsr, sq[ i ].s_pending, sq[ i ].s_ns);
+            rc = -1;
+            done = 1;
+            continue;
+        }
+        DEBUG(fprintf(stderr, "sendmmsg: %d of %d\n", done, count - i));
+        for (j = i; j < i + done; j++) {
+            if (msg[ j ].msg_len != sq[ j ].s_len) {
+                dnsr_udp_failed(dnsr, sq[ j ].s_pending, sq[ j ].s_ns);
+                rc = -1;
+            }
+        }
+    }
+#else  /* HAVE_SENDMMSG */
+    for (i = 0; i < count; i++) {
+        memset(&mh, 0, sizeof(struct msghdr));
+        mh.msg_name = &dnsr->d_nsinfo[ sq[ i ].s_ns ].ns_sa;
+        mh.msg_namelen =
+                (dnsr->d_nsinfo[ sq[ i ].s_ns ].ns_sa.ss_family == AF_INET)
+                        ? sizeof(struct sockaddr_in)
+                        : sizeof(struct sockaddr_in6);
+        mh.msg_iov = iov[ i ];
+        mh.msg_iovlen = 2;
+        while ((sent = sendmsg(fd, &mh, 0)) < 0) {
+            if (errno != EINTR) {
+                break;
+            }
+        }
+        if (sent != sq[ i ].s_len) {
+            DEBUG(perror("sendmsg"));
+            dnsr_udp_failed(dnsr, sq[ i ].s_pending, sq[ i ].s_ns);
+            rc = -1;
+        }
+    }
+#endif /* HAVE_SENDMMSG */
+
+    return (rc);
+}
+
+/*
+ * A send of p to name server ns failed.  p is finished with
+ * DNSR_ERROR_SYSTEM, unless it is racing and another server has it.  Also
+ * called by uring.c.
+ */
+
+void
+dnsr_udp_failed(DNSR *dnsr, struct dnsr_pending *p, int ns) {
+    if (p == NULL) {
+        return;
+    }
+    if (p->p_events == eventlist_race) {
+        p->p_asked &= ~(1 << ns);
+        if (p->p_asked != 0) {
+            return;
+        }
+    }
+    dnsr_pending_done(dnsr, p, NULL, DNSR_ERROR_SYSTEM);
+}
+
+/*
+ * Drops p from the send queues, for when it is freed before they are
+ * flushed.
+ */
+
+void
+dnsr_udp_forget(DNSR *dnsr, struct dnsr_pending *p) {
+    int q, i;
+
+    for (q = 0; q < 2; q++) {
+        for (i = 0; i < dnsr->d_sendcount[ q ]; i++) {
+            if (dnsr->d_sendq[ q ][ i ].s_pending == p) {
+                dnsr->d_sendq[ q ][ i ] =
+                        dnsr->d_sendq[ q ][ --dnsr->d_sendcount[ q ] ];
+                i--;
+            }
+        }
+    }
+
+    if (dnsr->d_uring != NULL) {
+        dnsr_uring_forget(dnsr, p);
+    }
+}
+
+/*
+ * Reads as many responses as are waiting on fd, up to DNSR_RECV_BATCH, into
+ * the handle's receive ring.
+ *
+ * Return Values:
+ *      >=0     number of responses in d_recvq
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_udp_recv(DNSR *dnsr, int fd) {
+    int                  n;
+    struct dnsr_udprecv *r;
+#ifdef HAVE_RECVMMSG
+    int                  i;
+    struct iovec         iov[ DNSR_RECV_BATCH ];
+    struct mmsghdr       msg[ DNSR_RECV_BATCH ];
+#else  /* HAVE_RECVMMSG */
+    socklen_t            socklen;
+#endif /* HAVE_RECVMMSG */
+
+    if ((dnsr->d_recvq == NULL) &&
+            ((dnsr->d_recvq = malloc(DNSR_RECV_BATCH *
+                                     sizeof(struct dnsr_udprecv))) == NULL)) {
+        DEBUG(perror("malloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+
+#ifdef HAVE_RECVMMSG
+    memset(msg, 0, sizeof(msg));
+    for (i = 0; i < DNSR_RECV_BATCH; i++) {
+        r = &dnsr->d_recvq[ i ];
+        iov[ i ].iov_base = r->r_buf;
+        iov[ i ].iov_len = DNSR_MAX_UDP;
+        msg[ i ].msg_hdr.msg_name = &r->r_from;
+        msg[ i ].msg_hdr.msg_namelen = sizeof(struct sockaddr_storage);
+        msg[ i ].msg_hdr.msg_iov = &iov[ i ];
+        msg[ i ].msg_hdr.msg_iovlen = 1;
+    }
+
+    while ((n = recvmmsg(fd, msg, DNSR_RECV_BATCH, MSG_DONTWAIT, NULL)) < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK) {
+            return 0;
+        }
+        if (errno != EINTR) {
+            DEBUG(perror("recvmmsg"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
+    }
+    for (i = 0; i < n; i++) {
+        dnsr->d_recvq[ i ].r_len = msg[ i ].msg_len;
+    }
+#else  /* HAVE_RECVMMSG */
+    for (n = 0; n < DNSR_RECV_BATCH; n++) {
+        r = &dnsr->d_recvq[ n ];
+        socklen = sizeof(struct sockaddr_storage);
+        if ((r->r_len = recvfrom(fd, r->r_buf, DNSR_MAX_UDP, MSG_DONTWAIT,
+                     (struct sockaddr *)&r->r_from, &socklen)) < 0) {
+            if (errno == EINTR) {
+                n--;
+                continue;
+            }
+            if (errno == EAGAIN || errno == EWOULDBLOCK) {
+                break;
+            }
+            DEBUG(perror("recvfrom"));
+            dnsr->d_errno = DNSR_ERROR_SYSTEM;
+            return (-1);
+        }
+    }
+#endif /* HAVE_RECVMMSG */
+
+    DEBUG(fprintf(stderr, "dnsr_udp_recv: %d responses\n", n));
+    return (n);
+}
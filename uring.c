@@ -0,0 +1,612 @@
+/*
+ * Copyright (c) Regents of The University of Michigan
+ * See COPYING.
+ */
+
+#include <errno.h>
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif /* HAVE_LINUX_IO_URING_H */
+
+#include "denser.h"
+#include "internal.h"
+
+/*
+ * An optional io_uring transport, turned on with DNSR_FLAG_URING.  A
+ * multishot receive stays posted on each UDP socket and fills buffers from
+ * a ring the kernel picks from, so reading responses takes no system calls
+ * of its own.  Queued queries go out as one batch of sends per flush, and
+ * the wait for responses or the next retry timer is a single
+ * io_uring_enter( ) with a timeout.
+ *
+ * Completions are only reaped into the ring's ready list as they are
+ * found; responses are handed to dnsr_response( ) by dnsr_uring_wait( )
+ * alone, so that flushing the send queue never finishes a query as a side
+ * effect.
+ *
+ * Where the kernel or the headers lack what this needs, turning it on
+ * fails with DNSR_ERROR_NOT_IMPLEMENTED and the handle keeps using the
+ * sendmmsg( ) transport in udp.c.
+ */
+
+/* Multishot receive came last, in 6.0 */
+#if defined(HAVE_LINUX_IO_URING_H) && defined(IORING_RECV_MULTISHOT)
+
+#define DNSR_URING_ENTRIES 256 /* Submission queue size */
+#define DNSR_URING_BUFS 64     /* Receive buffers, a power of two */
+#define DNSR_URING_SENDS 128   /* Sends in flight */
+
+#define DNSR_URING_RECV 1ULL
+#define DNSR_URING_SEND 2ULL
+
+/* A receive buffer: the kernel's header, the peer's address, the payload */
+#define DNSR_URING_BUFSIZE                                                     \
+    (sizeof(struct io_uring_recvmsg_out) + sizeof(struct sockaddr_storage) +  \
+            DNSR_MAX_UDP)
+
+struct dnsr_uring_send {
+    struct dnsr_pending *us_pending;
+    int                  us_ns;
+    struct msghdr        us_msg;
+    struct iovec         us_iov;
+    char                 us_buf[ DNSR_MAX_UDP_BASIC ];
+};
+
+struct dnsr_uring {
+    int                     ur_fd;
+    unsigned int            ur_tosubmit;
+    void                   *ur_sqmap;
+    size_t                  ur_sqmaplen;
+    void                   *ur_cqmap;
+    size_t                  ur_cqmaplen;
+    struct io_uring_sqe    *ur_sqes;
+    size_t                  ur_sqeslen;
+    unsigned int           *ur_sqhead;
+    unsigned int           *ur_sqtail;
+    unsigned int           *ur_sqarray;
+    unsigned int            ur_sqmask;
+    unsigned int            ur_sqentries;
+    unsigned int           *ur_cqhead;
+    unsigned int           *ur_cqtail;
+    unsigned int            ur_cqmask;
+    struct io_uring_cqe    *ur_cqes;
+
+    /* Receiving */
+    struct io_uring_buf_ring *ur_bufring;
+    size_t                    ur_bufringlen;
+    char                     *ur_bufs;
+    uint16_t                  ur_buftail;
+    struct msghdr             ur_recvmsg[ 2 ];
+    int                       ur_sock[ 2 ];
+    int                       ur_armed[ 2 ];
+    uint16_t                  ur_ready[ DNSR_URING_BUFS ]; /* buffer IDs */
+    int                       ur_readylen[ DNSR_URING_BUFS ];
+    int                       ur_nready;
+
+    /* Sending */
+    struct dnsr_uring_send ur_sends[ DNSR_URING_SENDS ];
+    int                    ur_sendfree[ DNSR_URING_SENDS ];
+    int                    ur_nsendfree;
+};
+
+static struct io_uring_sqe *dnsr_uring_sqe(DNSR *);
+static int                  dnsr_uring_enter(DNSR *, int, int);
+static void                 dnsr_uring_arm(DNSR *, int);
+static void                 dnsr_uring_reap(DNSR *);
+static void                 dnsr_uring_putbuf(struct dnsr_uring *, uint16_t);
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params *p) {
+    return (syscall(__NR_io_uring_setup, entries, p));
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete,
+        unsigned int flags, void *arg, size_t argsz) {
+    return (syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+            arg, argsz));
+}
+
+static int
+sys_io_uring_register(
+        int fd, unsigned int opcode, void *arg, unsigned int nr_args) {
+    return (syscall(__NR_io_uring_register, fd, opcode, arg, nr_args));
+}
+
+/*
+ * Sets up the ring, the receive buffers, and posts the receives.
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_uring_init(DNSR *dnsr) {
+    struct dnsr_uring      *ur;
+    struct io_uring_params  p;
+    struct io_uring_buf_reg reg;
+    int                     i;
+
+    if (dnsr->d_uring != NULL) {
+        return 0;
+    }
+
+    if ((ur = calloc(1, sizeof(struct dnsr_uring))) == NULL) {
+        DEBUG(perror("calloc"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+    ur->ur_fd = -1;
+    dnsr->d_uring = ur;
+
+    memset(&p, 0, sizeof(struct io_uring_params));
+    if ((ur->ur_fd = sys_io_uring_setup(DNSR_URING_ENTRIES, &p)) < 0) {
+        DEBUG(perror("io_uring_setup"));
+        goto unsupported;
+    }
+    /* Waiting with a timeout needs EXT_ARG, 5.11 */
+    if (!(p.features & IORING_FEAT_EXT_ARG)) {
+        DEBUG(fprintf(stderr, "dnsr_uring_init: no EXT_ARG\n"));
+        goto unsupported;
+    }
+
+    ur->ur_sqmaplen = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ur->ur_cqmaplen =
+            p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ur->ur_cqmaplen > ur->ur_sqmaplen) {
+            ur->ur_sqmaplen = ur->ur_cqmaplen;
+        }
+    }
+    if ((ur->ur_sqmap = mmap(NULL, ur->ur_sqmaplen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQ_RING)) ==
+            MAP_FAILED) {
+        ur->ur_sqmap = NULL;
+        goto error;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ur->ur_cqmap = ur->ur_sqmap;
+    } else if ((ur->ur_cqmap = mmap(NULL, ur->ur_cqmaplen,
+                        PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ur->ur_fd, IORING_OFF_CQ_RING)) == MAP_FAILED) {
+        ur->ur_cqmap = NULL;
+        goto error;
+    }
+    ur->ur_sqeslen = p.sq_entries * sizeof(struct io_uring_sqe);
+    if ((ur->ur_sqes = mmap(NULL, ur->ur_sqeslen, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, ur->ur_fd, IORING_OFF_SQES)) ==
+            MAP_FAILED) {
+        ur->ur_sqes = NULL;
+        goto error;
+    }
+
+    ur->ur_sqhead = (unsigned int *)((char *)ur->ur_sqmap + p.sq_off.head);
+    ur->ur_sqtail = (unsigned int *)((char *)ur->ur_sqmap + p.sq_off.tail);
+    ur->ur_sqarray = (unsigned int *)((char *)ur->ur_sqmap + p.sq_off.array);
+    ur->ur_sqmask =
+            *(unsigned int *)((char *)ur->ur_sqmap + p.sq_off.ring_mask);
+    ur->ur_sqentries = p.sq_entries;
+    ur->ur_cqhead = (unsigned int *)((char *)ur->ur_cqmap + p.cq_off.head);
+    ur->ur_cqtail = (unsigned int *)((char *)ur->ur_cqmap + p.cq_off.tail);
+    ur->ur_cqmask =
+            *(unsigned int *)((char *)ur->ur_cqmap + p.cq_off.ring_mask);
+    ur->ur_cqes =
+            (struct io_uring_cqe *)((char *)ur->ur_cqmap + p.cq_off.cqes);
+
+    /* Receive buffers, handed to the kernel through a buffer ring */
+    ur->ur_bufringlen = DNSR_URING_BUFS * sizeof(struct io_uring_buf);
+    if ((ur->ur_bufring = mmap(NULL, ur->ur_bufringlen, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+        ur->ur_bufring = NULL;
+        goto error;
+    }
+    if ((ur->ur_bufs = malloc(DNSR_URING_BUFS * DNSR_URING_BUFSIZE)) == NULL) {
+        goto error;
+    }
+    memset(&reg, 0, sizeof(struct io_uring_buf_reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)ur->ur_bufring;
+    reg.ring_entries = DNSR_URING_BUFS;
+    reg.bgid = 0;
+    /* Buffer rings are 5.19 */
+    if (sys_io_uring_register(ur->ur_fd, IORING_REGISTER_PBUF_RING, &reg, 1) !=
+            0) {
+        DEBUG(perror("io_uring_register"));
+        goto unsupported;
+    }
+    for (i = 0; i < DNSR_URING_BUFS; i++) {
+        dnsr_uring_putbuf(ur, i);
+    }
+
+    for (i = 0; i < DNSR_URING_SENDS; i++) {
+        ur->ur_sendfree[ i ] = i;
+    }
+    ur->ur_nsendfree = DNSR_URING_SENDS;
+
+    /* Post a receive on each socket.  A kernel without multishot receive,
+     * 6.0, fails them straight away.
+     */
+    ur->ur_sock[ 0 ] = dnsr->d_fd;
+    ur->ur_sock[ 1 ] = dnsr->d_fd6;
+    for (i = 0; i < 2; i++) {
+        if (ur->ur_sock[ i ] >= 0) {
+            dnsr_uring_arm(dnsr, i);
+        }
+    }
+    if (dnsr_uring_enter(dnsr, 0, 0) != 0) {
+        goto error;
+    }
+    dnsr_uring_reap(dnsr);
+    for (i = 0; i < 2; i++) {
+        if ((ur->ur_sock[ i ] >= 0) && !ur->ur_armed[ i ]) {
+            DEBUG(fprintf(stderr, "dnsr_uring_init: no multishot recvmsg\n"));
+            goto unsupported;
+        }
+    }
+
+    return 0;
+
+unsupported:
+    dnsr_uring_free(dnsr);
+    dnsr->d_errno = DNSR_ERROR_NOT_IMPLEMENTED;
+    return (-1);
+
+error:
+    DEBUG(perror("dnsr_uring_init"));
+    dnsr_uring_free(dnsr);
+    dnsr->d_errno = DNSR_ERROR_SYSTEM;
+    return (-1);
+}
+
+void
+dnsr_uring_free(DNSR *dnsr) {
+    struct dnsr_uring *ur;
+
+    if ((ur = dnsr->d_uring) == NULL) {
+        return;
+    }
+
+    /* Closing the ring cancels everything posted on it */
+    if (ur->ur_fd >= 0) {
+        close(ur->ur_fd);
+    }
+    if (ur->ur_sqes != NULL) {
+        munmap(ur->ur_sqes, ur->ur_sqeslen);
+    }
+    if ((ur->ur_cqmap != NULL) && (ur->ur_cqmap != ur->ur_sqmap)) {
+        munmap(ur->ur_cqmap, ur->ur_cqmaplen);
+    }
+    if (ur->ur_sqmap != NULL) {
+        munmap(ur->ur_sqmap, ur->ur_sqmaplen);
+    }
+    if (ur->ur_bufring != NULL) {
+        munmap(ur->ur_bufring, ur->ur_bufringlen);
+    }
+    free(ur->ur_bufs);
+    free(ur);
+    dnsr->d_uring = NULL;
+}
+
+/* The descriptor to watch for completions, for dnsr_fds( ) */
+int
+dnsr_uring_fd(DNSR *dnsr) {
+    return (dnsr->d_uring->ur_fd);
+}
+
+static void
+dnsr_uring_putbuf(struct dnsr_uring *ur, uint16_t bid) {
+    struct io_uring_buf *buf;
+
+    buf = &ur->ur_bufring->bufs[ ur->ur_buftail & (DNSR_URING_BUFS - 1) ];
+    buf->addr = (uint64_t)(uintptr_t)(ur->ur_bufs + bid * DNSR_URING_BUFSIZE);
+    buf->len = DNSR_URING_BUFSIZE;
+    buf->bid = bid;
+    ur->ur_buftail++;
+    __atomic_store_n(&ur->ur_bufring->tail, ur->ur_buftail, __ATOMIC_RELEASE);
+}
+
+/* Returns a free submission queue entry, submitting if the queue is full */
+static struct io_uring_sqe *
+dnsr_uring_sqe(DNSR *dnsr) {
+    struct dnsr_uring   *ur = dnsr->d_uring;
+    struct io_uring_sqe *sqe;
+    unsigned int         tail, head;
+
+    tail = *ur->ur_sqtail;
+    head = __atomic_load_n(ur->ur_sqhead, __ATOMIC_ACQUIRE);
+    if (tail - head >= ur->ur_sqentries) {
+        if (dnsr_uring_enter(dnsr, 0, 0) != 0) {
+            return (NULL);
+        }
+    }
+
+    sqe = &ur->ur_sqes[ tail & ur->ur_sqmask ];
+    memset(sqe, 0, sizeof(struct io_uring_sqe));
+    ur->ur_sqarray[ tail & ur->ur_sqmask ] = tail & ur->ur_sqmask;
+    __atomic_store_n(ur->ur_sqtail, tail + 1, __ATOMIC_RELEASE);
+    ur->ur_tosubmit++;
+    return (sqe);
+}
+
+/*
+ * Submits what is queued, and if wait is set waits upto ms milliseconds,
+ * or forever if ms is negative, for a completion.
+ */
+
+static int
+dnsr_uring_enter(DNSR *dnsr, int wait, int ms) {
+    struct dnsr_uring              *ur = dnsr->d_uring;
+    struct io_uring_getevents_arg   arg;
+    struct __kernel_timespec        ts;
+    unsigned int                    flags = 0;
+    int                             rc;
+
+    memset(&arg, 0, sizeof(struct io_uring_getevents_arg));
+    if (wait) {
+        flags |= IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG;
+        arg.sigmask_sz = _NSIG / 8;
+        if (ms >= 0) {
+            ts.tv_sec = ms / 1000;
+            ts.tv_nsec = (ms % 1000) * 1000000L;
+            arg.ts = (uint64_t)(uintptr_t)&ts;
+        }
+    }
+
+    if ((ur->ur_tosubmit == 0) && !wait) {
+        return 0;
+    }
+
+    if ((rc = sys_io_uring_enter(ur->ur_fd, ur->ur_tosubmit, wait ? 1 : 0,
+                 flags, wait ? &arg : NULL,
+                 wait ? sizeof(struct io_uring_getevents_arg) : 0)) < 0) {
+        if ((errno == ETIME) || (errno == EINTR) || (errno == EBUSY)) {
+            return 0;
+        }
+        DEBUG(perror("io_uring_enter"));
+        dnsr->d_errno = DNSR_ERROR_SYSTEM;
+        return (-1);
+    }
+    ur->ur_tosubmit -= rc;
+    return 0;
+}
+
+static void
+dnsr_uring_arm(DNSR *dnsr, int i) {
+    struct dnsr_uring   *ur = dnsr->d_uring;
+    struct io_uring_sqe *sqe;
+
+    if ((sqe = dnsr_uring_sqe(dnsr)) == NULL) {
+        return;
+    }
+
+    /* The kernel only reads the name and control lengths */
+    memset(&ur->ur_recvmsg[ i ], 0, sizeof(struct msghdr));
+    ur->ur_recvmsg[ i ].msg_namelen = sizeof(struct sockaddr_storage);
+
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = ur->ur_sock[ i ];
+    sqe->addr = (uint64_t)(uintptr_t)&ur->ur_recvmsg[ i ];
+    sqe->len = 1;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = 0;
+    sqe->user_data = (DNSR_URING_RECV << 32) | i;
+    ur->ur_armed[ i ] = 1;
+}
+
+/*
+ * Takes every completion off the ring.  Finished sends free their slot,
+ * received responses wait on the ready list for dnsr_uring_wait( ).
+ */
+
+static void
+dnsr_uring_reap(DNSR *dnsr) {
+    struct dnsr_uring      *ur = dnsr->d_uring;
+    struct io_uring_cqe    *cqe;
+    struct dnsr_uring_send *us;
+    unsigned int            head, tail;
+    int                     i;
+
+    head = *ur->ur_cqhead;
+    tail = __atomic_load_n(ur->ur_cqtail, __ATOMIC_ACQUIRE);
+
+    for (; head != tail; head++) {
+        cqe = &ur->ur_cqes[ head & ur->ur_cqmask ];
+        i = cqe->user_data & 0xffffffff;
+
+        switch (cqe->user_data >> 32) {
+        case DNSR_URING_SEND:
+            us = &ur->ur_sends[ i ];
+            if ((cqe->res < 0) && (us->us_pending != NULL)) {
+                DEBUG(fprintf(stderr, "uring send: %s\n", strerror(-cqe->res)));
+                dnsr_udp_failed(dnsr, us->us_pending, us->us_ns);
+            }
+            us->us_pending = NULL;
+            ur->ur_sendfree[ ur->ur_nsendfree++ ] = i;
+            break;
+
+        case DNSR_URING_RECV:
+            if (!(cqe->flags & IORING_CQE_F_MORE)) {
+                /* Out of buffers or an error, it has to be posted again */
+                ur->ur_armed[ i ] = 0;
+            }
+            if (cqe->flags & IORING_CQE_F_BUFFER) {
+                ur->ur_ready[ ur->ur_nready ] =
+                        cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+                ur->ur_readylen[ ur->ur_nready++ ] = cqe->res;
+            } else if (cqe->res < 0) {
+                DEBUG(fprintf(stderr, "uring recv: %s\n", strerror(-cqe->res)));
+            }
+            break;
+        }
+    }
+
+    __atomic_store_n(ur->ur_cqhead, head, __ATOMIC_RELEASE);
+}
+
+/*
+ * Hands queued queries to the kernel.  Each is copied, so the queue can be
+ * reused at once.  A send that fails finishes its query with
+ * DNSR_ERROR_SYSTEM when its completion is reaped.
+ */
+
+int
+dnsr_uring_send(DNSR *dnsr, struct dnsr_udpsend *sq, int count) {
+    struct dnsr_uring      *ur = dnsr->d_uring;
+    struct dnsr_uring_send *us;
+    struct io_uring_sqe    *sqe;
+    struct nsinfo          *ns;
+    int                     i, slot;
+
+    for (i = 0; i < count; i++) {
+        while (ur->ur_nsendfree == 0) {
+            if (dnsr_uring_enter(dnsr, 1, -1) != 0) {
+                return (-1);
+            }
+            dnsr_uring_reap(dnsr);
+        }
+        if ((sqe = dnsr_uring_sqe(dnsr)) == NULL) {
+            return (-1);
+        }
+
+        slot = ur->ur_sendfree[ --ur->ur_nsendfree ];
+        us = &ur->ur_sends[ slot ];
+        ns = &dnsr->d_nsinfo[ sq[ i ].s_ns ];
+        us->us_pending = sq[ i ].s_pending;
+        us->us_ns = sq[ i ].s_ns;
+        memcpy(us->us_buf, &sq[ i ].s_header, sizeof(struct dnsr_header));
+        memcpy(us->us_buf + sizeof(struct dnsr_header),
+                sq[ i ].s_pending->p_query + sizeof(struct dnsr_header),
+                sq[ i ].s_len - sizeof(struct dnsr_header));
+        us->us_iov.iov_base = us->us_buf;
+        us->us_iov.iov_len = sq[ i ].s_len;
+        memset(&us->us_msg, 0, sizeof(struct msghdr));
+        us->us_msg.msg_name = &ns->ns_sa;
+        us->us_msg.msg_namelen = (ns->ns_sa.ss_family == AF_INET)
+                                         ? sizeof(struct sockaddr_in)
+                                         : sizeof(struct sockaddr_in6);
+        us->us_msg.msg_iov = &us->us_iov;
+        us->us_msg.msg_iovlen = 1;
+
+        sqe->opcode = IORING_OP_SENDMSG;
+        sqe->fd = (ns->ns_sa.ss_family == AF_INET) ? dnsr->d_fd : dnsr->d_fd6;
+        sqe->addr = (uint64_t)(uintptr_t)&us->us_msg;
+        sqe->len = 1;
+        sqe->user_data = (DNSR_URING_SEND << 32) | slot;
+    }
+
+    return (dnsr_uring_enter(dnsr, 0, 0));
+}
+
+/* Drops p from sends still in flight, for when it is freed */
+void
+dnsr_uring_forget(DNSR *dnsr, struct dnsr_pending *p) {
+    int i;
+
+    for (i = 0; i < DNSR_URING_SENDS; i++) {
+        if (dnsr->d_uring->ur_sends[ i ].us_pending == p) {
+            dnsr->d_uring->ur_sends[ i ].us_pending = NULL;
+        }
+    }
+}
+
+/*
+ * Waits upto ms milliseconds for responses, or not at all if ms is zero,
+ * and hands every response received to dnsr_response( ).
+ *
+ * Return Values:
+ *      0       success
+ *      -1      error - check dnsr_errno
+ */
+
+int
+dnsr_uring_wait(DNSR *dnsr, int ms) {
+    struct dnsr_uring            *ur = dnsr->d_uring;
+    struct io_uring_recvmsg_out *out;
+    char                         *buf;
+    int                           i, len;
+
+    dnsr_uring_reap(dnsr);
+    if ((ur->ur_nready == 0) && (ms != 0)) {
+        if (dnsr_uring_enter(dnsr, 1, ms) != 0) {
+            return (-1);
+        }
+        dnsr_uring_reap(dnsr);
+    }
+
+    for (i = 0; i < ur->ur_nready; i++) {
+        buf = ur->ur_bufs + ur->ur_ready[ i ] * DNSR_URING_BUFSIZE;
+        out = (struct io_uring_recvmsg_out *)buf;
+        len = ur->ur_readylen[ i ];
+        if ((len >= sizeof(struct io_uring_recvmsg_out) +
+                                sizeof(struct sockaddr_storage)) &&
+                !(out->flags & MSG_TRUNC)) {
+            dnsr_response(dnsr,
+                    buf + sizeof(struct io_uring_recvmsg_out) +
+                            sizeof(struct sockaddr_storage),
+                    out->payloadlen,
+                    (struct sockaddr *)(buf +
+                                        sizeof(struct io_uring_recvmsg_out)));
+        }
+        dnsr_uring_putbuf(ur, ur->ur_ready[ i ]);
+    }
+    ur->ur_nready = 0;
+
+    for (i = 0; i < 2; i++) {
+        if ((ur->ur_sock[ i ] >= 0) && !ur->ur_armed[ i ]) {
+            dnsr_uring_arm(dnsr, i);
+        }
+    }
+
+    return (dnsr_uring_enter(dnsr, 0, 0));
+}
+
+#else /* HAVE_LINUX_IO_URING_H && IORING_RECV_MULTISHOT */
+
+int
+dnsr_uring_init(DNSR *dnsr) {
+    DEBUG(fprintf(stderr, "dnsr_uring_init: not built with io_uring\n"));
+    dnsr->d_errno = DNSR_ERROR_NOT_IMPLEMENTED;
+    return (-1);
+}
+
+void
+dnsr_uring_free(DNSR *dnsr) {
+}
+
+int
+dnsr_uring_fd(DNSR *dnsr) {
+    return (-1);
+}
+
+int
+dnsr_uring_send(DNSR *dnsr, struct dnsr_udpsend *sq, int count) {
+    dnsr->d_errno = DNSR_ERROR_NOT_IMPLEMENTED;
+    return (-1);
+}
+
+void
+dnsr_uring_forget(DNSR *dnsr, struct dnsr_pending *p) {
+}
+
+int
+dnsr_uring_wait(DNSR *dnsr, int ms) {
+    dnsr->d_errno = DNSR_ERROR_NOT_IMPLEMENTED;
+    return (-1);
+}
+
+#endif /* HAVE_LINUX_IO_URING_H && IORING_RECV_MULTISHOT */